@@ -0,0 +1,181 @@
+// arena.c - Scoped allocator for short-lived kernel memory
+//
+// An arena hands out memory by bumping a pointer through page-sized chunks
+// taken from the page allocator. Nothing is freed individually; everything is
+// given back by arena_release. Released chunks are kept on a small cache so
+// that the next arena does not pay for a page allocation (and the two page
+// clears done by memory_alloc_page and memory_free_page).
+//
+
+#ifndef TRACE
+#ifdef ARENA_TRACE
+#define TRACE
+#endif
+#endif
+
+#ifndef DEBUG
+#ifdef ARENA_DEBUG
+#define DEBUG
+#endif
+#endif
+
+#include "arena.h"
+
+#include "console.h"
+#include "halt.h"
+#include "memory.h"
+#include "spinlock.h"
+
+#include <stdint.h>
+
+// INTERNAL TYPE DEFINITIONS
+//
+
+struct arena_chunk {
+    struct arena_chunk * prev; // previously filled chunk of the same arena
+    uint64_t reserved; // keeps the payload 16-byte aligned
+};
+
+// INTERNAL MACRO DEFINITIONS
+//
+
+#define ARENA_ALIGN 16
+#define ARENA_CHUNK_MAX (PAGE_SIZE - sizeof(struct arena_chunk))
+
+// INTERNAL FUNCTION DECLARATIONS
+//
+
+static struct arena_chunk * chunk_get(void);
+static void chunk_put(struct arena_chunk * chunk);
+static unsigned long chunk_cache_scan(struct shrinker * shr, unsigned long nr);
+
+// INTERNAL GLOBAL VARIABLES
+//
+
+static struct arena_chunk * chunk_cache;
+static int chunk_cache_cnt;
+static struct spinlock chunk_cache_lock = SPINLOCK_INIT("arena");
+
+static struct shrinker chunk_cache_shrinker = {
+    .name = "arena",
+    .scan = chunk_cache_scan
+};
+
+// EXPORTED FUNCTION DEFINITIONS
+//
+
+void arena_init(void) {
+    memory_register_shrinker(&chunk_cache_shrinker);
+}
+
+void arena_begin(struct arena * ar) {
+    trace("%s(%p)", __func__, ar);
+    ar->chunk = NULL;
+    ar->used = PAGE_SIZE; // forces a chunk to be taken on first allocation
+}
+
+void * arena_alloc(struct arena * ar, size_t size) {
+    struct arena_chunk * chunk;
+    void * ptr;
+
+    trace("%s(%p,%zu)", __func__, ar, size);
+
+    size = (size + ARENA_ALIGN-1) / ARENA_ALIGN * ARENA_ALIGN;
+
+    if (ARENA_CHUNK_MAX < size)
+        panic("arena alloc request too large");
+
+    // Start a new chunk if the request does not fit in the current one. The
+    // tail of the old chunk is abandoned until the arena is released.
+
+    if (PAGE_SIZE - ar->used < size) {
+        chunk = chunk_get();
+        if (chunk == NULL)
+            return NULL;
+        chunk->prev = ar->chunk;
+        ar->chunk = chunk;
+        ar->used = sizeof(struct arena_chunk);
+    }
+
+    ptr = (void*)ar->chunk + ar->used;
+    ar->used += size;
+    return ptr;
+}
+
+void arena_release(struct arena * ar) {
+    struct arena_chunk * chunk;
+
+    trace("%s(%p)", __func__, ar);
+
+    while (ar->chunk != NULL) {
+        chunk = ar->chunk;
+        ar->chunk = chunk->prev;
+        chunk_put(chunk);
+    }
+
+    ar->used = PAGE_SIZE;
+}
+
+// INTERNAL FUNCTION DEFINITIONS
+//
+
+static struct arena_chunk * chunk_get(void) {
+    struct arena_chunk * chunk;
+    int pie;
+
+    pie = spin_lock_irqsave(&chunk_cache_lock);
+    chunk = chunk_cache;
+    if (chunk != NULL) {
+        chunk_cache = chunk->prev;
+        chunk_cache_cnt -= 1;
+    }
+    spin_unlock_irqrestore(&chunk_cache_lock, pie);
+
+    if (chunk == NULL)
+        chunk = memory_try_alloc_page();
+
+    debug("arena chunk %p taken", chunk);
+    return chunk;
+}
+
+static void chunk_put(struct arena_chunk * chunk) {
+    int pie;
+
+    pie = spin_lock_irqsave(&chunk_cache_lock);
+    if (chunk_cache_cnt < ARENA_CACHE_MAX) {
+        chunk->prev = chunk_cache;
+        chunk_cache = chunk;
+        chunk_cache_cnt += 1;
+        chunk = NULL;
+    }
+    spin_unlock_irqrestore(&chunk_cache_lock, pie);
+
+    if (chunk != NULL)
+        memory_free_page(chunk);
+}
+
+// Hands cached chunks back to the page allocator when it runs out of pages.
+
+static unsigned long chunk_cache_scan(struct shrinker * shr, unsigned long nr) {
+    struct arena_chunk * chunk;
+    unsigned long freed = 0;
+    int pie;
+
+    while (freed < nr) {
+        pie = spin_lock_irqsave(&chunk_cache_lock);
+        chunk = chunk_cache;
+        if (chunk != NULL) {
+            chunk_cache = chunk->prev;
+            chunk_cache_cnt -= 1;
+        }
+        spin_unlock_irqrestore(&chunk_cache_lock, pie);
+
+        if (chunk == NULL)
+            break;
+
+        memory_free_page(chunk);
+        freed += 1;
+    }
+
+    return freed;
+}
@@ -0,0 +1,57 @@
+// arena.h - Scoped allocator for short-lived kernel memory
+//
+
+#ifndef _ARENA_H_
+#define _ARENA_H_
+
+#include <stddef.h>
+
+// COMPILE-TIME CONFIGURATION
+//
+
+// Number of released chunks kept for reuse by later arenas instead of being
+// handed back to the page allocator.
+
+#ifndef ARENA_CACHE_MAX
+#define ARENA_CACHE_MAX 8
+#endif
+
+// EXPORTED TYPE DEFINITIONS
+//
+
+struct arena_chunk; // opaque
+
+struct arena {
+    struct arena_chunk * chunk; // chunk being allocated from (NULL if none)
+    size_t used; // bytes of chunk in use
+};
+
+// EXPORTED FUNCTION DECLARATIONS
+//
+
+// void arena_init(void)
+// Registers the chunk cache with the page allocator's shrinker list. Must be
+// called after memory_init.
+
+extern void arena_init(void);
+
+// void arena_begin(struct arena * ar)
+// Initializes an empty arena. No memory is taken until the first arena_alloc.
+
+extern void arena_begin(struct arena * ar);
+
+// void * arena_alloc(struct arena * ar, size_t size)
+// Allocates /size/ bytes from the arena, rounded up to a multiple of 16. The
+// memory is not zeroed and remains valid until arena_release is called.
+// Returns NULL if a new chunk is needed and no page is available. Panics if
+// the request does not fit in one page-sized chunk.
+
+extern void * arena_alloc(struct arena * ar, size_t size);
+
+// void arena_release(struct arena * ar)
+// Frees everything allocated from the arena at once. The arena is left empty
+// and may be used again.
+
+extern void arena_release(struct arena * ar);
+
+#endif // _ARENA_H_
@@ -17,6 +17,12 @@
 // PMA : Physical Memory Address
 // VMA : Virtual Memory Address
 
+// Maximum number of harts. Harts with a larger mhartid are parked in start.s.
+
+#ifndef NHART
+#define NHART 4
+#endif
+
 #define RAM_START_PMA 0x80000000 // QEMU
 #define RAM_START ((void*)RAM_START_PMA)
 #define RAM_END_PMA (RAM_START_PMA+RAM_SIZE)
@@ -30,6 +36,11 @@
 #define USER_END_VMA    0xD0000000UL // End of user program space
 #define USER_STACK_VMA  USER_END_VMA // starting user stack pointer
 
+// Kernel thread stacks live in the last gigabyte of the address space, which
+// is mapped the same way in every memory space.
+
+#define KSTACK_START_VMA 0xFFFFFFFFC0000000UL
+
 #define UART0_IOBASE 0x10000000 // PMA
 #define UART1_IOBASE 0x10000100 // PMA
 #define UART0_IRQNO 10
@@ -8,12 +8,18 @@
 
 #include "string.h"
 #include "intr.h"
+#include "spinlock.h"
 #include "uart.h"
 
 //           INTERNAL FUNCTION DECLARATIONS
 //           
 
 static void vprintf_putc(char c, void * aux);
+static size_t printf_nolock(const char * fmt, ...);
+
+// Keeps lines printed by different harts from being interleaved.
+
+static struct spinlock console_lock = SPINLOCK_INIT("console");
 
 //           EXPORTED GLOBAL VARIABLES
 //          
@@ -138,13 +144,11 @@ size_t console_vprintf(const char * fmt, va_list ap) {
 	int saved_intr_state;
   size_t nout;
 
-  if (intr_initialized)
-    saved_intr_state = intr_disable();
+  saved_intr_state = spin_lock_irqsave(&console_lock);
 
 	nout = vgprintf(vprintf_putc, NULL, fmt, ap);
 
-  if (intr_initialized)
-    intr_restore(saved_intr_state);
+  spin_unlock_irqrestore(&console_lock, saved_intr_state);
   
   return nout;
 }
@@ -158,18 +162,16 @@ void console_labeled_printf (
 	int saved_intr_state;
   va_list ap;
 
-  if (intr_initialized)
-    saved_intr_state = intr_disable();
+  saved_intr_state = spin_lock_irqsave(&console_lock);
 
-	console_printf("%s: %s:%d: ", label, src_flname, src_lineno);
+	printf_nolock("%s: %s:%d: ", label, src_flname, src_lineno);
 
 	va_start(ap, fmt);
-	console_vprintf(fmt, ap);
+	vgprintf(vprintf_putc, NULL, fmt, ap);
 	console_putchar('\n');
 	va_end(ap);
 
-  if (intr_initialized)
-    intr_restore(saved_intr_state);
+  spin_unlock_irqrestore(&console_lock, saved_intr_state);
 }
 
 
@@ -178,4 +180,14 @@ void console_labeled_printf (
 
 void vprintf_putc(char c, void * __attribute__ ((unused)) aux) {
 	console_putchar(c);
+}
+
+size_t printf_nolock(const char * fmt, ...) {
+	va_list ap;
+	size_t n;
+
+	va_start(ap, fmt);
+	n = vgprintf(vprintf_putc, NULL, fmt, ap);
+	va_end(ap);
+	return n;
 }
\ No newline at end of file
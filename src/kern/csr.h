@@ -212,7 +212,14 @@ static inline void csrs_sip(intptr_t mask) {
 }
 
 static inline void csrc_sip(intptr_t mask) {
-    asm inline ("csrrc %0, sip, %0" :: "r" (mask));
+    asm inline ("csrrc zero, sip, %0" :: "r" (mask));
+}
+
+static inline intptr_t csrr_sip(void) {
+    intptr_t val;
+
+    asm inline volatile ("csrr %0, sip" : "=r" (val));
+    return val;
 }
 
 // mstatus
@@ -246,6 +253,11 @@ static inline void csrc_mstatus(intptr_t mask) {
 #define RISCV_SSTATUS_SIE (1UL << 1)
 #define RISCV_SSTATUS_SPIE (1UL << 5)
 #define RISCV_SSTATUS_SPP (1UL << 8)
+#define RISCV_SSTATUS_FS (3UL << 13) // FP unit state (field)
+#define RISCV_SSTATUS_FS_OFF (0UL << 13)
+#define RISCV_SSTATUS_FS_INITIAL (1UL << 13)
+#define RISCV_SSTATUS_FS_CLEAN (2UL << 13)
+#define RISCV_SSTATUS_FS_DIRTY (3UL << 13)
 #define RISCV_SSTATUS_SUM (1UL << 18)
 
 static inline intptr_t csrr_sstatus(void) {
@@ -301,4 +313,18 @@ static inline uintptr_t csrrw_satp(uintptr_t satp_new) {
     return satp_old;
 }
 
+// time, cycle (enabled for S and U mode by mcounteren and scounteren)
+
+static inline uint64_t csrr_time(void) {
+    uint64_t time_cur;
+    asm inline volatile ("rdtime %0" : "=r" (time_cur));
+    return time_cur;
+}
+
+static inline uint64_t csrr_cycle(void) {
+    uint64_t cycle_cur;
+    asm inline volatile ("rdcycle %0" : "=r" (cycle_cur));
+    return cycle_cur;
+}
+
 #endif // _CSR_H_
\ No newline at end of file
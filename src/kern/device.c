@@ -6,6 +6,7 @@
 #include "halt.h"
 #include "string.h"
 #include "error.h"
+#include "lock.h"
 
 //           COMPILE-TIME PARAMETER DEFAULTS
 //          
@@ -33,10 +34,16 @@ struct device {
 
 struct device devtab[NDEV];
 
+// Drivers register devices while the kernel boots; after that, devtab is only
+// searched.
+
+static struct rwlock devtab_lock;
+
 //           EXPORTED FUNCTION DEFINITIONS
 //          
 
 void devmgr_init(void) {
+    rwlock_init(&devtab_lock, "devtab");
     devmgr_initialized = 1;
 }
 
@@ -51,6 +58,8 @@ int device_register (
     assert (name != NULL);
     assert (openfn != NULL);
 
+    rwlock_write_acquire(&devtab_lock);
+
 	//           Find empty slot in devtab
 
 	while (devno < NDEV) {
@@ -70,6 +79,8 @@ int device_register (
 	devtab[devno].openfn = openfn;
 	devtab[devno].aux = aux;
 
+    rwlock_write_release(&devtab_lock);
+
     debug("%s%d registered (openfn=%p,aux=%p)", name, instno, openfn, aux);
 
 	return instno;
@@ -80,11 +91,15 @@ int device_open (
     const char * name,
     int instno)
 {
+	int (*openfn)(struct io_intf ** ioptr, void * aux);
+	void * aux;
 	int devno = 0;
 	int k = 0;
 
 	trace("%s(name=%s,instno=%d)", __func__, name, instno);
 
+	rwlock_read_acquire(&devtab_lock);
+
 	//           Find instno-th instance of device in devtab
 
 	while (devno < NDEV) {
@@ -101,11 +116,17 @@ int device_open (
 	}
 
 	if (devno == NDEV) {
+		rwlock_read_release(&devtab_lock);
 		debug("Device %s%d not found", name, instno);
 		return -ENODEV;
 	} else
 		debug("%s%d is device %d", name, instno, devno);
 
-	//           Call driver's open function
-	return devtab[devno].openfn(ioptr, devtab[devno].aux);
+	openfn = devtab[devno].openfn;
+	aux = devtab[devno].aux;
+
+	rwlock_read_release(&devtab_lock);
+
+	//           Call driver's open function, which may sleep
+	return openfn(ioptr, aux);
 }
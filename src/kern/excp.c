@@ -4,8 +4,11 @@
 #include "trap.h"
 #include "csr.h"
 #include "halt.h"
+#include "intr.h"
 #include "memory.h"
+#include "process.h"
 #include "signals.h"
+#include "thread.h"
 
 #include <stddef.h>
 
@@ -73,6 +76,14 @@ void smode_excp_handler(unsigned int code, struct trap_frame * tfr) {
  * @returns     This funciton returns nothing.
  */
 void umode_excp_handler(unsigned int code, struct trap_frame * tfr) {
+    thread_acct_trap_enter();
+
+    // With kernel preemption the handler runs with interrupts enabled, so it
+    // can be preempted like a kernel thread (see intr_handler).
+
+    if (KERNEL_PREEMPT)
+        intr_enable();
+
     switch (code) {
     case RISCV_SCAUSE_INSTR_PAGE_FAULT: // instruction page fault
     case RISCV_SCAUSE_LOAD_PAGE_FAULT: // load page fault
@@ -83,12 +94,22 @@ void umode_excp_handler(unsigned int code, struct trap_frame * tfr) {
     case RISCV_SCAUSE_ECALL_FROM_UMODE:
         syscall_handler(tfr); // Pass trap frame to syscall handler
         break;
+    case RISCV_SCAUSE_ILLEGAL_INSTR:
+        if (!thread_fp_first_use(tfr))
+            default_excp_handler(code, tfr);
+        break;
     default:
         default_excp_handler(code, tfr);
         break;
     }
 
+    // Interrupts must be off again before _trap_entry_from_umode points stvec
+    // back at itself.
+
+    intr_disable();
+    process_check_exit();
     signal_deliver();
+    thread_acct_trap_exit();
 }
 
 void default_excp_handler (
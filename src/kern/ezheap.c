@@ -19,6 +19,7 @@
 #include "string.h"
 #include "halt.h"
 #include "memory.h"
+#include "spinlock.h"
 
 #include <stdint.h>
 
@@ -32,6 +33,7 @@ char heap_initialized = 0;
 
 static void * heap_start;
 static void * heap_end;
+static struct spinlock heap_lock = SPINLOCK_INIT("heap"); // heap_start, heap_end
 
 // EXPORTED FUNCTION DEFINITIONS
 //
@@ -46,6 +48,8 @@ void heap_init(void * start, void * end) {
 
 void * kmalloc(size_t size) {
     void * new_block;
+    void * ptr;
+    int pie;
 
     trace("%s(%zu)", __func__, size);
 
@@ -57,28 +61,43 @@ void * kmalloc(size_t size) {
     
     // If the request fits in the current heap block, allocate from it.
 
+    pie = spin_lock_irqsave(&heap_lock);
+
     if (size <= heap_end - heap_start) {
         heap_end -= size;
-        return heap_end;
+        ptr = heap_end;
+        spin_unlock_irqrestore(&heap_lock, pie);
+        return ptr;
     }
 
+    spin_unlock_irqrestore(&heap_lock, pie);
+
     // The request is no more than a page, but we don't have room for it in the
     // current block of heap memory. Get a direct-mapped page of physical memory
-    // from the memory manager.
+    // from the memory manager, failing if it has none left.
+
+    new_block = memory_try_alloc_page();
 
-    new_block = memory_alloc_page();
+    if (new_block == NULL)
+        return NULL;
 
     // Do we have more free space left if we abandon the current block and
     // switch to the new one, or just use the new block for this request and
-    // stay with the current block?
+    // stay with the current block? (Another hart may have switched blocks in
+    // the meantime; that only means some space is wasted.)
+
+    pie = spin_lock_irqsave(&heap_lock);
 
     if (heap_end - heap_start < PAGE_SIZE - size) {
         // switch to new block
         heap_start = new_block;
         heap_end = new_block + PAGE_SIZE - size;
-        return heap_end;
+        ptr = heap_end;
     } else
-        return new_block;
+        ptr = new_block;
+
+    spin_unlock_irqrestore(&heap_lock, pie);
+    return ptr;
 }
 
 void * kcalloc(size_t n, size_t size) {
@@ -90,7 +109,8 @@ void * kcalloc(size_t n, size_t size) {
         panic("heap alloc request too large");
 
     ptr = kmalloc(n * size);
-    memset(ptr, 0, n * size);
+    if (ptr != NULL)
+        memset(ptr, 0, n * size);
     return ptr;
 }
 
@@ -0,0 +1,208 @@
+// futex.c - Wait queues keyed by user memory words
+//
+
+#ifndef TRACE
+#ifdef FUTEX_TRACE
+#define TRACE
+#endif
+#endif
+
+#ifndef DEBUG
+#ifdef FUTEX_DEBUG
+#define DEBUG
+#endif
+#endif
+
+#include "futex.h"
+
+#include "console.h"
+#include "error.h"
+#include "memory.h"
+#include "process.h"
+#include "spinlock.h"
+#include "thread.h"
+
+#include <stddef.h>
+
+#if (FUTEX_NBUCKET & (FUTEX_NBUCKET - 1)) != 0
+#error "FUTEX_NBUCKET must be a power of two"
+#endif
+
+// INTERNAL TYPE DEFINITIONS
+//
+
+// A waiting thread, on its own stack. Each waiter has a condition of its own,
+// so futex_wake can wake exactly the threads it takes off the queue.
+
+struct futex_waiter {
+    struct futex_waiter * next;
+    uintptr_t key; // physical address of the word
+    struct process * proc; // process of the waiting thread
+    struct condition cond;
+    char woken; // taken off the queue by futex_wake or futex_cancel
+    char canceled; // taken off the queue by futex_cancel
+};
+
+// Waiters for all words that hash to the same bucket, oldest first
+
+struct futex_bucket {
+    struct spinlock lock;
+    struct futex_waiter * head;
+};
+
+// INTERNAL GLOBAL VARIABLES
+//
+
+static struct futex_bucket futex_table[FUTEX_NBUCKET];
+
+// INTERNAL FUNCTION DECLARATIONS
+//
+
+static struct futex_bucket * futex_bucket(uintptr_t key);
+
+// EXPORTED FUNCTION DEFINITIONS
+//
+
+int futex_wait(const int * uaddr, int val, uint64_t tcnt) {
+    struct futex_waiter ** link;
+    struct futex_waiter w;
+    struct futex_bucket * b;
+    int result;
+    int pie;
+
+    trace("%s(uaddr=%p,val=%d,tcnt=%lu)", __func__, uaddr, val, tcnt);
+
+    if ((uintptr_t)uaddr % sizeof(int) != 0)
+        return -EINVAL;
+
+    w.key = memory_virt_to_phys(uaddr, PTE_R | PTE_U);
+    if (w.key == 0)
+        return -EINVAL;
+
+    w.next = NULL;
+    w.proc = current_process();
+    w.woken = 0;
+    w.canceled = 0;
+    condition_init(&w.cond, "futex");
+    b = futex_bucket(w.key);
+
+    pie = spin_lock_irqsave(&b->lock);
+
+    if (*(volatile const int *)uaddr != val) {
+        spin_unlock_irqrestore(&b->lock, pie);
+        return -EAGAIN;
+    }
+
+    // futex_cancel sets exiting before it looks at any bucket, so either it
+    // finds us on the queue or we see the flag here.
+
+    if (w.proc != NULL && w.proc->exiting) {
+        spin_unlock_irqrestore(&b->lock, pie);
+        return -EINTR;
+    }
+
+    for (link = &b->head; *link != NULL; link = &(*link)->next)
+        continue;
+    *link = &w;
+
+    // Only futex_wake and futex_cancel signal w.cond, and they set w.woken
+    // first.
+
+    if (tcnt == 0) {
+        while (!w.woken)
+            condition_wait_spin(&w.cond, &b->lock);
+    } else
+        condition_wait_timeout(&w.cond, &b->lock, tcnt);
+
+    if (w.canceled)
+        result = -EINTR;
+    else if (w.woken)
+        result = 0;
+    else {
+        for (link = &b->head; *link != &w; link = &(*link)->next)
+            continue;
+        *link = w.next;
+        result = -ETIMEDOUT;
+    }
+
+    spin_unlock_irqrestore(&b->lock, pie);
+    return result;
+}
+
+int futex_wake(const int * uaddr, int cnt) {
+    struct futex_waiter ** link;
+    struct futex_waiter * w;
+    struct futex_bucket * b;
+    uintptr_t key;
+    int n = 0;
+    int pie;
+
+    trace("%s(uaddr=%p,cnt=%d)", __func__, uaddr, cnt);
+
+    if ((uintptr_t)uaddr % sizeof(int) != 0)
+        return -EINVAL;
+
+    // A word that is not mapped cannot have waiters.
+
+    key = memory_virt_to_phys(uaddr, PTE_U);
+    if (key == 0)
+        return 0;
+
+    b = futex_bucket(key);
+    pie = spin_lock_irqsave(&b->lock);
+
+    link = &b->head;
+
+    while (*link != NULL && n < cnt) {
+        w = *link;
+
+        if (w->key == key) {
+            *link = w->next;
+            w->woken = 1;
+            condition_signal(&w->cond);
+            n += 1;
+        } else
+            link = &w->next;
+    }
+
+    spin_unlock_irqrestore(&b->lock, pie);
+
+    debug("futex_wake(%p): woke %d", uaddr, n);
+    return n;
+}
+
+void futex_cancel(struct process * proc) {
+    struct futex_waiter ** link;
+    struct futex_waiter * w;
+    struct futex_bucket * b;
+    int pie;
+
+    trace("%s(pid=%d)", __func__, proc->id);
+
+    for (b = futex_table; b < futex_table + FUTEX_NBUCKET; b++) {
+        pie = spin_lock_irqsave(&b->lock);
+
+        link = &b->head;
+
+        while (*link != NULL) {
+            w = *link;
+
+            if (w->proc == proc) {
+                *link = w->next;
+                w->woken = 1;
+                w->canceled = 1;
+                condition_signal(&w->cond);
+            } else
+                link = &w->next;
+        }
+
+        spin_unlock_irqrestore(&b->lock, pie);
+    }
+}
+
+// INTERNAL FUNCTION DEFINITIONS
+//
+
+struct futex_bucket * futex_bucket(uintptr_t key) {
+    return &futex_table[((key >> 2) ^ (key >> 12)) % FUTEX_NBUCKET];
+}
@@ -0,0 +1,53 @@
+// futex.h - Wait queues keyed by user memory words
+//
+// A futex lets user threads that share memory sleep until another thread
+// changes a word and wakes them, instead of polling the word. Waiting threads
+// are kept in a hash table of wait queues keyed by the physical address of the
+// word, so every thread that maps the word sees the same futex.
+//
+
+#ifndef _FUTEX_H_
+#define _FUTEX_H_
+
+#include <stdint.h>
+
+struct process; // forward decl.
+
+// COMPILE-TIME PARAMETERS
+//
+
+// Number of wait queues in the hash table. Must be a power of two.
+
+#ifndef FUTEX_NBUCKET
+#define FUTEX_NBUCKET 64
+#endif
+
+// EXPORTED FUNCTION DECLARATIONS
+//
+
+// int futex_wait(const int * uaddr, int val, uint64_t tcnt)
+// If the user word at /uaddr/ still holds /val/, sleeps until futex_wake is
+// called for the word or, if /tcnt/ is not 0, until /tcnt/ timer ticks have
+// passed. The word is compared with the wait queue locked, so a wake-up that
+// follows a change of the word cannot be missed. Returns 0 if woken, -EAGAIN if
+// the word did not hold /val/, -ETIMEDOUT if the timeout expired, or -EINVAL if
+// /uaddr/ is misaligned or not readable from U mode, or -EINTR if the wait was
+// ended by futex_cancel.
+
+extern int futex_wait(const int * uaddr, int val, uint64_t tcnt);
+
+// int futex_wake(const int * uaddr, int cnt)
+// Wakes up to /cnt/ threads waiting on the user word at /uaddr/, longest
+// waiting first. Returns the number of threads woken, or -EINVAL if /uaddr/ is
+// misaligned.
+
+extern int futex_wake(const int * uaddr, int cnt);
+
+// void futex_cancel(struct process * proc)
+// Wakes every thread of /proc/ that is waiting on a futex, and makes their
+// futex_wait return -EINTR. Threads of /proc/ that call futex_wait after
+// proc->exiting is set return -EINTR at once. Used when the process exits.
+
+extern void futex_cancel(struct process * proc);
+
+#endif // _FUTEX_H_
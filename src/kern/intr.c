@@ -14,7 +14,10 @@
 #include "halt.h"
 #include "csr.h"
 #include "plic.h"
+#include "process.h"
 #include "timer.h"
+#include "smp.h"
+#include "schedtrace.h"
 
 #include <stddef.h>
 
@@ -54,7 +57,7 @@ void intr_init(void) {
     plic_init();
 
     csrw_sip(0); // clear all pending interrupts
-    csrw_sie(RISCV_SIE_SEIE); //enable interrupts from plic
+    csrw_sie(RISCV_SIE_SEIE | RISCV_SIE_SSIE); // plic and IPIs
 
     intr_initialized = 1;
 }
@@ -88,24 +91,52 @@ void intr_disable_irq(int irqno) {
 
 // void intr_handler(int code, struct trap_frame * tfr)
 // Called from trapasm.s to handle an interrupt. Dispataches to
-// timer_intr_handler and extern_intr_handler.
+// timer_intr_handler, extern_intr_handler and smp_ipi_handler.
 
 void intr_handler(int code, struct trap_frame * tfr) {
+    const int from_umode = ((tfr->sstatus & RISCV_SSTATUS_SPP) == 0);
+    struct hart * const h = this_hart();
+
+    if (from_umode)
+        thread_acct_trap_enter();
+
+    schedtrace(SCHEDTRACE_INTR_ENTER, running_thread(), code);
+
+    // Threads woken while in_intr is set are handed the CPU when we return
+    // (see wake_locked in thread.c).
+
+    h->in_intr = 1;
+
     switch (code) {
     case RISCV_SCAUSE_INTR_EXCODE_STI:
-        timer_intr_handler(tfr);
+        if (timer_intr_handler(tfr))
+            thread_tick();
     case RISCV_SCAUSE_INTR_EXCODE_SEI:
         extern_intr_handler();
         break;
+    case RISCV_SCAUSE_INTR_EXCODE_SSI:
+        smp_ipi_handler();
+        break;
     default:
         panic("unhandled interrupt");
         break;
     }
 
-    // If we were running user mode, yield thread.
+    h->in_intr = 0;
+
+    schedtrace(SCHEDTRACE_INTR_EXIT, running_thread(), code);
+
+    // If we were running user mode, or kernel code with kernel preemption
+    // enabled, let the scheduler decide whether to switch threads. A thread
+    // preempted in S mode resumes here and returns through
+    // _trap_entry_from_smode, possibly on another hart.
 
-    if ((tfr->sstatus & RISCV_SSTATUS_SPP) == 0)
-        thread_yield();
+    if (from_umode) {
+        thread_preempt();
+        process_check_exit();
+        thread_acct_trap_exit();
+    } else if (KERNEL_PREEMPT)
+        thread_preempt();
 }
 
 // INTERNAL FUNCTION DEFINITIONS
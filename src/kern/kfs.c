@@ -89,9 +89,8 @@ struct io_intf * vioblk_io;
 char fs_initialized;
 struct boot_block_t boot_block;
 struct file_struct file_structs[FS_MAXOPEN];
-inode_t inode;
-data_block_t data_block;
-static struct lock fs_lock;
+static struct lock fs_lock; // protects file_structs and the device position
+static struct rwlock dir_lock; // protects boot_block and fs_initialized
 
 /**
  * fs_mount - Initializes the filesystem for use.
@@ -102,16 +101,23 @@ static struct lock fs_lock;
  *                      Errors include already initialized filesystem or I/O issues.
  */
 int fs_mount(struct io_intf* blkio) {
-    // Initialize lock 
+    // Initialize locks
     lock_init(&fs_lock, "Filesystem Lock");
+    rwlock_init(&dir_lock, "Directory Lock");
     
     // store the block device interface
     vioblk_io = blkio;
 
 
+    // the boot block is only written here, so fs_open can search it with
+    // dir_lock held for reading
+    rwlock_write_acquire(&dir_lock);
+
+
     // check if fs has already been initialized
     if (fs_initialized) {
         console_printf("fs_is already initialized\n");
+        rwlock_write_release(&dir_lock);
         return -1;
     }
 
@@ -120,6 +126,7 @@ int fs_mount(struct io_intf* blkio) {
     uint64_t offset = 0;
     if (vioblk_io->ops->ctl(vioblk_io, IOCTL_SETPOS, &offset) != 0) {
         console_printf("issue setting block device offset to 0\n");
+        rwlock_write_release(&dir_lock);
         return -1;
     }
 
@@ -127,6 +134,7 @@ int fs_mount(struct io_intf* blkio) {
     // attempt to read bootblock
     if (ioread(blkio, (void *)&boot_block, FS_BLKSZ) < 0) {
         console_printf("error: failed to read bootblock\n");
+        rwlock_write_release(&dir_lock);
         return -1;
     }
 
@@ -134,11 +142,13 @@ int fs_mount(struct io_intf* blkio) {
     console_printf("boot block read successfully, inodes: %u, data blocks: %u\n", boot_block.num_inodes, boot_block.num_data);
 
 
-    // mark fs as initialized
-    fs_initialized = 1;
-   
     // init file structs array
     memset(file_structs, 0, sizeof(file_structs));
+
+    // mark fs as initialized
+    fs_initialized = 1;
+
+    rwlock_write_release(&dir_lock);
     return 0;
 }
 
@@ -158,34 +168,14 @@ int fs_mount(struct io_intf* blkio) {
  *                      or file not found in directory entries.
  */
 int fs_open(const char* name, struct io_intf** ioptr) {
-    // Acquire the lock
-    lock_acquire(&fs_lock);
+    // Acquire the directory lock for reading; lookups do not exclude each
+    // other, only fs_mount
+    rwlock_read_acquire(&dir_lock);
 
     // check if file system is initialized before calling open
     if (!fs_initialized) {
         console_printf("filesystem not initialized\n");
-        lock_release(&fs_lock); // Release the lock before returning 
-        return -1;
-    }
-
-
-    // new file
-    struct file_struct * file = NULL;
-
-
-    for (int i = 0; i < FS_MAXOPEN; i++) {
-        if (file_structs[i].flags == 0) {
-            file = &file_structs[i];
-            console_printf("found available slot at index %d\n", i);
-            break;
-        }
-    }
-
-
-    // check if we found a valid file slot
-    if (file == NULL) {
-        console_printf("no available file slots\n");
-        lock_release(&fs_lock);
+        rwlock_read_release(&dir_lock); // Release the lock before returning 
         return -1;
     }
 
@@ -210,6 +200,35 @@ int fs_open(const char* name, struct io_intf** ioptr) {
 
     if (!dentry) {
         console_printf("file not found in directory entries\n");
+        rwlock_read_release(&dir_lock);
+        return -1;
+    }
+
+
+    uint32_t inode_number = dentry->inode;
+    rwlock_read_release(&dir_lock);
+
+
+    // Acquire the lock for the file slot and the device position
+    lock_acquire(&fs_lock);
+
+
+    // new file
+    struct file_struct * file = NULL;
+
+
+    for (int i = 0; i < FS_MAXOPEN; i++) {
+        if (file_structs[i].flags == 0) {
+            file = &file_structs[i];
+            console_printf("found available slot at index %d\n", i);
+            break;
+        }
+    }
+
+
+    // check if we found a valid file slot
+    if (file == NULL) {
+        console_printf("no available file slots\n");
         lock_release(&fs_lock);
         return -1;
     }
@@ -217,7 +236,7 @@ int fs_open(const char* name, struct io_intf** ioptr) {
 
     // set file position
     file->file_position = 0;
-    file->inode_number = dentry->inode;
+    file->inode_number = inode_number;
 
 
     // set position to inode start
@@ -229,7 +248,8 @@ int fs_open(const char* name, struct io_intf** ioptr) {
     }
 
 
-    // read inode data
+    // read inode data into a buffer on our own stack
+    inode_t inode;
     uint64_t bytes_read = vioblk_io->ops->read(vioblk_io, &inode, sizeof(struct inode_t));
     if (bytes_read != sizeof(struct inode_t)) {
         console_printf("can't read inode\n");
@@ -345,6 +365,9 @@ long fs_write(struct io_intf* io, const void* buf, unsigned long n) {
 
 
     // read the inode
+    inode_t inode;
+    data_block_t data_block;
+
     if (vioblk_io->ops->ctl(vioblk_io, IOCTL_SETPOS, &inode_offset) != 0) {
     lock_release(&fs_lock); // Release lock before returning
         return -1; // Error setting position
@@ -495,6 +518,9 @@ long fs_read(struct io_intf* io, void* buf, unsigned long n)
 
 
     // read the inode
+    inode_t inode;
+    data_block_t data_block;
+
     if (vioblk_io->ops->ctl(vioblk_io, IOCTL_SETPOS, &inode_offset) != 0) {
         lock_release(&fs_lock);
         return -1; // Error setting position
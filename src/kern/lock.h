@@ -1,80 +1,103 @@
-// lock.h - A sleep lock
+// lock.h - Sleep locks
+//
+// Ownership is passed directly from the releasing thread to the thread that
+// has waited longest, so a release wakes at most one thread and waiters
+// acquire the lock in FIFO order (unless the kernel is built with
+// LOCK_HANDOFF=0; see thread.c). Locks are not recursive.
+//
+// A reader-writer lock (struct rwlock) is for data that is looked up much
+// more often than it is changed. Any number of readers may hold it at once,
+// or a single writer. It prefers writers: once a writer is waiting, new
+// readers wait behind it, and a writer releasing the lock hands it to the
+// next writer before admitting the readers that queued up. As with struct
+// lock, a releasing thread hands the lock over to the threads it wakes.
 //
-
-#ifdef LOCK_TRACE
-#define TRACE
-#endif
-
-#ifdef LOCK_DEBUG
-#define DEBUG
-#endif
 
 #ifndef _LOCK_H_
 #define _LOCK_H_
 
 #include "thread.h"
-#include "halt.h"
-#include "console.h"
-#include "intr.h"
+#include "spinlock.h"
 
 struct lock {
-    struct condition cond;
+    struct condition cond; // threads waiting for the lock, oldest first
+    struct spinlock guard; // protects tid
     int tid; // thread holding lock or -1
 };
 
+struct rwlock {
+    struct condition readers; // readers waiting for writers to finish
+    struct condition writers; // writers waiting, oldest first
+    struct spinlock guard; // protects nread and writing
+    int nread; // readers holding the lock
+    char writing; // held by a writer
+};
+
+// EXPORTED FUNCTION DECLARATIONS
+//
+
+// void lock_init(struct lock * lk, const char * name)
+// Initializes an unlocked lock.
+
 static inline void lock_init(struct lock * lk, const char * name);
-static inline void lock_acquire(struct lock * lk);
-static inline void lock_release(struct lock * lk);
+
+// void lock_acquire(struct lock * lk)
+// Acquires /lk/, sleeping until it is handed over if another thread holds it.
+// It is an error (and causes a panic) to acquire a lock the running thread
+// already holds. (Defined in thread.c.)
+
+extern void lock_acquire(struct lock * lk);
+
+// int lock_try_acquire(struct lock * lk)
+// Acquires /lk/ if it is free and returns 1; otherwise returns 0 immediately.
+// Does not sleep, but must not be called from an ISR.
+
+extern int lock_try_acquire(struct lock * lk);
+
+// void lock_release(struct lock * lk)
+// Releases /lk/, which the running thread must hold. If threads are waiting,
+// the one that has waited longest becomes the owner and is made ready.
+
+extern void lock_release(struct lock * lk);
+
+// void rwlock_init(struct rwlock * rw, const char * name)
+// Initializes an unlocked reader-writer lock.
+
+static inline void rwlock_init(struct rwlock * rw, const char * name);
+
+// void rwlock_read_acquire(struct rwlock * rw)
+// void rwlock_read_release(struct rwlock * rw)
+// Acquire and release /rw/ for reading. Acquiring sleeps while a writer holds
+// the lock or is waiting for it. (Defined in thread.c.)
+
+extern void rwlock_read_acquire(struct rwlock * rw);
+extern void rwlock_read_release(struct rwlock * rw);
+
+// void rwlock_write_acquire(struct rwlock * rw)
+// void rwlock_write_release(struct rwlock * rw)
+// Acquire and release /rw/ for writing. Acquiring sleeps until no reader or
+// other writer holds the lock. Writers do not nest, and the lock does not
+// record which thread holds it. May be called before thread_init as long as
+// the lock is free. (Defined in thread.c.)
+
+extern void rwlock_write_acquire(struct rwlock * rw);
+extern void rwlock_write_release(struct rwlock * rw);
 
 // INLINE FUNCTION DEFINITIONS
 //
 
 static inline void lock_init(struct lock * lk, const char * name) {
-    trace("%s(<%s:%p>", __func__, name, lk);
     condition_init(&lk->cond, name);
+    spinlock_init(&lk->guard, name);
     lk->tid = -1;
 }
 
-/**
- * lock_acquire - Acquires a lock, ensuring mutual exclusion.
- *
- * This function attempts to acquire the given lock. If the lock is already held,
- * the calling thread is put to sleep until the lock becomes available.
- *
- * @param lk: Pointer to the lock to acquire.
- */
-
-static inline void lock_acquire(struct lock * lk) {
-    trace("%s(<%s:%p>)", __func__, lk->cond.name, lk);
-
-    while(1){
-        int intr_state = intr_disable();
-
-        if(lk->tid == -1) {
-            lk->tid = running_thread();
-            intr_restore(intr_state);
-            debug("Thread <%s:%d> acquired lock <%s:%p>", 
-                thread_name(running_thread()), running_thread(),
-                lk->cond.name, lk);
-            return;
-        }
-
-        // Wait if lock is held
-        condition_wait(&lk->cond);
-    }
-}
-
-static inline void lock_release(struct lock * lk) {
-    trace("%s(<%s:%p>", __func__, lk->cond.name, lk);
-
-    assert (lk->tid == running_thread());
-    
-    lk->tid = -1;
-    condition_broadcast(&lk->cond);
-
-    debug("Thread <%s:%d> released lock <%s:%p>",
-        thread_name(running_thread()), running_thread(),
-        lk->cond.name, lk);
+static inline void rwlock_init(struct rwlock * rw, const char * name) {
+    condition_init(&rw->readers, name);
+    condition_init(&rw->writers, name);
+    spinlock_init(&rw->guard, name);
+    rw->nread = 0;
+    rw->writing = 0;
 }
 
-#endif // _LOCK_H_
\ No newline at end of file
+#endif // _LOCK_H_
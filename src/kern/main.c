@@ -19,6 +19,7 @@
 #include "intr.h"
 #include "memory.h"
 #include "heap.h"
+#include "arena.h"
 #include "virtio.h"
 #include "halt.h"
 #include "elf.h"
@@ -26,6 +27,9 @@
 #include "string.h"
 #include "process.h"
 #include "config.h"
+#include "smp.h"
+#include "schedtrace.h"
+#include "workq.h"
 
 
 void main(void) {
@@ -37,9 +41,12 @@ void main(void) {
 
     console_init();
     memory_init();
+    arena_init();
     intr_init();
     devmgr_init();
+    schedtrace_init();
     thread_init();
+    workq_init();
     procmgr_init();
     timer_init();
 
@@ -59,6 +66,10 @@ void main(void) {
         virtio_attach(mmio_base, VIRT0_IRQNO+i);
     }
 
+    // Bring up the other harts
+
+    smp_init();
+
     intr_enable();
 
     result = device_open(&blkio, "blk", 0);
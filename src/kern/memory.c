@@ -24,7 +24,12 @@
 #include "error.h"
 #include "thread.h"
 #include "process.h"
+#include "intr.h"
+#include "smp.h"
+#include "spinlock.h"
+#include "workq.h"
 
+#include <limits.h>
 #include <stdint.h>
 
 // EXPORTED VARIABLE DEFINITIONS
@@ -63,6 +68,14 @@ union linked_page {
 #define VPN0(vma) (((vma) >> 12) & 0x1FF)
 #define MIN(a,b) (((a)<(b))?(a):(b))
 
+// Each kernel stack slot is a guard page followed by the stack itself
+
+#define KSTACK_SLOT_SIZE ((KSTACK_PAGES + 1) * PAGE_SIZE)
+
+#if KSTACK_SLOTS * (KSTACK_PAGES + 1) > (1 << 18)
+#error "Kernel stack slots do not fit in the kernel stack region"
+#endif
+
 // INTERNAL FUNCTION DECLARATIONS
 //
 struct pte * walk_pt(struct pte* root, uintptr_t vma, int create);
@@ -92,6 +105,22 @@ static inline struct pte leaf_pte (
 static inline struct pte ptab_pte (
     const struct pte * ptab, uint_fast8_t g_flag);
 static inline struct pte null_pte(void);
+static inline struct pte napot_pte (
+    const void * pptr, uint_fast8_t rwxug_flags);
+static inline void * pte_pageptr(const struct pte * pte, uintptr_t vma);
+
+static void * alloc_napot_block(void);
+static int map_napot_block(struct pte * pte, uint_fast8_t rwxug_flags);
+static void napot_split(struct pte * pte, uintptr_t vma);
+
+static unsigned long shrink_free_list(unsigned long nr);
+static void kstack_unmap(uintptr_t base, void ** pages);
+static void kstack_slot_put(int slot);
+static void kstack_flush(struct work * wk);
+static void free_user_space(struct pte * root);
+static int free_user_pages (
+    struct pte * root, uintptr_t * vmap, unsigned long nr);
+static void free_user_tables(struct pte * root);
 
 static inline void sfence_vma(void);
 
@@ -99,6 +128,18 @@ static inline void sfence_vma(void);
 //
 
 static union linked_page * free_list;
+static unsigned long free_page_cnt; // pages on free_list
+static unsigned long total_page_cnt; // pages handed to the allocator at boot
+static struct shrinker * shrinker_list;
+static char shrinking; // set while shrinkers run, to stop recursion
+
+// page_lock protects free_list and free_page_cnt. kstack_lock protects
+// kstack_map, kstack_stale and the kernel stack page tables. Neither is held
+// while calling shrinkers or memset, so no page is allocated or freed with
+// kstack_lock held.
+
+static struct spinlock page_lock = SPINLOCK_INIT("page");
+static struct spinlock kstack_lock = SPINLOCK_INIT("kstack");
 
 static struct pte main_pt2[PTE_CNT]
     __attribute__ ((section(".bss.pagetable"), aligned(4096)));
@@ -106,6 +147,12 @@ static struct pte main_pt1_0x80000[PTE_CNT]
     __attribute__ ((section(".bss.pagetable"), aligned(4096)));
 static struct pte main_pt0_0x80000[PTE_CNT]
     __attribute__ ((section(".bss.pagetable"), aligned(4096)));
+static struct pte main_pt1_kstack[PTE_CNT]
+    __attribute__ ((section(".bss.pagetable"), aligned(4096)));
+
+static uint64_t kstack_map[(KSTACK_SLOTS + 63) / 64]; // slots in use
+static uint64_t kstack_stale[(KSTACK_SLOTS + 63) / 64]; // unmapped, awaiting flush
+static struct work kstack_flush_work; // runs kstack_flush
 
 // EXPORTED VARIABLE DEFINITIONS
 //
@@ -134,6 +181,8 @@ void memory_init(void) {
     size_t page_cnt;
     uintptr_t pma;
     const void * pp;
+    struct pt_cursor cur;
+    uintptr_t vma;
 
     trace("%s()", __func__);
 
@@ -194,6 +243,12 @@ void memory_init(void) {
             leaf_pte(pp, PTE_R | PTE_W | PTE_G);
     }
 
+    // Kernel stack region. The second-level table is created now so that the
+    // global root entry copied into cloned spaces already points at it; stacks
+    // mapped later show up in every space.
+
+    main_pt2[VPN2(KSTACK_START_VMA)] = ptab_pte(main_pt1_kstack, PTE_G);
+
     // Enable paging. This part always makes me nervous.
 
     main_mtag =  // Sv39
@@ -244,6 +299,8 @@ void memory_init(void) {
         free_list = page;
     }
 
+    free_page_cnt = page_cnt;
+    total_page_cnt = page_cnt;
 
     // Allow supervisor to access user memory. We could be more precise by only
     // enabling it when we are accessing user memory, and disable it at other
@@ -251,28 +308,74 @@ void memory_init(void) {
 
     csrs_sstatus(RISCV_SSTATUS_SUM);
 
+    // Create the level 0 tables of the kernel stack region now, so that
+    // memory_alloc_kstack never needs a page table under kstack_lock.
+
+    pt_cursor_init(&cur, main_pt2, 1);
+
+    for (vma = KSTACK_START_VMA;
+        vma < KSTACK_START_VMA + KSTACK_SLOTS * KSTACK_SLOT_SIZE;
+        vma += MEGA_SIZE)
+    {
+        if (pt_cursor_seek(&cur, vma) == NULL)
+            panic("no memory for kernel stack page tables");
+    }
+
+    work_init(&kstack_flush_work, kstack_flush);
+
     memory_initialized = 1;
 }
 
 
 
+/**
+ * Allocates a zeroed memory page, panicking if none can be found.
+ * 
+ * @return Pointer to the allocated memory page.
+ */
+void *memory_alloc_page(void) {
+    void *page;
+
+    page = memory_try_alloc_page();
+
+    if (page == NULL)
+        panic("no free pages in free_list: memory_alloc_page");
+
+    return page;
+}
+
+
+
 /**
  * Allocates a zeroed memory page from the free list.
  * 
+ * If the free list is empty, the registered shrinkers are asked to give pages
+ * back before giving up.
+ * 
  * @return Pointer to the allocated memory page, or NULL on failure.
  */
-void *memory_alloc_page(void) {
+void *memory_try_alloc_page(void) {
     union linked_page *page;
+    int pie;
+
+    for (;;) {
+        // Remove the first page from the free list
+        pie = spin_lock_irqsave(&page_lock);
+        page = free_list;
+        if (page != NULL) {
+            free_list = page->next;
+            free_page_cnt -= 1;
+        }
+        spin_unlock_irqrestore(&page_lock, pie);
 
-    // Ensure the free list exists
-    if (free_list == NULL) {
-        panic("no free pages in free_list: memory_alloc_page");
-        return NULL;
-    }
+        if (page != NULL)
+            break;
 
-    // Remove the first page from the free list
-    page = free_list;
-    free_list = free_list->next;
+        // Free list is empty. Another hart may take what the shrinkers free
+        // before we get to it, so go around again.
+        if (shrink_free_list(1) == 0)
+            return NULL;
+    }
 
     // Zero out the page
     memset((void *)page, 0, PAGE_SIZE);
@@ -283,6 +386,175 @@ void *memory_alloc_page(void) {
 
 
 
+/**
+ * Reports how many pages the page allocator manages and how many are free.
+ * 
+ * @param stats     filled in with the current counts
+ */
+void memory_get_stats(struct memory_stats * stats) {
+    stats->total_pages = total_page_cnt;
+    stats->free_pages = free_page_cnt;
+}
+
+
+
+/**
+ * Allocates and maps a kernel thread stack.
+ * 
+ * Takes a free slot in the kernel stack region and maps KSTACK_PAGES fresh
+ * pages at the top of it. The first page of the slot stays unmapped as a
+ * guard page.
+ * 
+ * @return      lowest address of the stack, or NULL if out of slots or pages
+ */
+void * memory_alloc_kstack(void) {
+    void * pages[KSTACK_PAGES];
+    struct pt_cursor cur;
+    uintptr_t base;
+    int slot;
+    int pie;
+    int i;
+
+    pie = spin_lock_irqsave(&kstack_lock);
+    for (slot = 0; slot < KSTACK_SLOTS; slot++) {
+        if (!(kstack_map[slot / 64] & (1UL << (slot % 64)))) {
+            kstack_map[slot / 64] |= 1UL << (slot % 64);
+            break;
+        }
+    }
+    spin_unlock_irqrestore(&kstack_lock, pie);
+
+    if (slot == KSTACK_SLOTS)
+        return NULL;
+
+    // Allocating a page may run the shrinkers, so do it before taking
+    // kstack_lock again.
+
+    for (i = 0; i < KSTACK_PAGES; i++) {
+        pages[i] = memory_try_alloc_page();
+
+        if (pages[i] == NULL) {
+            while (0 < i)
+                memory_free_page(pages[--i]);
+            kstack_slot_put(slot);
+            return NULL;
+        }
+    }
+
+    // The level 0 tables, made by memory_init, are shared with the
+    // neighbouring slots.
+
+    base = KSTACK_START_VMA + slot * KSTACK_SLOT_SIZE + PAGE_SIZE;
+    pt_cursor_init(&cur, main_pt2, 0);
+
+    pie = spin_lock_irqsave(&kstack_lock);
+    for (i = 0; i < KSTACK_PAGES; i++) {
+        *pt_cursor_seek(&cur, base + i * PAGE_SIZE) =
+            leaf_pte(pages[i], PTE_R | PTE_W | PTE_G);
+    }
+    spin_unlock_irqrestore(&kstack_lock, pie);
+
+    sfence_vma();
+    debug("kernel stack slot %d at %p", slot, (void*)base);
+    return (void*)base;
+}
+
+
+
+/**
+ * Unmaps a kernel stack and gives its pages and slot back.
+ * 
+ * @param stack     lowest address of the stack, as returned by
+ *                  memory_alloc_kstack
+ */
+void memory_free_kstack(void * stack) {
+    const uintptr_t base = (uintptr_t)stack;
+    const int slot = (base - KSTACK_START_VMA) / KSTACK_SLOT_SIZE;
+
+    void * pages[KSTACK_PAGES];
+    int pie;
+    int i;
+
+    assert (base == KSTACK_START_VMA + slot * KSTACK_SLOT_SIZE + PAGE_SIZE);
+
+    pie = spin_lock_irqsave(&kstack_lock);
+    kstack_unmap(base, pages);
+    spin_unlock_irqrestore(&kstack_lock, pie);
+
+    for (i = 0; i < KSTACK_PAGES; i++)
+        memory_free_page(pages[i]);
+
+    // Other harts may still have the stack in their TLBs. The slot can only
+    // be handed out again once they have all flushed.
+
+    smp_tlb_shootdown();
+    kstack_slot_put(slot);
+}
+
+
+
+/**
+ * Unmaps a kernel stack and gives its pages back without waiting for a TLB
+ * shootdown. The slot is given back later, by kstack_flush on system_wq.
+ * 
+ * @param stack     lowest address of the stack, as returned by
+ *                  memory_alloc_kstack
+ * 
+ * @return          1 if the stack was freed, 0 if system_wq does not exist
+ *                  yet
+ */
+int memory_try_free_kstack(void * stack) {
+    const uintptr_t base = (uintptr_t)stack;
+    const int slot = (base - KSTACK_START_VMA) / KSTACK_SLOT_SIZE;
+
+    void * pages[KSTACK_PAGES];
+    int pie;
+    int i;
+
+    assert (base == KSTACK_START_VMA + slot * KSTACK_SLOT_SIZE + PAGE_SIZE);
+
+    if (system_wq == NULL)
+        return 0;
+
+    // kstack_lock is only held for a few PTE updates, so it is safe to wait
+    // for it even with other spinlocks held. But the caller may hold spinlocks
+    // that other harts are spinning on with interrupts disabled, so it cannot
+    // wait for them to flush their TLBs. The pages can go back at once, but
+    // the slot stays taken until the shootdown has been done from a worker
+    // thread.
+
+    pie = spin_lock_irqsave(&kstack_lock);
+    kstack_unmap(base, pages);
+    kstack_stale[slot / 64] |= 1UL << (slot % 64);
+    spin_unlock_irqrestore(&kstack_lock, pie);
+
+    for (i = 0; i < KSTACK_PAGES; i++)
+        memory_free_page(pages[i]);
+
+    work_queue(system_wq, &kstack_flush_work);
+    return 1;
+}
+
+
+
+/**
+ * Registers a shrinker to be called when the free list runs out.
+ * 
+ * @param shr   shrinker to add. must stay valid for as long as the kernel runs.
+ */
+void memory_register_shrinker(struct shrinker * shr) {
+    struct shrinker ** link = &shrinker_list;
+
+    // keep registration order
+    while (*link != NULL)
+        link = &(*link)->next;
+
+    shr->next = NULL;
+    *link = shr;
+}
+
+
+
 /**
  * Frees a memory page and returns it to the free list.
  * 
@@ -293,6 +565,7 @@ void *memory_alloc_page(void) {
 
 void memory_free_page(void * pp){
     union linked_page *page;
+    int pie;
 
     // Ensure the input page is valid and page-aligned
     if ((uintptr_t)pp % PAGE_SIZE != 0 || pp == NULL) {
@@ -307,8 +580,11 @@ void memory_free_page(void * pp){
     page = (union linked_page *)pp;
 
     // Add the page back to the free list
+    pie = spin_lock_irqsave(&page_lock);
     page->next = free_list;
     free_list = page;
+    free_page_cnt += 1;
+    spin_unlock_irqrestore(&page_lock, pie);
 }
 
 
@@ -341,6 +617,10 @@ void memory_set_page_flags(const void *vp, uint8_t rwxug_flags) {
         return;
     }
 
+    // A 64 kB mapping has to be broken up before one of its pages can change
+    if (pte->n)
+        napot_split(pte, (uintptr_t)vp);
+
     // Update the PTE with the new flags
     pte->flags &= ~PTE_FLAGS_MASK;
     pte->flags |= rwxug_flags;
@@ -368,6 +648,7 @@ void memory_space_reclaim(void) {
 
     // extract the root page table pointer
     struct pte* old_root_pa = mtag_to_root(old_satp);
+    struct pt_cursor cur;
 
     // switch to the main mem space
     csrw_satp(main_mtag);
@@ -376,12 +657,17 @@ void memory_space_reclaim(void) {
     sfence_vma();
 
     // reclaim the old memory space's page tables and pages
+    pt_cursor_init(&cur, old_root_pa, 0);
+
     for (uintptr_t vaddr = USER_START_VMA; vaddr < USER_END_VMA; vaddr += PAGE_SIZE) {
         // walk the pt
-        struct pte* pte = walk_pt(old_root_pa, vaddr, 0);
+        struct pte* pte = pt_cursor_seek(&cur, vaddr);
         
-        // check if pte is valid
-        if (!pte) continue;
+        // no level 0 table, so nothing is mapped in the rest of this 2 MB region
+        if (!pte) {
+            vaddr = round_down_addr(vaddr, MEGA_SIZE) + MEGA_SIZE - PAGE_SIZE;
+            continue;
+        }
 
         // check if valid flag is set
         if (!(pte->flags & PTE_V)) continue; 
@@ -392,8 +678,7 @@ void memory_space_reclaim(void) {
         // free the physical page if its a leaf pte
         if (pte->flags & (PTE_R | PTE_W | PTE_X)) {
             // free the phyical page
-            uintptr_t pa = (uintptr_t)(pte->ppn) << 12;
-            memory_free_page((void *)pa);
+            memory_free_page(pte_pageptr(pte, vaddr));
 
             // invalidate the pte
             memset(pte, 0, sizeof(struct pte));
@@ -406,6 +691,49 @@ void memory_space_reclaim(void) {
 
 
 
+/**
+ * frees a memory space that is not active, such as a clone whose process
+ * could not be started
+ * 
+ * @param mtag      memory space tag of the space to free
+ */
+
+void memory_space_destroy(uintptr_t mtag) {
+    assert (mtag != active_space_mtag() && mtag != main_mtag);
+    free_user_space(mtag_to_root(mtag));
+}
+
+
+
+/**
+ * frees part of a memory space that is not active, so that a large space can
+ * be torn down a batch at a time
+ * 
+ * @param mtag      memory space tag of the space to free
+ * @param pos       where to continue; USER_START_VMA on the first call, and
+ *                  advanced by each call
+ * @param nr        maximum number of user pages to free in this call
+ * 
+ * @return          1 if the space is gone (its page tables and root table were
+ *                  freed too), 0 if there are user pages left
+ */
+
+int memory_space_destroy_some (
+    uintptr_t mtag, uintptr_t * pos, unsigned long nr)
+{
+    struct pte * const root = mtag_to_root(mtag);
+
+    assert (mtag != main_mtag);
+
+    if (!free_user_pages(root, pos, nr))
+        return 0;
+
+    free_user_tables(root);
+    return 1;
+}
+
+
+
 /**
  * allocates and maps a range of virtual addresses with provided flags
  * 
@@ -421,36 +749,71 @@ void memory_space_reclaim(void) {
  */
 
 void * memory_alloc_and_map_range (uintptr_t vma, size_t size, uint_fast8_t rwxug_flags) {
-    uintptr_t start_vma = vma;
-    uintptr_t end_vma = start_vma + size;
-    size_t page_size = PAGE_SIZE;
-
     // allign start and end addresses
-    round_down_addr(start_vma, page_size);
-    round_up_addr(end_vma, page_size);
+    uintptr_t start_vma = round_down_addr(vma, PAGE_SIZE);
+    uintptr_t end_vma = round_up_addr(vma + size, PAGE_SIZE);
+    uintptr_t current_vma = start_vma;
+    struct pt_cursor cur;
+    struct pte * pte;
 
-    size_t num_pages = (end_vma - start_vma) / page_size;
+    if (!wellformed_vma(start_vma) || !wellformed_vma(end_vma - 1))
+        return NULL;
 
-    for (size_t pages_mapped = 0; pages_mapped < num_pages; pages_mapped++) {
-        uintptr_t current_vma = start_vma + pages_mapped * page_size;
+    pt_cursor_init(&cur, active_space_root(), 1);
 
-        void* result = memory_alloc_and_map_page(current_vma, rwxug_flags);
+    while (current_vma < end_vma) {
+        pte = pt_cursor_seek(&cur, current_vma);
+        if (pte == NULL)
+            break; // out of memory or range runs into a mega or giga page
 
-        if (!result) {
-            // allocation or mapping failed 
-            // unroll each allocated page
-            for (int i = 0; i < pages_mapped; i++) {
-                uintptr_t rollback_vma = start_vma + i * page_size;
+        // use a single 64 kB mapping where the range covers an aligned block
+        // and the allocator can hand us 16 contiguous pages
+        if (MEMORY_NAPOT && aligned_addr(current_vma, NAPOT_SIZE) &&
+            end_vma - current_vma >= NAPOT_SIZE &&
+            map_napot_block(pte, rwxug_flags) == 0)
+        {
+            current_vma += NAPOT_SIZE;
+            continue;
+        }
 
-                // unmap the page and free the physical memory
-                memory_free_page((void *)rollback_vma);
-            }
+        // Replacing one page of a 64 kB mapping splits the rest into 4 kB pages
+        if (pte->n)
+            napot_split(pte, current_vma);
 
-            kprintf("something went wrong when allocating a page, rolling back each allocated page\n");
-            return NULL;
+        void * pp = memory_try_alloc_page();
+        if (pp == NULL)
+            break; // out of memory
+
+        *pte = leaf_pte(pp, rwxug_flags);
+        current_vma += PAGE_SIZE;
+    }
+
+    if (current_vma < end_vma) {
+        // mapping failed part way (out of memory or hit a large page)
+        // unroll each allocated page
+        pt_cursor_init(&cur, active_space_root(), 0);
+
+        for (uintptr_t rollback_vma = start_vma; rollback_vma < current_vma;
+            rollback_vma += PAGE_SIZE)
+        {
+            pte = pt_cursor_seek(&cur, rollback_vma);
+
+            // unmap the page and free the physical memory
+            if (pte && (pte->flags & PTE_V)) {
+                memory_free_page(pte_pageptr(pte, rollback_vma));
+                *pte = null_pte();
+            }
         }
+
+        sfence_vma();
+
+        kprintf("something went wrong when allocating a page, rolling back each allocated page\n");
+        return NULL;
     }
 
+    // Flush TLB once for the whole range
+    sfence_vma();
+
     return (void *)start_vma;
 }
 
@@ -469,23 +832,49 @@ void * memory_alloc_and_map_range (uintptr_t vma, size_t size, uint_fast8_t rwxu
  */
 
 void memory_set_range_flags (const void * vp, size_t size, uint_fast8_t rwxug_flags) {
-    uintptr_t start_addr = (uintptr_t) vp;
-    uintptr_t end_addr = start_addr + size;
-    size_t page_size = PAGE_SIZE;
-
     // make sure the start and end addresses are page aligned
-    round_down_addr(start_addr, page_size);
-    round_up_addr(end_addr, page_size);
+    uintptr_t start_addr = round_down_addr((uintptr_t)vp, PAGE_SIZE);
+    uintptr_t end_addr = round_up_addr((uintptr_t)vp + size, PAGE_SIZE);
+    uintptr_t current_addr = start_addr;
+    struct pt_cursor cur;
 
-    // calculate the num of pages
-    size_t num_pages = (end_addr - start_addr) / page_size;
+    pt_cursor_init(&cur, active_space_root(), 0);
 
     // iterate over each page in the range
-    for (size_t current_page = 0; current_page < num_pages; current_page++) {
-        // grab the current address and set the flag
-        uintptr_t current_addr = start_addr + current_page * page_size;
-        memory_set_page_flags((void *)current_addr, rwxug_flags);       
+    while (current_addr < end_addr) {
+        struct pte * pte = pt_cursor_seek(&cur, current_addr);
+
+        if (pte == NULL || !(pte->flags & PTE_V)) {
+            kprintf("pte is null or not valid in memory_set_range_flags");
+            current_addr += PAGE_SIZE;
+            continue;
+        }
+
+        if (pte->n) {
+            // a 64 kB mapping entirely inside the range keeps its size; all
+            // 16 PTEs of the block get the new flags
+            if (aligned_addr(current_addr, NAPOT_SIZE) &&
+                end_addr - current_addr >= NAPOT_SIZE)
+            {
+                for (int i = 0; i < NAPOT_PAGES; i++) {
+                    pte[i].flags &= ~PTE_FLAGS_MASK;
+                    pte[i].flags |= rwxug_flags;
+                }
+
+                current_addr += NAPOT_SIZE;
+                continue;
+            }
+
+            // otherwise split the block so only this page changes
+            napot_split(pte, current_addr);
+        }
+
+        pte->flags &= ~PTE_FLAGS_MASK;
+        pte->flags |= rwxug_flags;
+        current_addr += PAGE_SIZE;
     }
+
+    sfence_vma();
 }
 
 
@@ -503,14 +892,23 @@ void memory_unmap_and_free_user(void) {
 
     // extract the root page table pointer
     struct pte* root_pt = mtag_to_root(old_satp);
+    struct pt_cursor cur;
+
+    pt_cursor_init(&cur, root_pt, 0);
 
     // iterate over the user virtual address range and unmap user pages
     for (uintptr_t vma = USER_START_VMA; vma < USER_END_VMA; vma += PAGE_SIZE) {
         // walk to the pte
-        struct pte* pte = walk_pt(root_pt, vma, 0);
+        struct pte* pte = pt_cursor_seek(&cur, vma);
+
+        // skip the rest of a 2 MB region that has no level 0 table
+        if (!pte) {
+            vma = round_down_addr(vma, MEGA_SIZE) + MEGA_SIZE - PAGE_SIZE;
+            continue;
+        }
 
         // check if pte is valid
-        if (!pte || (!(pte->flags & PTE_V))) continue; 
+        if (!(pte->flags & PTE_V)) continue; 
 
         // check if user flag is set
         if (!(pte->flags & PTE_U)) continue;
@@ -521,9 +919,7 @@ void memory_unmap_and_free_user(void) {
             pte->flags = 0;
 
             // leaf page, unmap and free
-            uintptr_t pa = (uintptr_t)(pte->ppn) << 12;
-
-            memory_free_page((void *)pa);
+            memory_free_page(pte_pageptr(pte, vma));
         }
     }
 
@@ -559,9 +955,8 @@ void *memory_alloc_and_map_page(uintptr_t vma, uint_fast8_t rwxug_flags){
     }
 
     // Allocate physical page
-    void *physical_page = memory_alloc_page();
+    void *physical_page = memory_try_alloc_page();
     if(!physical_page) {
-        panic("Out of physical memory!");
         return NULL;
     }
 
@@ -572,6 +967,10 @@ void *memory_alloc_and_map_page(uintptr_t vma, uint_fast8_t rwxug_flags){
         return NULL;
     }
 
+    // Replacing one page of a 64 kB mapping splits the rest into 4 kB pages
+    if (pte->n)
+        napot_split(pte, vma);
+
     // Set up the leaf PTE to point to the allocated physical page
     *pte = leaf_pte(physical_page, rwxug_flags);
 
@@ -593,7 +992,7 @@ void *memory_alloc_and_map_page(uintptr_t vma, uint_fast8_t rwxug_flags){
 
 void memory_handle_page_fault(const void * vptr){
     uintptr_t va = (uintptr_t) vptr;
-    struct pte * root_pt, * pa_pte, * new_pp;
+    struct pte * new_pp;
     
     console_printf("handling page fault at virtual address: 0x%lx\n", va);
 
@@ -611,21 +1010,14 @@ void memory_handle_page_fault(const void * vptr){
         panic("page fault at non-aligned address");
     }
 
-    // get the root page table for the active memory space and get to the pte for the va
-    root_pt = active_space_root();
-    pa_pte = walk_pt(root_pt, va, 1);
-
-    if (pa_pte == NULL) {
-        console_printf("memory_handle_page_fault: pte not found for address 0x%lx\n", va);
-        panic("Page fault: PTE not found");
-    }
-
-    // allocate new pp
+    // allocate new pp; this also creates any missing page tables
     new_pp = (struct pte *) memory_alloc_and_map_page(va, PTE_R | PTE_W | PTE_U);
 
     if (new_pp == NULL) {
-        console_printf("memory_handle_page_fault: failed to allocate physical page for address 0x%lx\n", va);
-        panic("Page fault: Memory allocation failed");
+        // out of memory for the page or a page table: the process cannot
+        // continue, but the kernel can
+        console_printf("memory_handle_page_fault: failed to allocate page for address 0x%lx\n", va);
+        process_exit();
     }
 
     // flush tlb
@@ -648,22 +1040,27 @@ void memory_handle_page_fault(const void * vptr){
  */
 
 int memory_validate_vptr_len (const void * vp, size_t len, uint_fast8_t rwxug_flags){
+    struct pt_cursor cur;
+
     // Validate the ptr and len are well-formed
     if (!wellformed_vma((uintptr_t)vp) || len == 0){
         return -1;
     }
 
-    uintptr_t start_vma = (uintptr_t)vp;
-    uintptr_t end_vma = start_vma + len;
-
     // make sure the start and end addresses are page aligned
-    round_down_addr(start_vma, PAGE_SIZE);
-    round_up_addr(end_vma, PAGE_SIZE);
+    uintptr_t start_vma = round_down_addr((uintptr_t)vp, PAGE_SIZE);
+    uintptr_t end_vma = round_up_addr((uintptr_t)vp + len, PAGE_SIZE);
+
+    if (end_vma < start_vma || !wellformed_vma(end_vma - 1)){
+        return -1;
+    }
+
+    pt_cursor_init(&cur, active_space_root(), 0);
 
     // Traverse all pages within the range [start_vma, end_vma)
     for(uintptr_t current_vma = start_vma; current_vma < end_vma; current_vma += PAGE_SIZE){
         // Get the page table entry for the current virtual address
-        struct pte *pte = walk_pt(active_space_root(), current_vma, 0);
+        struct pte *pte = pt_cursor_seek(&cur, current_vma);
         if (!pte || !(pte->flags & PTE_V)){
             return -1; // Page is not mapped
         }
@@ -690,15 +1087,19 @@ int memory_validate_vptr_len (const void * vp, size_t len, uint_fast8_t rwxug_fl
  */
 
 int memory_validate_vstr (const char * vs, uint_fast8_t ug_flags){
+    struct pt_cursor cur;
+
     if (!wellformed_vma((uintptr_t)vs)){
         return -1;
     }
 
     uintptr_t current_vma = (uintptr_t)vs;
+
+    pt_cursor_init(&cur, active_space_root(), 0);
     
-    while (1) {
+    while (wellformed_vma(current_vma)) {
         // Get PTE for the current virtual address
-        struct pte *pte = walk_pt(active_space_root(), current_vma, 0);
+        struct pte *pte = pt_cursor_seek(&cur, current_vma);
         if(!pte || !(pte->flags & PTE_V)){
             return -1; // Page is not mapped
         }
@@ -708,21 +1109,44 @@ int memory_validate_vstr (const char * vs, uint_fast8_t ug_flags){
             return -1; // Required flags are not present
         }
 
-        // Access the current character
-        const char *current_char = (const char *)current_vma;
-        if (*current_char == '\0'){
-            return 0; // Found null terminator, string is valid
-        }
+        // The page checks out; scan the rest of it for the null terminator
+        do {
+            if (*(const char *)current_vma == '\0'){
+                return 0; // Found null terminator, string is valid
+            }
 
-        current_vma++;
-        
-        if(current_vma % PAGE_SIZE == 0){
-            // Moving to next page, repeat checks for new page
-            continue;
-        }
+            current_vma++;
+        } while (current_vma % PAGE_SIZE != 0);
     }    
 
-    return -1; // Should never reach here.
+    return -1; // Ran off the end of the address space
+}
+
+/**
+ * translates a virtual address in the active memory space to a physical address
+ * 
+ * @param vp            virtual address to translate
+ * @param rwxug_flags   flags the page containing vp must be mapped with
+ * 
+ * @return              returns the physical address vp maps to, or 0 if its
+ *                      page is not mapped with the required flags
+ */
+
+uintptr_t memory_virt_to_phys (const void * vp, uint_fast8_t rwxug_flags){
+    const uintptr_t vma = (uintptr_t)vp;
+    struct pte * pte;
+
+    if (!wellformed_vma(vma)){
+        return 0;
+    }
+
+    pte = walk_pt(active_space_root(), vma, 0);
+
+    if (!pte || !(pte->flags & PTE_V) || (pte->flags & rwxug_flags) != rwxug_flags){
+        return 0;
+    }
+
+    return (uintptr_t)pte_pageptr(pte, vma) + vma % PAGE_SIZE;
 }
 
 /**
@@ -742,9 +1166,11 @@ uintptr_t memory_space_clone(uint_fast16_t asid){
 
     // extract parent root pt 
     struct pte* parent_root_pt = mtag_to_root(parent_mtag);
+    struct pt_cursor parent_cur;
+    struct pt_cursor child_cur;
 
     // allocate new root page 
-    struct pte *new_root = memory_alloc_page();
+    struct pte *new_root = memory_try_alloc_page();
     if (!new_root) 
         return 0; // Allocation failure
 
@@ -757,20 +1183,35 @@ uintptr_t memory_space_clone(uint_fast16_t asid){
             child_root[i] = main_pt2[i];
     }
 
+    pt_cursor_init(&parent_cur, parent_root_pt, 0);
+    pt_cursor_init(&child_cur, child_root, 1);
+
     // clone the page table entries
     for (uintptr_t vma = USER_START_VMA; vma < USER_END_VMA; vma += PAGE_SIZE) {
-        struct pte *parent_pte = walk_pt(parent_root_pt, vma, 0);
-        if (!parent_pte || !(parent_pte->flags & PTE_V)) {
+        struct pte *parent_pte = pt_cursor_seek(&parent_cur, vma);
+        if (!parent_pte) {
+            // nothing mapped in the rest of this 2 MB region
+            vma = round_down_addr(vma, MEGA_SIZE) + MEGA_SIZE - PAGE_SIZE;
+            continue;
+        }
+
+        if (!(parent_pte->flags & PTE_V)) {
             continue; // Skip unmapped pages
         }
 
-        void *parent_phys_page = pagenum_to_pageptr(parent_pte->ppn);
+        void *parent_phys_page = pte_pageptr(parent_pte, vma);
 
         // walk to the same vma in the child root
-        struct pte *child_pte = walk_pt(child_root, vma, 1);
+        struct pte *child_pte = pt_cursor_seek(&child_cur, vma);
 
         // allocate the page that the child pte points to 
-        void* child_pt = memory_alloc_page();
+        void* child_pt = child_pte ? memory_try_alloc_page() : NULL;
+
+        if (child_pt == NULL) {
+            // out of memory: undo the partial copy
+            free_user_space(child_root);
+            return 0;
+        }
 
         // set the ppn of the child pte to the newly allocated page
         child_pte->ppn = pageptr_to_pagenum(child_pt);
@@ -839,7 +1280,10 @@ struct pte * walk_pt(struct pte* root, uintptr_t vma, int create) {
         } else if (create) {
             // entry isn't valid create the entry
             // allocate a new page table
-            struct pte* new_pt = (struct pte*)memory_alloc_page(); // should panic if no pages available
+            struct pte* new_pt = (struct pte*)memory_try_alloc_page();
+
+            if (new_pt == NULL)
+                return NULL; // out of memory
 
             console_printf("new pt address: 0x%x\n", new_pt);
 
@@ -859,6 +1303,333 @@ struct pte * walk_pt(struct pte* root, uintptr_t vma, int create) {
 }
 
 
+
+/**
+ * starts a page table cursor on a page table tree
+ * 
+ * @param cur       cursor to initialize
+ * @param root      pointer to the root page table
+ * @param create    if non-zero, missing pts are created as the cursor moves
+ */
+
+void pt_cursor_init(struct pt_cursor * cur, struct pte * root, int create) {
+    cur->root = root;
+    cur->pt0 = NULL;
+    cur->region = 1; // not a 2 MB aligned address, so the first seek walks
+    cur->create = create;
+}
+
+
+
+/**
+ * positions a cursor at a virtual address and returns its leaf pte
+ * 
+ * only the level 0 table of the current 2 MB region is remembered, so the
+ * tree is walked from the root only when vma is in a different region than
+ * the previous call. a missing table is remembered as well when the cursor
+ * does not create tables, so scanning an empty region costs a single walk.
+ * 
+ * @param cur       cursor set up by pt_cursor_init
+ * @param vma       virtual memory address for which the PTE is sought
+ * 
+ * @return          returns the same pte pointer walk_pt would, or NULL
+ */
+
+struct pte * pt_cursor_seek(struct pt_cursor * cur, uintptr_t vma) {
+    uintptr_t region = round_down_addr(vma, MEGA_SIZE);
+
+    if (region != cur->region) {
+        // walk_pt returns the first pte of the level 0 table for region
+        cur->pt0 = walk_pt(cur->root, region, cur->create);
+        cur->region = region;
+    }
+
+    if (cur->pt0 == NULL)
+        return NULL;
+
+    return cur->pt0 + VPN0(vma);
+}
+
+
+/**
+ * takes 16 physically contiguous pages starting on a 64 kB boundary off the
+ * free list
+ * 
+ * pages are pushed onto the free list one at a time, so a run of contiguous
+ * pages shows up as consecutive entries in descending address order (this is
+ * how memory_init builds the list, and how a reclaimed 64 kB block is put
+ * back). only the first NAPOT_SCAN_MAX entries are examined.
+ * 
+ * @return          returns a pointer to the zeroed block, or NULL if no block
+ *                  was found
+ */
+
+static void * alloc_napot_block(void) {
+    union linked_page ** link = &free_list;
+    union linked_page * top;
+    union linked_page * page;
+    int scanned = 0;
+    int pie;
+    int i;
+
+    pie = spin_lock_irqsave(&page_lock);
+
+    while ((top = *link) != NULL && scanned < NAPOT_SCAN_MAX) {
+        // the first entry of a run must be the highest page of a block
+        if (aligned_ptr(top + 1, NAPOT_SIZE)) {
+            page = top;
+
+            for (i = 1; i < NAPOT_PAGES; i++) {
+                if (page->next != page - 1)
+                    break;
+                page = page->next;
+            }
+
+            if (i == NAPOT_PAGES) {
+                // page now points at the lowest page of the block
+                *link = page->next;
+                free_page_cnt -= NAPOT_PAGES;
+                spin_unlock_irqrestore(&page_lock, pie);
+                memset(page, 0, NAPOT_SIZE);
+                return page;
+            }
+        }
+
+        link = &top->next;
+        scanned++;
+    }
+
+    spin_unlock_irqrestore(&page_lock, pie);
+    return NULL;
+}
+
+/**
+ * maps a 64 kB block using Svnapot PTEs. the caller flushes the TLB.
+ * 
+ * @param pte           level 0 PTE of the first page of a 64 kB aligned block
+ * @param rwxug_flags   flags for the mapping
+ * 
+ * @return              returns 0 on success, or -1 if any of the 16 pages is
+ *                      already mapped or no contiguous block is free
+ */
+
+static int map_napot_block(struct pte * pte, uint_fast8_t rwxug_flags) {
+    void * block;
+    int i;
+
+    // all 16 PTEs live in the same level 0 table since the block is 64 kB
+    // aligned
+    for (i = 0; i < NAPOT_PAGES; i++) {
+        if (pte[i].flags & PTE_V)
+            return -1;
+    }
+
+    block = alloc_napot_block();
+    if (block == NULL)
+        return -1;
+
+    for (i = 0; i < NAPOT_PAGES; i++)
+        pte[i] = napot_pte(block, rwxug_flags);
+
+    return 0;
+}
+
+/**
+ * rewrites the 64 kB mapping containing vma as 16 ordinary 4 kB PTEs with the
+ * same flags. the caller is responsible for flushing the TLB.
+ * 
+ * @param pte       pointer to the level 0 PTE that maps vma
+ * @param vma       virtual address mapped by pte
+ */
+
+static void napot_split(struct pte * pte, uintptr_t vma) {
+    struct pte * first = pte - (VPN0(vma) % NAPOT_PAGES);
+    uintptr_t base = first->ppn & ~(uintptr_t)(NAPOT_PAGES - 1);
+
+    for (int i = 0; i < NAPOT_PAGES; i++) {
+        first[i].ppn = base + i;
+        first[i].n = 0;
+    }
+}
+
+
+/**
+ * runs the registered shrinkers until at least nr pages are on the free list
+ * 
+ * @param nr        number of pages wanted
+ * 
+ * @return          returns the number of pages the shrinkers freed
+ */
+
+static unsigned long shrink_free_list(unsigned long nr) {
+    struct shrinker * shr;
+    unsigned long freed = 0;
+
+    if (__atomic_exchange_n(&shrinking, 1, __ATOMIC_ACQUIRE))
+        return 0;
+
+    for (shr = shrinker_list; shr != NULL && freed < nr; shr = shr->next) {
+        freed += shr->scan(shr, nr - freed);
+        debug("shrinker %s: %lu pages freed", shr->name, freed);
+    }
+
+    __atomic_store_n(&shrinking, 0, __ATOMIC_RELEASE);
+    return freed;
+}
+
+/**
+ * frees every user page and every non-global page table in a memory space,
+ * including the root table itself. the space must not be active.
+ * 
+ * @param root      root page table of the space to free
+ */
+
+static void free_user_space(struct pte * root) {
+    uintptr_t vma = USER_START_VMA;
+
+    free_user_pages(root, &vma, ULONG_MAX);
+    free_user_tables(root);
+}
+
+/**
+ * frees up to /nr/ user pages of a space that is not active, starting at
+ * *vmap. the page table entries are left as they are; the tables themselves
+ * are freed by free_user_tables.
+ * 
+ * @param root      root page table of the space
+ * @param vmap      first address to look at, updated to where to continue
+ * @param nr        maximum number of pages to free
+ * 
+ * @return          1 if the end of the user region was reached, 0 if not
+ */
+
+static int free_user_pages (
+    struct pte * root, uintptr_t * vmap, unsigned long nr)
+{
+    struct pt_cursor cur;
+    struct pte * pte;
+    unsigned long freed = 0;
+    uintptr_t vma;
+
+    pt_cursor_init(&cur, root, 0);
+
+    for (vma = *vmap; vma < USER_END_VMA; vma += PAGE_SIZE) {
+        if (freed == nr) {
+            *vmap = vma;
+            return 0;
+        }
+
+        pte = pt_cursor_seek(&cur, vma);
+
+        if (pte == NULL) {
+            vma = round_down_addr(vma, MEGA_SIZE) + MEGA_SIZE - PAGE_SIZE;
+            continue;
+        }
+
+        if ((pte->flags & PTE_V) && !(pte->flags & PTE_G)) {
+            memory_free_page(pte_pageptr(pte, vma));
+            freed += 1;
+        }
+    }
+
+    *vmap = USER_END_VMA;
+    return 1;
+}
+
+/**
+ * frees the page tables of a space whose user pages are gone, including the
+ * root table itself
+ * 
+ * @param root      root page table of the space
+ */
+
+static void free_user_tables(struct pte * root) {
+    struct pte * pt1;
+    int i, j;
+
+    // page tables reachable through non-global root entries belong to this
+    // space alone
+    for (i = 0; i < PTE_CNT; i++) {
+        if (!(root[i].flags & PTE_V) || (root[i].flags & PTE_G) ||
+            (root[i].flags & (PTE_R | PTE_W | PTE_X)))
+            continue;
+
+        pt1 = pagenum_to_pageptr(root[i].ppn);
+
+        for (j = 0; j < PTE_CNT; j++) {
+            if ((pt1[j].flags & PTE_V) &&
+                !(pt1[j].flags & (PTE_R | PTE_W | PTE_X)))
+                memory_free_page(pagenum_to_pageptr(pt1[j].ppn));
+        }
+
+        memory_free_page(pt1);
+    }
+
+    memory_free_page(root);
+}
+
+
+/**
+ * unmaps a kernel stack. called with kstack_lock held; the caller frees the
+ * pages once it has released the lock.
+ * 
+ * @param base      lowest address of the stack
+ * @param pages     receives the KSTACK_PAGES pages that were mapped
+ */
+
+static void kstack_unmap(uintptr_t base, void ** pages) {
+    struct pt_cursor cur;
+    struct pte * pte;
+    int i;
+
+    pt_cursor_init(&cur, main_pt2, 0);
+
+    for (i = 0; i < KSTACK_PAGES; i++) {
+        pte = pt_cursor_seek(&cur, base + i * PAGE_SIZE);
+        pages[i] = pte_pageptr(pte, base + i * PAGE_SIZE);
+        *pte = null_pte();
+    }
+
+    sfence_vma();
+}
+
+static void kstack_slot_put(int slot) {
+    int pie;
+
+    pie = spin_lock_irqsave(&kstack_lock);
+    kstack_map[slot / 64] &= ~(1UL << (slot % 64));
+    spin_unlock_irqrestore(&kstack_lock, pie);
+}
+
+/**
+ * gives back the slots left by memory_try_free_kstack, once every hart has
+ * flushed them from its TLB. Slots unmapped while the shootdown is in
+ * progress are left for the next run, which work_queue has already arranged.
+ * 
+ * @param wk        kstack_flush_work
+ */
+
+static void kstack_flush(struct work * wk) {
+    uint64_t stale[(KSTACK_SLOTS + 63) / 64];
+    int pie;
+    int i;
+
+    pie = spin_lock_irqsave(&kstack_lock);
+    for (i = 0; i < (KSTACK_SLOTS + 63) / 64; i++) {
+        stale[i] = kstack_stale[i];
+        kstack_stale[i] = 0;
+    }
+    spin_unlock_irqrestore(&kstack_lock, pie);
+
+    smp_tlb_shootdown();
+
+    pie = spin_lock_irqsave(&kstack_lock);
+    for (i = 0; i < (KSTACK_SLOTS + 63) / 64; i++)
+        kstack_map[i] &= ~stale[i];
+    spin_unlock_irqrestore(&kstack_lock, pie);
+}
+
+
 // INTERNAL FUNCTION DEFINITIONS
 //
 
@@ -963,6 +1734,30 @@ static inline struct pte null_pte(void) {
     return (struct pte) { };
 }
 
+// Svnapot encodes a 64 kB mapping as ppn[3:0] = 0b1000 with the N bit set; the
+// same PTE is repeated in all 16 slots covering the block.
+
+static inline struct pte napot_pte (
+    const void * pptr, uint_fast8_t rwxug_flags)
+{
+    struct pte pte = leaf_pte(pptr, rwxug_flags);
+
+    pte.ppn = (pte.ppn & ~(uintptr_t)(NAPOT_PAGES - 1)) | (NAPOT_PAGES >> 1);
+    pte.n = 1;
+    return pte;
+}
+
+static inline void * pte_pageptr(const struct pte * pte, uintptr_t vma) {
+    uintptr_t ppn = pte->ppn;
+
+    if (pte->n) {
+        ppn &= ~(uintptr_t)(NAPOT_PAGES - 1);
+        ppn |= VPN0(vma) % NAPOT_PAGES;
+    }
+
+    return pagenum_to_pageptr(ppn);
+}
+
 static inline void sfence_vma(void) {
     asm inline ("sfence.vma" ::: "memory");
 }
@@ -33,6 +33,32 @@
 #define HEAP_INIT_MIN 256
 #endif
 
+// Map 64 kB aligned, physically contiguous runs with Svnapot PTEs. The hart
+// must implement Svnapot (QEMU: -cpu rv64,svnapot=true).
+
+#ifndef MEMORY_NAPOT
+#define MEMORY_NAPOT 1
+#endif
+
+// Maximum number of free list entries examined when looking for a contiguous
+// 64 kB block before falling back to 4 kB pages.
+
+#ifndef NAPOT_SCAN_MAX
+#define NAPOT_SCAN_MAX 128
+#endif
+
+// Number of 4 kB pages in each kernel thread stack.
+
+#ifndef KSTACK_PAGES
+#define KSTACK_PAGES 4
+#endif
+
+// Maximum number of kernel stacks that can be allocated at once.
+
+#ifndef KSTACK_SLOTS
+#define KSTACK_SLOTS 512
+#endif
+
 // CONSTANT DEFINITIONS
 //
 
@@ -51,9 +77,44 @@ struct pte {
 
 #define PTE_CNT (PAGE_SIZE/8) // number of PTEs per page table
 
+#define NAPOT_PAGES 16 // pages covered by one Svnapot 64 kB mapping
+#define NAPOT_SIZE (NAPOT_PAGES * PAGE_SIZE)
+
+#define KSTACK_SIZE (KSTACK_PAGES * PAGE_SIZE) // usable bytes in a kernel stack
+
 // EXPORTED TYPE DEFINITIONS
 //
 
+// A shrinker lets a subsystem that holds on to pages it does not strictly need
+// (caches, pools) give them back when the page allocator runs dry. The /scan/
+// callback should return up to /nr/ pages with memory_free_page and return the
+// number of pages it freed. It is called with the allocator's state consistent,
+// but must not allocate pages itself.
+
+struct shrinker {
+    const char * name;
+    unsigned long (*scan)(struct shrinker * shr, unsigned long nr);
+    struct shrinker * next; // managed by memory_register_shrinker
+};
+
+// Page allocator statistics, as returned by memory_get_stats.
+
+struct memory_stats {
+    unsigned long total_pages; // pages managed by the page allocator
+    unsigned long free_pages; // pages currently on the free list
+};
+
+// A page table cursor remembers the level 0 table of the 2 MB region it was
+// last positioned in, so that visiting consecutive pages does not walk the
+// tree from the root every time.
+
+struct pt_cursor {
+    struct pte * root; // root page table
+    struct pte * pt0; // level 0 table for region, or NULL if there is none
+    uintptr_t region; // 2 MB aligned address pt0 belongs to
+    int create; // create missing page tables
+};
+
 // EXPORTED VARIABLE DECLARATIONS
 //
 
@@ -92,6 +153,22 @@ extern uintptr_t memory_space_create(uint_fast16_t asid);
 
 extern void memory_space_reclaim(void);
 
+// void memory_space_destroy(uintptr_t mtag)
+// Frees all user pages and page tables of a memory space that is not active,
+// including its root page table. Global mappings shared with the main memory
+// space are left alone.
+
+extern void memory_space_destroy(uintptr_t mtag);
+
+// int memory_space_destroy_some(uintptr_t mtag, uintptr_t * pos, unsigned long nr)
+// Like memory_space_destroy, but frees at most /nr/ user pages per call, so
+// that a large space can be torn down in batches. *pos must be USER_START_VMA
+// on the first call and is advanced by each call. Returns 1 once the space,
+// including its page tables, has been freed, and 0 while pages remain.
+
+extern int memory_space_destroy_some (
+    uintptr_t mtag, uintptr_t * pos, unsigned long nr);
+
 // uintptr_t active_memory_space(void)
 // Returns the memory space tag of the current memory space.
 
@@ -105,10 +182,50 @@ extern uintptr_t memory_space_switch(uintptr_t mtag);
 
 // void * memory_alloc_page(void)
 // Allocates a physical page of memory. Returns a pointer to the direct-mapped
-// address of the page. Does not fail; panics if there are no free pages available.
+// address of the page. Does not fail; panics if there are no free pages available
+// even after running the registered shrinkers.
 
 extern void * memory_alloc_page(void);
 
+// void * memory_try_alloc_page(void)
+// Like memory_alloc_page, but returns NULL instead of panicking when no page can
+// be found. Callers that can back out of an operation should use this.
+
+extern void * memory_try_alloc_page(void);
+
+// void memory_get_stats(struct memory_stats * stats)
+// Fills in a snapshot of the page allocator's statistics.
+
+extern void memory_get_stats(struct memory_stats * stats);
+
+// void * memory_alloc_kstack(void)
+// Allocates a KSTACK_SIZE kernel stack in the kernel stack region and returns
+// its lowest address. The page below each stack is never mapped, so overrunning
+// a stack faults instead of overwriting a neighbour. The stack is visible in
+// every memory space. Returns NULL if no stack slot or page is available.
+
+extern void * memory_alloc_kstack(void);
+
+// void memory_free_kstack(void * stack)
+// Unmaps and frees a stack returned by memory_alloc_kstack. The stack must not
+// be in use.
+
+extern void memory_free_kstack(void * stack);
+
+// int memory_try_free_kstack(void * stack)
+// Like memory_free_kstack, but for use by shrinkers, which may be called with
+// spinlocks held: the pages are freed at once, but the TLB shootdown, and with
+// it the reuse of the stack slot, is left to a work item on system_wq. Returns
+// 1 if the stack was freed, or 0 if system_wq does not exist yet.
+
+extern int memory_try_free_kstack(void * stack);
+
+// void memory_register_shrinker(struct shrinker * shr)
+// Adds a shrinker to the list consulted by the page allocator when the free
+// list is empty. Shrinkers are called in the order they were registered.
+
+extern void memory_register_shrinker(struct shrinker * shr);
+
 // void memory_free_page(void * ptr)
 // Returns a physical memory page to the physical page allocator. The page must
 // have been previously allocated by memory_alloc_page.
@@ -133,7 +250,9 @@ extern void * memory_alloc_and_map_page (
 //        uintptr_t vma, size_t size, uint_fast8_t rwxug_flags)
 
 // Allocates and maps multiple physical pages in an address range. Equivalent to
-// calling memory_alloc_and_map_page for every page in the range.
+// calling memory_alloc_and_map_page for every page in the range, except that
+// 64 kB aligned parts of the range are mapped with a single Svnapot mapping
+// when 16 physically contiguous pages are available.
 
 extern void * memory_alloc_and_map_range (
     uintptr_t vma, size_t size, uint_fast8_t rwxug_flags);
@@ -146,7 +265,9 @@ extern void * memory_alloc_and_map_range (
 extern void memory_unmap_and_free_user(void);
 
 // extern void memory_set_page_flags(const void * vp, uint8_t rwxug_flags);
-// Sets the flags of the PTE associated with vp. Only works with 4 kB pages.
+// Sets the flags of the PTE associated with vp. Only works with 4 kB pages; if
+// vp is part of a 64 kB Svnapot mapping, the mapping is first split into 4 kB
+// pages.
 
 extern void memory_set_page_flags(
     const void * vp, uint8_t rwxug_flags);
@@ -178,6 +299,14 @@ extern int memory_validate_vptr_len (
 extern int memory_validate_vstr (
     const char * vs, uint_fast8_t ug_flags);
 
+// uintptr_t memory_virt_to_phys (const void * vp, uint_fast8_t rwxug_flags)
+// Returns the physical address that /vp/ maps to in the active memory space,
+// or 0 if the page containing /vp/ is not mapped with at least the specified
+// flags.
+
+extern uintptr_t memory_virt_to_phys (
+    const void * vp, uint_fast8_t rwxug_flags);
+
 // Called from excp.c to handle a page fault at the specified address. Either
 // maps a page containing the faulting address, or calls process_exit().
 
@@ -187,6 +316,21 @@ extern void memory_handle_page_fault(const void * vptr);
 
 struct pte * walk_pt(struct pte* root, uintptr_t vma, int create);
 
+// void pt_cursor_init(struct pt_cursor * cur, struct pte * root, int create)
+// Sets up a cursor on the page table tree rooted at /root/. If /create/ is
+// non-zero, missing page tables are allocated as the cursor moves.
+
+extern void pt_cursor_init (
+    struct pt_cursor * cur, struct pte * root, int create);
+
+// struct pte * pt_cursor_seek(struct pt_cursor * cur, uintptr_t vma)
+// Returns the level 0 PTE for /vma/, like walk_pt, but only walks from the
+// root when /vma/ is in a different 2 MB region than the previous call. When
+// it returns NULL for a cursor that does not create tables, nothing in the
+// 2 MB region containing /vma/ is mapped by 4 kB pages.
+
+extern struct pte * pt_cursor_seek(struct pt_cursor * cur, uintptr_t vma);
+
 // INLINE FUNCTION DEFINITIONS
 //
 
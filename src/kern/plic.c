@@ -3,6 +3,7 @@
 
 #include "plic.h"
 #include "console.h"
+#include "smp.h"
 
 #include <stdint.h>
 
@@ -17,7 +18,11 @@
 #endif
 
 #define PLIC_SRCCNT 0x400
-#define PLIC_CTXCNT 1
+#define PLIC_CTXCNT (2*NHART)
+
+// On the QEMU virt machine, each hart has an M mode and an S mode context.
+
+#define PLIC_SCTX(hartid) (2*(hartid)+1)
 
 // INTERNAL FUNCTION DECLARATIONS
 //
@@ -33,9 +38,9 @@ extern void plic_set_context_threshold(uint32_t ctxno, uint32_t level);
 extern uint32_t plic_claim_context_interrupt(uint32_t ctxno);
 extern void plic_complete_context_interrupt(uint32_t ctxno, uint32_t srcno);
 
-// Currently supports only single-hart operation. The low-level PLIC functions
-// already understand contexts, so we only need to modify the high-level
-// functions (plic_init, plic_claim, plic_complete).
+// Every source is enabled for the S mode context of every hart, so whichever
+// hart claims an interrupt first handles it; the others claim 0. Enabling and
+// disabling a source is done with its priority, which is shared by all harts.
 
 // EXPORTED FUNCTION DEFINITIONS
 // 
@@ -43,13 +48,24 @@ extern void plic_complete_context_interrupt(uint32_t ctxno, uint32_t srcno);
 void plic_init(void) {
     int i;
 
-    // Disable all sources by setting priority to 0, enable all sources for
-    // context 0 (M mode on hart 0).
+    // Disable all sources by setting priority to 0, then set up the boot
+    // hart's context.
 
-    for (i = 0; i < PLIC_SRCCNT; i++) {
+    for (i = 0; i < PLIC_SRCCNT; i++)
         plic_set_source_priority(i, 0);
-        plic_enable_source_for_context(1, i); // changed context no
-    }
+
+    plic_init_hart(0);
+}
+
+void plic_init_hart(int hartid) {
+    int i;
+
+    // Enable all sources for the S mode context of the hart.
+
+    for (i = 0; i < PLIC_SRCCNT; i++)
+        plic_enable_source_for_context(PLIC_SCTX(hartid), i);
+
+    plic_set_context_threshold(PLIC_SCTX(hartid), 0);
 }
 
 extern void plic_enable_irq(int irqno, int prio) {
@@ -65,15 +81,15 @@ extern void plic_disable_irq(int irqno) {
 }
 
 extern int plic_claim_irq(void) {
-    // Hardwired context 0 (M mode on hart 0)
+    // S mode context of the hart taking the interrupt
     trace("%s()", __func__);
-    return plic_claim_context_interrupt(1); // changed context no
+    return plic_claim_context_interrupt(PLIC_SCTX(this_hart()->id));
 }
 
 extern void plic_close_irq(int irqno) {
-    // Hardwired context 0 (M mode on hart 0)
+    // Must be completed in the context that claimed it
     trace("%s(irqno=%d)", __func__, irqno);
-    plic_complete_context_interrupt(1, irqno); // changed context no
+    plic_complete_context_interrupt(PLIC_SCTX(this_hart()->id), irqno);
 }
 
 // INTERNAL FUNCTION DEFINITIONS
@@ -11,6 +11,11 @@
 
 extern void plic_init(void);
 
+// Enables all interrupt sources for the S mode context of a hart. Called for
+// the boot hart by plic_init, and by each secondary hart when it starts.
+
+extern void plic_init_hart(int hartid);
+
 extern void plic_enable_irq(int irqno, int prio);
 extern void plic_disable_irq(int irqno);
 
@@ -2,6 +2,9 @@
 //
 
 #include "process.h"
+#include "spinlock.h"
+#include "workq.h"
+#include "futex.h"
 
 #ifdef PROCESS_TRACE
 #define TRACE
@@ -21,9 +24,30 @@
 // #define NPROC 16
 // #endif
 
+// Number of user pages the reaper frees before letting other threads run.
+
+#ifndef REAP_BATCH
+#define REAP_BATCH 64
+#endif
+
 // INTERNAL FUNCTION DECLARATIONS
 //
 
+// Makes the other threads of /proc/ exit and waits until they have. Called by
+// the main thread of /proc/ from process_exit.
+
+static void kill_siblings(struct process * proc);
+
+// Hands the memory space of an exited process to the reaper, which frees it in
+// the background. Waits for room if the reaper's queue is full.
+
+static void reap_queue(uintptr_t mtag);
+
+// Body of the reaper's work item. Frees queued memory spaces REAP_BATCH pages
+// at a time, yielding in between.
+
+static void reap_work_func(struct work * wk);
+
 // INTERNAL GLOBAL VARIABLES
 //
 
@@ -39,6 +63,22 @@ struct process * proctab[NPROC] = {
     [MAIN_PID] = &main_proc
 };
 
+// Memory spaces waiting to be freed by the reaper, oldest at reap_head. Each
+// process queues its space once, so NPROC entries are normally enough.
+
+static uintptr_t reap_list[NPROC];
+static int reap_head;
+static int reap_cnt;
+static struct spinlock reap_lock = SPINLOCK_INIT("reap");
+static struct condition reap_space; // signaled when reap_cnt drops below NPROC
+
+static struct workqueue * reaper_wq;
+static struct work reap_work;
+
+// Protects the nthr counts that a main thread in kill_siblings waits on.
+
+static struct spinlock exit_lock = SPINLOCK_INIT("exit");
+
 // EXPORTED GLOBAL VARIABLES
 //
 
@@ -61,6 +101,8 @@ void procmgr_init(void) {
     
     // init tid
     main_proc.tid = running_thread();
+    main_proc.nthr = 1;
+    condition_init(&main_proc.thr_exited, "thr_exited");
 
     // init mem space identifier
     main_proc.mtag = active_memory_space();
@@ -70,6 +112,13 @@ void procmgr_init(void) {
     // init io 
     memset(main_proc.iotab, 0, sizeof(main_proc.iotab));
 
+    // the reaper frees memory spaces of exited processes
+    reaper_wq = workqueue_create("reaper");
+    if (reaper_wq == NULL)
+        panic("procmgr_init: could not create reaper");
+    work_init(&reap_work, reap_work_func);
+    condition_init(&reap_space, "reap_space");
+
     // mark process manager as initialized
     procmgr_initialized = 1;
 }
@@ -95,7 +144,6 @@ void procmgr_init(void) {
 int process_exec(struct io_intf * exeio) {
     int result;
     void (*entry_point)(void);
-    struct thread_stack_anchor* stack_anchor;
     uintptr_t usp;
 
     // (a) unmap any virtual memory mappings begongin to other user processes
@@ -121,12 +169,10 @@ int process_exec(struct io_intf * exeio) {
     // (d) start the process in user mode
     // set up the stack
     usp = USER_STACK_VMA;
-    
-    // set up stack anchor
-    stack_anchor = (struct thread_stack_anchor*) cur_stack_base();
 
-    // call thread_jump_user (in thrasm.s) to finish switching to umode
-    _thread_finish_jump(stack_anchor, usp, (uintptr_t)entry_point);
+    // thread_jump_to_user also resets the thread's FP and CPU time state
+    // for the new image
+    thread_jump_to_user(usp, (uintptr_t)entry_point);
     
     // this line should not execute
     panic("process_exec: returned from user mode execution\n");
@@ -136,19 +182,59 @@ int process_exec(struct io_intf * exeio) {
 
 
 /**
- * cleans up after a finished process by reclaimin the resources of the process
+ * ends the calling thread and cleans up after the process if it was the last thread
+ * 
+ * the last thread to exit cleans up anything associated with the process at the initial
+ * execution including process memory space and open io interface. every thread ends its
+ * associated kernel thread
  * 
- * cleans up anything associated with the process at the initial execution including
- * process memory space, open io interface, and associated kernel thread
+ * when the main thread exits, the whole process does: the other threads are made to
+ * exit first, so that a parent waiting for the main thread only sees it exit once none
+ * of the process's threads are left running
+ * 
+ * the memory space is handed to the reaper thread rather than freed here, so that a
+ * parent waiting for the thread is not held up by it
  */
 
 void __attribute__ ((noreturn)) process_exit(void) {
     struct process* current_proc = current_process();
+    uintptr_t mtag;
+    int left;
+    int pie;
 
     if (!current_proc) panic("prcess_exit: current process doesn't exist, ::confused_face_emoji\n");
 
-    // reclaim the memory space
-    memory_space_reclaim();
+    if (running_thread() == current_proc->tid)
+        kill_siblings(current_proc);
+
+    // leave the memory space before dropping our count, so that once the count
+    // reaches zero no hart is running in the space any more. without a process
+    // the thread runs in the main memory space from here on, even if it is
+    // preempted
+    thread_set_process(running_thread(), NULL);
+    memory_space_switch(main_mtag);
+
+    // other threads are still using the memory space and io interfaces. if the
+    // main thread is waiting for us in kill_siblings, we may be the last one it
+    // waits for
+    pie = spin_lock_irqsave(&exit_lock);
+    left = __atomic_sub_fetch(&current_proc->nthr, 1, __ATOMIC_ACQ_REL);
+    if (left == 1 && current_proc->exiting)
+        condition_broadcast(&current_proc->thr_exited);
+    spin_unlock_irqrestore(&exit_lock, pie);
+
+    if (left != 0)
+        thread_exit();
+
+    mtag = current_proc->mtag;
+    current_proc->mtag = main_mtag;
+
+    // the first process runs in the main memory space, which stays; only its
+    // user pages go
+    if (mtag == main_mtag)
+        memory_space_reclaim();
+    else
+        reap_queue(mtag);
 
     // close open io device
     for (int i = 0; i < PROCESS_IOMAX; i++) {
@@ -167,6 +253,21 @@ void __attribute__ ((noreturn)) process_exit(void) {
 
 
 
+/**
+ * ends the calling thread if the main thread of its process has exited
+ * 
+ * called on the way back to U mode
+ */
+
+void process_check_exit(void) {
+    struct process * const proc = current_process();
+
+    if (proc != NULL && proc->exiting && running_thread() != proc->tid)
+        process_exit();
+}
+
+
+
 /**
  * this function finds a process by its pid
  * 
@@ -195,3 +296,90 @@ void process_terminate(int pid) {
     // else need to cleanup 
     
 }
+
+
+
+// INTERNAL FUNCTION DEFINITIONS
+//
+
+/**
+ * makes the other threads of a process exit and waits for them
+ * 
+ * threads running in U mode exit at their next trap, at the latest on the next
+ * timer tick, and threads sleeping on a futex are woken to exit. a thread blocked
+ * in some other system call exits once the call returns; nothing wakes it, so
+ * if the call never returns (a uart read with no input) neither does this
+ * 
+ * @param proc      the process, whose main thread is the caller
+ */
+
+static void kill_siblings(struct process * proc) {
+    int pie;
+
+    __atomic_store_n(&proc->exiting, 1, __ATOMIC_RELEASE);
+    futex_cancel(proc);
+
+    pie = spin_lock_irqsave(&exit_lock);
+    while (__atomic_load_n(&proc->nthr, __ATOMIC_ACQUIRE) > 1)
+        condition_wait_spin(&proc->thr_exited, &exit_lock);
+    spin_unlock_irqrestore(&exit_lock, pie);
+}
+
+/**
+ * queues a memory space for the reaper
+ * 
+ * @param mtag      memory space tag of an exited process's space, not active on
+ *                  any hart
+ */
+
+static void reap_queue(uintptr_t mtag) {
+    int pie;
+
+    pie = spin_lock_irqsave(&reap_lock);
+
+    // the reaper is already at work on the queue, so room opens up as soon as
+    // it takes the next space off it
+    while (reap_cnt == NPROC)
+        condition_wait_spin(&reap_space, &reap_lock);
+
+    reap_list[(reap_head + reap_cnt) % NPROC] = mtag;
+    reap_cnt += 1;
+    spin_unlock_irqrestore(&reap_lock, pie);
+
+    work_queue(reaper_wq, &reap_work);
+}
+
+/**
+ * frees every memory space on the reaper's queue, a batch of pages at a time
+ * 
+ * @param wk        the reaper's work item (unused)
+ */
+
+static void reap_work_func(struct work * wk) {
+    uintptr_t mtag;
+    uintptr_t pos;
+    int pie;
+
+    // the worker only runs the reaper, so it can stay a background thread
+    thread_set_background();
+
+    for (;;) {
+        pie = spin_lock_irqsave(&reap_lock);
+
+        if (reap_cnt == 0) {
+            spin_unlock_irqrestore(&reap_lock, pie);
+            return;
+        }
+
+        mtag = reap_list[reap_head];
+        reap_head = (reap_head + 1) % NPROC;
+        reap_cnt -= 1;
+        condition_broadcast(&reap_space);
+        spin_unlock_irqrestore(&reap_lock, pie);
+
+        pos = USER_START_VMA;
+
+        while (!memory_space_destroy_some(mtag, &pos, REAP_BATCH))
+            thread_yield();
+    }
+}
@@ -30,7 +30,10 @@
 
 struct process {
     int id; // process id of this process
-    int tid; // thread id of associated thread
+    int tid; // thread id of the process's first thread
+    int nthr; // threads of the process that have not exited
+    volatile char exiting; // main thread has exited; the others follow (process_exit)
+    struct condition thr_exited; // signaled when nthr drops to 1 while exiting
     uintptr_t mtag; // memory space identifier
     struct io_intf * iotab[PROCESS_IOMAX];
 
@@ -54,8 +57,22 @@ extern struct process * proctab[];
 extern void procmgr_init(void);
 extern int process_exec(struct io_intf * exeio);
 
+// void process_exit(void)
+// Ends the calling thread. If it is the main thread of its process, first
+// makes the other threads exit and waits for them, then tears the process
+// down. Threads sleeping in futex_wait are woken to exit, but a thread blocked
+// in another system call (a device read, alarm_sleep, a struct lock) is only
+// noticed once that call returns, so the wait has no bound until then.
+
 extern void __attribute__ ((noreturn)) process_exit(void);
 
+// void process_check_exit(void)
+// Ends the calling thread if the main thread of its process has exited. Called
+// on the way back to U mode, which is where the other threads of an exiting
+// process notice that they are to exit.
+
+extern void process_check_exit(void);
+
 extern void process_terminate(int pid);
 
 static inline struct process * current_process(void);
@@ -0,0 +1,23 @@
+// rusage.h - Resource usage reported by the getrusage system call
+//
+// Shared by the kernel and user programs.
+//
+
+#ifndef _RUSAGE_H_
+#define _RUSAGE_H_
+
+#include <stdint.h>
+
+// Values of the /who/ argument of getrusage
+
+#define RUSAGE_SELF         0   // the calling thread
+#define RUSAGE_CHILDREN     (-1) // children that have been waited for
+
+struct rusage {
+    uint64_t ru_utime; // time spent in U mode, in microseconds
+    uint64_t ru_stime; // time spent in S mode, in microseconds
+    uint64_t ru_ucycles; // cycles spent in U mode
+    uint64_t ru_scycles; // cycles spent in S mode
+};
+
+#endif // _RUSAGE_H_
@@ -0,0 +1,217 @@
+// schedtrace.c - Scheduler event trace
+//
+
+#ifdef SCHEDTRACE_TRACE
+#define TRACE
+#endif
+
+#ifdef SCHEDTRACE_DEBUG
+#define DEBUG
+#endif
+
+#include "schedtrace.h"
+
+#include "config.h"
+#include "csr.h"
+#include "device.h"
+#include "error.h"
+#include "heap.h"
+#include "intr.h"
+#include "io.h"
+#include "smp.h"
+#include "string.h"
+
+#include <stddef.h>
+
+#if (SCHEDTRACE_LEN & (SCHEDTRACE_LEN - 1)) != 0
+#error "SCHEDTRACE_LEN must be a power of two"
+#endif
+
+// INTERNAL TYPE DEFINITIONS
+//
+
+struct schedtrace_event {
+    uint64_t time; // rdtime
+    uintptr_t arg;
+    int32_t tid;
+    int32_t type;
+};
+
+// A ring is written only by its own hart. head counts all events ever
+// recorded; the event with index i is in ev[i % SCHEDTRACE_LEN] until it is
+// overwritten by event i + SCHEDTRACE_LEN.
+
+struct schedtrace_ring {
+    struct schedtrace_event ev[SCHEDTRACE_LEN];
+    volatile uint64_t head;
+};
+
+// An open "trace" device. The events to read are fixed when it is opened; a
+// reader that falls behind the writer skips the events it lost.
+
+struct schedtrace_reader {
+    struct io_intf io_intf;
+    uint64_t next[NHART]; // index of next event to read
+    uint64_t end[NHART]; // ring head when opened
+    int hart; // hart whose ring we are reading
+    char line[96]; // formatted event
+    size_t linepos; // bytes of line already returned
+    size_t linelen;
+};
+
+// INTERNAL GLOBAL VARIABLES
+//
+
+static struct schedtrace_ring rings[NHART];
+
+// INTERNAL FUNCTION DECLARATIONS
+//
+
+static int schedtrace_open(struct io_intf ** ioptr, void * aux);
+static void schedtrace_close(struct io_intf * io);
+static long schedtrace_read(struct io_intf * io, void * buf, unsigned long bufsz);
+
+// Formats the next event that has not been overwritten into rd->line. Returns
+// 0 if there are no more events.
+
+static int schedtrace_next_line(struct schedtrace_reader * rd);
+
+static const struct io_ops schedtrace_io_ops = {
+    .close = schedtrace_close,
+    .read = schedtrace_read
+};
+
+// EXPORTED FUNCTION DEFINITIONS
+//
+
+void schedtrace_init(void) {
+    device_register("trace", schedtrace_open, NULL);
+}
+
+void schedtrace_record(int type, int tid, uintptr_t arg) {
+    struct schedtrace_ring * const ring = &rings[this_hart()->id];
+    const uint64_t head = ring->head;
+    struct schedtrace_event * const ev = &ring->ev[head % SCHEDTRACE_LEN];
+
+    ev->time = csrr_time();
+    ev->arg = arg;
+    ev->tid = tid;
+    ev->type = type;
+
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+// INTERNAL FUNCTION DEFINITIONS
+//
+
+int schedtrace_open(struct io_intf ** ioptr, void * aux) {
+    struct schedtrace_reader * rd;
+    uint64_t head;
+    int h;
+
+    rd = kcalloc(1, sizeof(struct schedtrace_reader));
+    if (rd == NULL)
+        return -ENOMEM;
+
+    for (h = 0; h < NHART; h++) {
+        head = __atomic_load_n(&rings[h].head, __ATOMIC_ACQUIRE);
+        rd->end[h] = head;
+        rd->next[h] = (SCHEDTRACE_LEN < head) ? head - SCHEDTRACE_LEN : 0;
+    }
+
+    rd->io_intf.ops = &schedtrace_io_ops;
+    rd->io_intf.refcnt = 1;
+    *ioptr = &rd->io_intf;
+    return 0;
+}
+
+void schedtrace_close(struct io_intf * io) {
+    kfree((void *)io - offsetof(struct schedtrace_reader, io_intf));
+}
+
+long schedtrace_read(struct io_intf * io, void * buf, unsigned long bufsz) {
+    struct schedtrace_reader * const rd =
+        (void *)io - offsetof(struct schedtrace_reader, io_intf);
+    unsigned long cnt = 0;
+    size_t n;
+
+    while (cnt < bufsz) {
+        if (rd->linepos == rd->linelen) {
+            if (!schedtrace_next_line(rd))
+                break;
+        }
+
+        n = rd->linelen - rd->linepos;
+        if (bufsz - cnt < n)
+            n = bufsz - cnt;
+        memcpy(buf + cnt, rd->line + rd->linepos, n);
+        rd->linepos += n;
+        cnt += n;
+    }
+
+    return cnt;
+}
+
+int schedtrace_next_line(struct schedtrace_reader * rd) {
+    static const char * const names[] = {
+        [SCHEDTRACE_SWITCH_OUT] = "out",
+        [SCHEDTRACE_SWITCH_IN] = "in",
+        [SCHEDTRACE_WAKEUP] = "wake",
+        [SCHEDTRACE_BLOCK] = "block",
+        [SCHEDTRACE_INTR_ENTER] = "irq",
+        [SCHEDTRACE_INTR_EXIT] = "iret"
+    };
+
+    struct schedtrace_ring * ring;
+    struct schedtrace_event ev;
+    uint64_t head;
+    int h;
+
+    for (h = rd->hart; h < NHART; h++) {
+        ring = &rings[h];
+
+        while (rd->next[h] < rd->end[h]) {
+            ev = ring->ev[rd->next[h] % SCHEDTRACE_LEN];
+            rd->next[h] += 1;
+
+            // If the writer has since wrapped around onto the slot we copied,
+            // the copy may be torn. Drop it and skip everything it lost.
+
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+            if (head - (rd->next[h] - 1) > SCHEDTRACE_LEN) {
+                if (rd->next[h] < head - SCHEDTRACE_LEN)
+                    rd->next[h] = head - SCHEDTRACE_LEN;
+                continue;
+            }
+
+            if (ev.type < SCHEDTRACE_SWITCH_OUT ||
+                SCHEDTRACE_INTR_EXIT < ev.type)
+                continue;
+
+            if (ev.type == SCHEDTRACE_SWITCH_IN ||
+                ev.type == SCHEDTRACE_BLOCK)
+            {
+                rd->linelen = snprintf(rd->line, sizeof(rd->line),
+                    "%lu %d %s %d %s\n", (unsigned long)ev.time, h,
+                    names[ev.type], (int)ev.tid,
+                    (ev.arg != 0) ? (const char *)ev.arg : "-");
+            } else {
+                rd->linelen = snprintf(rd->line, sizeof(rd->line),
+                    "%lu %d %s %d %lu\n", (unsigned long)ev.time, h,
+                    names[ev.type], (int)ev.tid, (unsigned long)ev.arg);
+            }
+
+            if (sizeof(rd->line) - 1 < rd->linelen)
+                rd->linelen = sizeof(rd->line) - 1;
+
+            rd->linepos = 0;
+            rd->hart = h;
+            return 1;
+        }
+    }
+
+    rd->hart = NHART;
+    return 0;
+}
@@ -0,0 +1,80 @@
+// schedtrace.h - Scheduler event trace
+//
+// Scheduler and interrupt events are recorded with a timestamp into a ring
+// buffer per hart. Each hart writes only its own ring, with interrupts
+// disabled, so recording takes no lock. The rings can be read as text through
+// the "trace" device; src/util/trace2chrome.py converts the text to the Chrome
+// trace event format.
+//
+
+#ifndef _SCHEDTRACE_H_
+#define _SCHEDTRACE_H_
+
+#include <stdint.h>
+
+// COMPILE-TIME PARAMETERS
+//
+
+// Set SCHEDTRACE to 0 to compile out all trace points.
+
+#ifndef SCHEDTRACE
+#define SCHEDTRACE 1
+#endif
+
+// Number of events kept per hart. Must be a power of two.
+
+#ifndef SCHEDTRACE_LEN
+#define SCHEDTRACE_LEN 1024
+#endif
+
+// EXPORTED CONSTANT DEFINITIONS
+//
+
+// Event types. The meaning of /tid/ and /arg/ in schedtrace() depends on the
+// type:
+//
+//   SCHEDTRACE_SWITCH_OUT  tid stops running; arg is its new thread state
+//   SCHEDTRACE_SWITCH_IN   tid starts running; arg is its name (const char *)
+//   SCHEDTRACE_WAKEUP      tid is made ready; arg is the waking thread's tid
+//   SCHEDTRACE_BLOCK       tid waits; arg is the condition name (const char *)
+//   SCHEDTRACE_INTR_ENTER  interrupt taken in tid; arg is the scause code
+//   SCHEDTRACE_INTR_EXIT   interrupt handled; arg is the scause code
+
+#define SCHEDTRACE_SWITCH_OUT   1
+#define SCHEDTRACE_SWITCH_IN    2
+#define SCHEDTRACE_WAKEUP       3
+#define SCHEDTRACE_BLOCK        4
+#define SCHEDTRACE_INTR_ENTER   5
+#define SCHEDTRACE_INTR_EXIT    6
+
+// EXPORTED FUNCTION DECLARATIONS
+//
+
+// void schedtrace_init(void)
+// Registers the "trace" device. Opening it takes a snapshot of the rings;
+// reading it returns one line per event:
+//
+//   <rdtime> <hart> <event> <tid> <arg>
+//
+// where <event> is one of out, in, wake, block, irq, iret, and <arg> is a
+// number or a name, depending on the event.
+
+extern void schedtrace_init(void);
+
+// void schedtrace(int type, int tid, uintptr_t arg)
+// Records an event on this hart. Must be called with interrupts disabled.
+
+static inline void schedtrace(int type, int tid, uintptr_t arg);
+
+extern void schedtrace_record(int type, int tid, uintptr_t arg);
+
+// INLINE FUNCTION DEFINITIONS
+//
+
+static inline void schedtrace(int type, int tid, uintptr_t arg) {
+#if SCHEDTRACE
+    schedtrace_record(type, tid, arg);
+#endif
+}
+
+#endif // _SCHEDTRACE_H_
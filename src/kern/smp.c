@@ -0,0 +1,174 @@
+// smp.c - Multiple hart support
+//
+// All harts start in start.s. Hart 0 goes on to main; the others announce
+// themselves in smp_hart_present and spin until smp_init hands each of them an
+// idle thread and a stack. From then on every hart schedules threads from its
+// own run queue (see thread.c) and takes timer and external interrupts.
+//
+// Harts signal each other by writing the CLINT msip register of the target
+// hart. The resulting M mode software interrupt is forwarded to S mode as SSIP
+// by _mmode_trap_entry, and lands in smp_ipi_handler.
+//
+
+#ifndef TRACE
+#ifdef SMP_TRACE
+#define TRACE
+#endif
+#endif
+
+#ifndef DEBUG
+#ifdef SMP_DEBUG
+#define DEBUG
+#endif
+#endif
+
+#include "smp.h"
+
+#include "console.h"
+#include "csr.h"
+#include "halt.h"
+#include "intr.h"
+#include "memory.h"
+#include "plic.h"
+#include "thread.h"
+#include "timer.h"
+
+// INTERNAL CONSTANT DEFINITIONS
+//
+
+#define MSIP_ADDR 0x2000000 // CLINT msip register of hart 0
+
+// EXPORTED GLOBAL VARIABLE DEFINITIONS
+//
+
+struct hart harts[NHART];
+int smp_hart_cnt = 1;
+
+// The following are used by start.s, before the hart has a stack.
+
+const int smp_nhart = NHART; // harts with mhartid >= smp_nhart are parked
+volatile char smp_hart_present[NHART]; // set by each hart that started
+void * volatile smp_boot_sp[NHART]; // written by smp_init to release a hart
+struct thread * smp_boot_thr[NHART]; // thread pointer for released hart
+uint64_t _mmode_scratch[NHART][2]; // register save area for _mmode_trap_entry
+
+// INTERNAL FUNCTION DECLARATIONS
+//
+
+// Entered from start.s on a secondary hart once it has been released by
+// smp_init. Runs on the hart's idle thread and does not return.
+
+extern void __attribute__ ((noreturn)) smp_hart_main(int hartid);
+
+// EXPORTED FUNCTION DEFINITIONS
+//
+
+void smp_init(void) {
+    void * anchor;
+    int i;
+
+    trace("%s()", __func__);
+
+    harts[0].online = 1;
+
+    // The other harts marked themselves present long before the boot hart
+    // gets here, since they do nothing else.
+
+    for (i = 1; i < NHART; i++) {
+        if (!smp_hart_present[i])
+            continue;
+
+        harts[i].id = i;
+        smp_boot_thr[i] = thread_create_idle(&harts[i], &anchor);
+
+        if (smp_boot_thr[i] == NULL) {
+            kprintf("hart %d: no memory for idle thread\n", i);
+            continue;
+        }
+
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        smp_boot_sp[i] = anchor;
+
+        while (!harts[i].online)
+            continue;
+
+        smp_hart_cnt += 1;
+    }
+
+    kprintf("%d hart%s online\n", smp_hart_cnt, (smp_hart_cnt == 1) ? "" : "s");
+}
+
+void smp_send_ipi(struct hart * h, unsigned int reason) {
+    __atomic_fetch_or(&h->ipi_pending, reason, __ATOMIC_RELEASE);
+    *(volatile uint32_t*)(MSIP_ADDR + 4*(uintptr_t)h->id) = 1;
+}
+
+void smp_ipi_handler(void) {
+    struct hart * const h = this_hart();
+    unsigned int pending;
+
+    csrc_sip(RISCV_SIP_SSIP);
+    pending = __atomic_exchange_n(&h->ipi_pending, 0, __ATOMIC_ACQUIRE);
+
+    if (pending & IPI_TLB) {
+        const unsigned long req = h->tlb_req;
+        asm volatile ("sfence.vma" ::: "memory");
+        __atomic_store_n(&h->tlb_done, req, __ATOMIC_RELEASE);
+    }
+
+    // IPI_RESCHED needs no work here: the interrupt woke the idle thread from
+    // wfi, or intr_handler will call thread_preempt on the way back to U mode.
+}
+
+void smp_tlb_shootdown(void) {
+    unsigned long req[NHART];
+    int pie;
+    int i;
+
+    pie = intr_disable();
+
+    asm volatile ("sfence.vma" ::: "memory");
+
+    for (i = 0; i < NHART; i++) {
+        if (&harts[i] == this_hart() || !harts[i].online)
+            continue;
+        req[i] = __atomic_add_fetch(&harts[i].tlb_req, 1, __ATOMIC_ACQ_REL);
+        smp_send_ipi(&harts[i], IPI_TLB);
+    }
+
+    // While we wait, another hart may be waiting for us to do the same, so
+    // keep handling our own IPIs.
+
+    for (i = 0; i < NHART; i++) {
+        if (&harts[i] == this_hart() || !harts[i].online)
+            continue;
+        while ((long)(__atomic_load_n(&harts[i].tlb_done, __ATOMIC_ACQUIRE)
+            - req[i]) < 0)
+        {
+            if (csrr_sip() & RISCV_SIP_SSIP)
+                smp_ipi_handler();
+        }
+    }
+
+    intr_restore(pie);
+}
+
+// INTERNAL FUNCTION DEFINITIONS
+//
+
+void smp_hart_main(int hartid) {
+    struct hart * const h = &harts[hartid];
+
+    trace("%s(hartid=%d)", __func__, hartid);
+
+    csrs_sstatus(RISCV_SSTATUS_SUM);
+    csrw_sip(0);
+    plic_init_hart(hartid);
+    csrw_sie(RISCV_SIE_SEIE | RISCV_SIE_SSIE);
+    timer_init_hart();
+
+    h->online = 1;
+    intr_enable();
+
+    thread_idle_loop();
+}
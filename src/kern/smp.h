@@ -0,0 +1,87 @@
+// smp.h - Multiple hart support
+//
+
+#ifndef _SMP_H_
+#define _SMP_H_
+
+#include <stdint.h>
+
+#include "config.h"
+
+// EXPORTED CONSTANT DEFINITIONS
+//
+
+// Reasons for an inter-processor interrupt, ORed into struct hart ipi_pending.
+
+#define IPI_RESCHED (1 << 0) // a thread was made ready for this hart
+#define IPI_TLB     (1 << 1) // flush the TLB (see smp_tlb_shootdown)
+
+// EXPORTED TYPE DEFINITIONS
+//
+
+struct thread; // forward decl.
+
+// Per-hart state. Fields other than ipi_pending and the TLB shootdown counters
+// are only written by the hart itself.
+
+struct hart {
+    int id; // mhartid
+    volatile char online; // taking interrupts and scheduling threads
+    volatile char idling; // idle thread is about to wfi or in wfi
+    struct thread * idle; // this hart's idle thread
+    volatile unsigned int ipi_pending; // IPI_ bits
+    volatile unsigned long tlb_req; // shootdowns requested of this hart
+    volatile unsigned long tlb_done; // shootdowns completed by this hart
+    uint64_t next_tick; // time of next scheduler tick (timer.c)
+    char tickless; // scheduler tick stopped while idle (timer.c)
+    uint64_t budget_end; // when the running thread's RT budget runs out, or 0 (timer.c)
+    unsigned long idle_wakeups; // times the idle thread returned from wfi
+    struct thread * fp_owner; // thread whose FP state was last loaded here
+    char in_intr; // in intr_handler
+    char handoff; // a thread woken by an ISR is waiting to run (thread.c)
+    unsigned int handoffs; // ISR wake hand-offs since the last tick
+};
+
+// EXPORTED VARIABLE DECLARATIONS
+//
+
+extern struct hart harts[NHART];
+extern int smp_hart_cnt; // number of harts online
+
+// EXPORTED FUNCTION DECLARATIONS
+//
+
+// void smp_init(void)
+// Starts the secondary harts that are waiting in start.s. Must be called by
+// the boot hart after the thread manager, interrupt controller and timer are
+// initialized.
+
+extern void smp_init(void);
+
+// struct hart * this_hart(void)
+// Returns the per-hart state of the hart executing the caller. The result is
+// only stable while interrupts are disabled, since a thread may be moved to
+// another hart when it is preempted. (Defined in thread.c.)
+
+extern struct hart * this_hart(void);
+
+// void smp_send_ipi(struct hart * h, unsigned int reason)
+// Raises a software interrupt on hart /h/. The /reason/ bits are delivered to
+// smp_ipi_handler on that hart.
+
+extern void smp_send_ipi(struct hart * h, unsigned int reason);
+
+// void smp_ipi_handler(void)
+// Called from intr_handler for a supervisor software interrupt.
+
+extern void smp_ipi_handler(void);
+
+// void smp_tlb_shootdown(void)
+// Flushes the TLB of every online hart, including this one, and returns when
+// all of them have done so. Needed after changing a global mapping. Must not
+// be called with a spinlock held, since other harts may be spinning on it with
+// interrupts disabled.
+
+extern void smp_tlb_shootdown(void);
+
+#endif // _SMP_H_
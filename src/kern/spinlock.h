@@ -0,0 +1,109 @@
+// spinlock.h - Busy-waiting lock for data shared between harts
+//
+// A spinlock protects short critical sections that may run concurrently on
+// several harts, or on one hart and in an ISR on another. Code that sleeps must
+// not hold a spinlock; use a struct lock (lock.h) instead, or release the
+// spinlock while waiting with condition_wait_spin.
+//
+
+#ifndef _SPINLOCK_H_
+#define _SPINLOCK_H_
+
+#include "intr.h"
+#include "thread.h"
+
+struct spinlock {
+    volatile int locked; // 1 while held
+    const char * name;
+};
+
+#define SPINLOCK_INIT(nm) { .locked = 0, .name = (nm) }
+
+// EXPORTED FUNCTION DECLARATIONS
+//
+
+// void spinlock_init(struct spinlock * lk, const char * name)
+// Initializes an unlocked spinlock. A zero-initialized struct spinlock is also
+// unlocked.
+
+static inline void spinlock_init(struct spinlock * lk, const char * name);
+
+// void spin_lock(struct spinlock * lk)
+// void spin_unlock(struct spinlock * lk)
+// Acquire and release a spinlock. If the lock is also taken by an ISR, the
+// caller must have disabled interrupts, or use the _irqsave variants below.
+// The running thread cannot be preempted while it holds a spinlock (see
+// preempt_disable in thread.h).
+
+static inline void spin_lock(struct spinlock * lk);
+static inline void spin_unlock(struct spinlock * lk);
+
+// int spin_trylock(struct spinlock * lk)
+// Acquires the lock if it is free. Returns 1 if it was acquired, 0 otherwise.
+
+static inline int spin_trylock(struct spinlock * lk);
+
+// int spin_lock_irqsave(struct spinlock * lk)
+// void spin_unlock_irqrestore(struct spinlock * lk, int saved_intr_state)
+// Disable interrupts on this hart and acquire the lock, then release it and
+// restore the previous interrupt state.
+
+static inline int spin_lock_irqsave(struct spinlock * lk);
+static inline void spin_unlock_irqrestore (
+    struct spinlock * lk, int saved_intr_state);
+
+// INLINE FUNCTION DEFINITIONS
+//
+
+static inline void spinlock_init(struct spinlock * lk, const char * name) {
+    lk->locked = 0;
+    lk->name = name;
+}
+
+static inline void spin_lock(struct spinlock * lk) {
+    preempt_disable();
+
+    // amoswap.w.aq; spin on plain loads while the lock is held to keep the
+    // cache line shared until it is released.
+
+    while (__atomic_exchange_n(&lk->locked, 1, __ATOMIC_ACQUIRE) != 0) {
+        while (lk->locked)
+            continue;
+    }
+}
+
+static inline int spin_trylock(struct spinlock * lk) {
+    preempt_disable();
+
+    if (__atomic_exchange_n(&lk->locked, 1, __ATOMIC_ACQUIRE) == 0)
+        return 1;
+
+    preempt_enable();
+    return 0;
+}
+
+static inline void spin_unlock(struct spinlock * lk) {
+    __atomic_store_n(&lk->locked, 0, __ATOMIC_RELEASE);
+    preempt_enable();
+}
+
+static inline int spin_lock_irqsave(struct spinlock * lk) {
+    int saved_intr_state;
+
+    saved_intr_state = intr_disable();
+    spin_lock(lk);
+    return saved_intr_state;
+}
+
+static inline void spin_unlock_irqrestore (
+    struct spinlock * lk, int saved_intr_state)
+{
+    // Restore interrupts before leaving the preempt_disable section, so that a
+    // deferred preemption can happen right away.
+
+    __atomic_store_n(&lk->locked, 0, __ATOMIC_RELEASE);
+    intr_restore(saved_intr_state);
+    preempt_enable();
+}
+
+#endif // _SPINLOCK_H_
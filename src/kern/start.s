@@ -1,5 +1,15 @@
         .section	.text
-        
+
+        # All harts start here. Keep the hart id in s1. Harts beyond what the
+        # kernel was built for are parked for good.
+
+        csrr    s1, mhartid
+        la      t0, smp_nhart
+        lw      t0, 0(t0)
+        bltu    s1, t0, 1f
+2:      wfi
+        j       2b
+1:
         # Delegate to S mode all S mode interrupts and all exceptions except
         # ecall from S mode and M mode; ecalls from S mode are used to provide
         # access to the timer to S mode. Enable M mode interrupts.
@@ -28,6 +38,16 @@
         csrs    mcounteren, 7
         csrs    scounteren, 7
 
+        # Give the M mode trap handler a per-hart register save area, and
+        # enable M mode software interrupts, which carry IPIs (see smp.c).
+
+        la      t0, _mmode_scratch
+        slli    t1, s1, 4
+        add     t0, t0, t1
+        csrw    mscratch, t0
+        li      t0, 0x8 # MSIE
+        csrs    mie, t0
+
         # Switch to S mode
 
         li      t0, 0x1080 # bits to clear in mstatus (MPP=01,MPIE=0)
@@ -38,6 +58,7 @@
         csrw    mepc, t0
         mret
 1:      
+        bnez    s1, secondary_hart
 
         # Set stack pointer. The main thread uses a statically-allocated stack
         # in the .data section.
@@ -51,10 +72,43 @@
         bnez    a0, halt_failure
         j       halt_success
 
+secondary_hart:
+
+        # Tell the boot hart we are here, then wait for smp_init to give us a
+        # stack (in the kernel stack region, so we need the main memory space)
+        # and our idle thread.
+
+        la      t0, smp_hart_present
+        add     t0, t0, s1
+        li      t1, 1
+        sb      t1, 0(t0)
+
+        la      t0, smp_boot_sp
+        slli    t1, s1, 3
+        add     t0, t0, t1
+1:      ld      t2, 0(t0)
+        beqz    t2, 1b
+        fence   r, rw
+
+        la      t0, main_mtag
+        ld      t0, 0(t0)
+        csrw    satp, t0
+        sfence.vma
+
+        la      t0, smp_boot_thr
+        add     t0, t0, t1
+        ld      tp, 0(t0)
+        mv      sp, t2
+        mv      fp, zero
+
+        mv      a0, s1
+        call    smp_hart_main   # does not return
+        j       halt_failure
+
         .section        .data.stack, "wa", @progbits
         .balign		16
         
-        .equ		MAIN_STACK_SIZE, 4096
+        .equ		MAIN_STACK_SIZE, 16384 # same as KSTACK_SIZE
 
         .global		_main_stack_lowest
         .type		_main_stack_lowest, @object
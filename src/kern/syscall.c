@@ -14,6 +14,18 @@
 #include "timer.h"
 #include "heap.h"
 #include "kfs.h"
+#include "arena.h"
+#include "spinlock.h"
+#include "rusage.h"
+#include "futex.h"
+
+// Longest device or file name copied in from user space, including the
+// terminating null.
+
+#define SYSCALL_NAMELEN (FS_NAMELEN + 1)
+
+static int scratch_strcpy (
+    struct arena * scratch, const char * ustr, size_t bufsz, const char ** kstrp);
 
 /**
  * sysexit - Exits the current process
@@ -26,7 +38,8 @@
  * 
  * @return          does not return under normal circumstances, as process is terminated
  */
-static int sysexit(void){
+static int sysexit(struct arena * scratch){
+    arena_release(scratch); // process_exit does not come back to release it
     process_exit(); // Terminate current process
     return 0; // should never be reached
 }
@@ -66,15 +79,17 @@ static int sysmsgout(const char *msg){
  * it with a file descriptor in the fd table. The device is identified by
  * its name and instance number, which is provided by the user program
  * 
+ * @param scratch   syscall scratch arena for the kernel copy of the name
  * @param fd        file descriptor to associate with the device.
  * @param name      Null-terminated string representing device name
  * @param instno    Instance number of the device to open.
  * 
  * @return          0 on success, -EMFILE(-10) if fd is out of range,
- *                  -EINVAL(-1) if device name is invalid or memory validation fails,
+ *                  -EINVAL(-1) if device name is invalid, too long or memory validation fails,
+ *                  -ENOMEM if there is no memory for the kernel copy of the name,
  *                  negative value from 'device_open' if device can't be opened
  */
-static int sysdevopen(int fd, const char *name, int instno){
+static int sysdevopen(struct arena *scratch, int fd, const char *name, int instno){
     if (fd < 0 || fd >= PROCESS_IOMAX){
         return -EMFILE; //FD out of range
     }
@@ -83,9 +98,15 @@ static int sysdevopen(int fd, const char *name, int instno){
         return -EINVAL; //invalid file name
     } 
 
+    // work on a kernel copy so the name cannot change under device_open
+    int result = scratch_strcpy(scratch, name, SYSCALL_NAMELEN, &name);
+    if (result < 0){
+        return result; // name too long or out of memory
+    }
+
     struct io_intf *dev_io = NULL;
     // Attempt to open the device 
-    int result = device_open(&dev_io, name, instno);
+    result = device_open(&dev_io, name, instno);
     if(result < 0){
         return result; // return error code from device open 
     }
@@ -101,14 +122,17 @@ static int sysdevopen(int fd, const char *name, int instno){
  * This syscall opens a file identified by its name an associates it with 
  * a file descriptor in the fd table. File is accessed through file system.
  * 
+ * @param scratch   syscall scratch arena for the kernel copy of the name
  * @param fd        File descriptor to associate with the opened file
  * @param name      Null-terminated string representing file name
  * 
  * @return          0 on success, -EMFILE if fd is out of range, 
- *                  -EINVAL if file name pointer is invalid or fails memory validation.
+ *                  -EINVAL if file name pointer is invalid, the name is too long or it fails
+ *                  memory validation.
+ *                  -ENOMEM if there is no memory for the kernel copy of the name.
  *                  Negative value from fs_open if file cannot be opened
  */
-static int sysfsopen(int fd, const char *name){
+static int sysfsopen(struct arena *scratch, int fd, const char *name){
     if (fd < 0 || fd >= PROCESS_IOMAX){
         return -EMFILE; // Invalid file name
     }
@@ -116,8 +140,13 @@ static int sysfsopen(int fd, const char *name){
         return -EINVAL; // Invalid file name
     }
 
+    int result = scratch_strcpy(scratch, name, SYSCALL_NAMELEN, &name);
+    if(result < 0){
+        return result; // name too long or out of memory
+    }
+
     struct io_intf *fs_io = NULL;
-    int result = fs_open(name, &fs_io);
+    result = fs_open(name, &fs_io);
     if(result < 0){
         return result;
     }
@@ -246,11 +275,18 @@ static int sysioctl(int fd, int cmd, void *arg){
             }
             break;
 
+        case IOCTL_SETNBIO:
+            // The kernel only reads `arg`
+            if (memory_validate_vptr_len(arg, sizeof(int), PTE_R | PTE_U) != 0) {
+                return -EINVAL; // Invalid or inaccessible `arg` pointer
+            }
+            break;
+
         default:
             return -ENOTSUP; // Unsupported command
     }
 
-    return proc->iotab[fd]->ops->ctl(proc->iotab[fd], cmd, arg);
+    return ioctl(proc->iotab[fd], cmd, arg);
 
 }
 
@@ -261,13 +297,19 @@ static int sysioctl(int fd, int cmd, void *arg){
  * Validates the file descriptor and ensures it points to an executable. 
  * If valid, starts execution.
  *
+ * @param scratch   syscall scratch arena, released before the new image starts
  * @param fd    File descriptor pointing to the executable.
  *
  * @return      0 on success, or a negative error code.
  */
-static int sysexec(int fd){ //assume process exec handles cleanup of fd table
+static int sysexec(struct arena *scratch, int fd){ //assume process exec handles cleanup of fd table
     struct process* curr_process = current_process();
 
+    // the new image would replace the memory other threads are running in
+    if (curr_process->nthr > 1) {
+        return -EBUSY;
+    }
+
     // Validate file descriptor
     if (fd < 0 || fd >= PROCESS_IOMAX || curr_process->iotab[fd] == NULL) {
         return -EBADFD; // Invalid or unused file descriptor
@@ -276,6 +318,9 @@ static int sysexec(int fd){ //assume process exec handles cleanup of fd table
     struct io_intf* arg = curr_process->iotab[fd]; // get the argument into process_exec before clearing
     curr_process->iotab[fd] = NULL;
 
+    // process_exec does not return on success
+    arena_release(scratch);
+
     // Execute the program
     return process_exec(arg);
 }
@@ -330,31 +375,50 @@ static int sysusleep(unsigned long us){
  * @brief Creates a new child process by forking the current process's state.
  *
  * @param tfr A pointer to the trap frame representing the current process's state.
- * @return The ID of the newly created child process to the parent, or -1 if the operation fails.
+ * @return The thread ID of the newly created child process's thread to the parent, which
+ *         it can pass to syswait, or a negative value if the operation fails.
  */
 static int sysfork(const struct trap_frame *tfr){
-    //make a child process
+    // protects the search for a free proctab slot against forks on other harts.
+    // the slot is only reserved under the lock; the child is allocated with the
+    // lock dropped and published in the slot once it is set up
+    static struct spinlock proctab_lock = SPINLOCK_INIT("proctab");
+    static char proctab_reserved[NPROC];
+    struct process *current_proc = current_process();
+    //make a child process. The struct lives as long as the child does, so it
+    //comes from the heap rather than the syscall scratch arena.
     struct process *child_proc;
-    for(int i = 0; i < 16; i++){ //16 is NPROC, the number of processes
-        if(proctab[i] == NULL){
-            child_proc = kmalloc(sizeof(struct process));
-            proctab[i] = child_proc;
+    int child_id = -1;
+    int pie;
+
+    pie = spin_lock_irqsave(&proctab_lock);
+    for(int i = 0; i < NPROC; i++){
+        if(proctab[i] == NULL && !proctab_reserved[i]){
+            proctab_reserved[i] = 1;
+            child_id = i;
             break;
         }
     }
-    // ensure child proc is not null and is properly allocated
-    if(!child_proc){
+    spin_unlock_irqrestore(&proctab_lock, pie);
+
+    if(child_id < 0){
         return -1;
     }
-    // find the index into proctab array that child proc lives and set that as the tid for child
-    struct process *current_proc = current_process();
-    for(int i = 0; i < 16; i++){
-        if(proctab[i] == child_proc){
-            child_proc->id = i;
-            break;
-        }
+
+    // ensure child proc is properly allocated, giving the slot back if not
+    child_proc = kcalloc(1, sizeof(struct process));
+    if(!child_proc){
+        pie = spin_lock_irqsave(&proctab_lock);
+        proctab_reserved[child_id] = 0;
+        spin_unlock_irqrestore(&proctab_lock, pie);
+        return -ENOMEM;
     }
+
+    // the index into proctab array where child proc lives is its id
+    child_proc->id = child_id;
     child_proc->tid = -1; // Will be set by thread_fork_to_user
+    child_proc->nthr = 1;
+    condition_init(&child_proc->thr_exited, "thr_exited");
     child_proc->mtag = 0; // Will be set by memory_space_clone in thread_fork_to_user
 
     // copy over iotab array to child, incrementing refcnt if io_intf exists
@@ -365,24 +429,34 @@ static int sysfork(const struct trap_frame *tfr){
         child_proc->iotab[j] = current_proc->iotab[j];
     }
 
+    // publish the child before its thread can run
+    pie = spin_lock_irqsave(&proctab_lock);
+    proctab[child_id] = child_proc;
+    proctab_reserved[child_id] = 0;
+    spin_unlock_irqrestore(&proctab_lock, pie);
+
     // call thread fork to user to finish forking
     int result = thread_fork_to_user(child_proc, tfr);
 
-    // if it fails, set the memory assigned to child proc to 0 and decrement the refcnt
+    // if it fails, give the proctab slot back before freeing the child and
+    // decrement the refcnt
     if(result<0){
-        memset(child_proc, 0, sizeof(struct process));
-        proctab[child_proc->id] = NULL;
+        pie = spin_lock_irqsave(&proctab_lock);
+        proctab[child_id] = NULL;
+        spin_unlock_irqrestore(&proctab_lock, pie);
 
         //decrement refcnt
         for(int j = 0; j < PROCESS_IOMAX; j++){
             if (current_proc->iotab[j]) 
                 ioclose(current_proc->iotab[j]);
         }
+
+        kfree(child_proc);
         return result;
     }
     
-    //return child proc id to parent
-    return child_proc->id;
+    //return child's thread id to parent, so it can wait for that child
+    return child_proc->tid;
 
 }
 
@@ -498,26 +572,166 @@ static int sysprognames (void * arg) {
 
 
 
+/**
+ * @brief Creates another thread in the calling process.
+ *
+ * The new thread shares the caller's memory space and open files. It starts at
+ * upc on its own stack, with a0 and a1 as arguments, and is joined with wait.
+ *
+ * @param upc   user mode entry point of the new thread
+ * @param usp   top of the new thread's user stack, 16-byte aligned
+ * @param a0    first argument of the new thread
+ * @param a1    second argument of the new thread
+ * @return The thread id of the new thread, or a negative error code.
+ */
+static int systhrcreate(uintptr_t upc, uintptr_t usp, uintptr_t a0, uintptr_t a1) {
+    struct process * const proc = current_process();
+    int tid;
+
+    trace("%s(upc=%p,usp=%p)", __func__, (void*)upc, (void*)usp);
+
+    if (upc < USER_START_VMA || USER_END_VMA <= upc) {
+        return -EINVAL;
+    }
+
+    if (usp <= USER_START_VMA || USER_END_VMA < usp || usp % 16 != 0) {
+        return -EINVAL;
+    }
+
+    __atomic_add_fetch(&proc->nthr, 1, __ATOMIC_ACQ_REL);
+
+    tid = thread_create_user(usp, upc, a0, a1);
+
+    if (tid < 0) {
+        __atomic_sub_fetch(&proc->nthr, 1, __ATOMIC_ACQ_REL);
+    }
+
+    return tid;
+}
+
+
+
+/**
+ * @brief Sleeps until another thread wakes the futex at uaddr.
+ *
+ * @param uaddr         user word to wait on, 4-byte aligned
+ * @param val           value the word is expected to hold
+ * @param timeout_us    longest time to sleep in microseconds, or 0 to wait
+ *                      without a timeout
+ * @return 0 when woken, -EAGAIN if the word no longer holds val, -ETIMEDOUT
+ *         if the timeout expired, or -EINVAL if uaddr is invalid.
+ */
+static int sysfutexwait(const int * uaddr, int val, unsigned long timeout_us) {
+    const uint64_t tick_per_us = TIMER_FREQ / 1000000;
+
+    // A timeout too large to convert waits as long as possible instead of
+    // wrapping around to a short one (or to 0, no timeout).
+
+    if (UINT64_MAX / tick_per_us < timeout_us)
+        return futex_wait(uaddr, val, UINT64_MAX);
+
+    return futex_wait(uaddr, val, timeout_us * tick_per_us);
+}
+
+
+
+/**
+ * @brief Wakes threads sleeping on the futex at uaddr.
+ *
+ * @param uaddr     user word the threads wait on
+ * @param cnt       largest number of threads to wake
+ * @return The number of threads woken, or -EINVAL if uaddr is invalid.
+ */
+static int sysfutexwake(const int * uaddr, int cnt) {
+    return futex_wake(uaddr, cnt);
+}
+
+
+
+/**
+ * @brief Returns the CPU time used by the calling thread or its children.
+ *
+ * @param who   RUSAGE_SELF for the calling thread, or RUSAGE_CHILDREN for the
+ *              children it has waited for
+ * @param ru    user pointer to the struct rusage to fill in
+ * @return 0 on success, or -EINVAL if who or ru is invalid.
+ */
+static int sysgetrusage(int who, struct rusage * ru) {
+    struct rusage kru;
+    int result;
+
+    if (memory_validate_vptr_len(ru, sizeof(struct rusage), PTE_W | PTE_U) != 0)
+        return -EINVAL;
+
+    result = thread_getrusage(who, &kru);
+
+    if (result == 0)
+        *ru = kru;
+
+    return result;
+}
+
+
+
+/**
+ * @brief Makes the calling thread a periodic real-time thread, scheduled
+ *        earliest deadline first ahead of normal threads.
+ *
+ * @param period_us     length of each period in microseconds, or 0 to make
+ *                      the thread a normal thread again
+ * @param budget_us     CPU time the thread may use in each period, in
+ *                      microseconds
+ * @return 0 on success, or -EINVAL if budget_us is 0 or longer than period_us,
+ *         or either is too large to convert to timer ticks.
+ */
+static int sysrtset(unsigned long period_us, unsigned long budget_us) {
+    const uint64_t tick_per_us = TIMER_FREQ / 1000000;
+
+    // A period that wrapped around could come out as 0, which would quietly
+    // make the thread a normal thread again.
+
+    if (UINT64_MAX / tick_per_us < period_us ||
+        UINT64_MAX / tick_per_us < budget_us)
+        return -EINVAL;
+
+    return thread_rt_set(period_us * tick_per_us, budget_us * tick_per_us);
+}
+
+
+
+/**
+ * @brief Sleeps until the calling real-time thread's next period starts.
+ *
+ * @return The number of deadlines missed since the previous call, or -EINVAL
+ *         if the thread is not a real-time thread.
+ */
+static int sysrtwait(void) {
+    return thread_rt_wait();
+}
+
+
+
 /**
  * syscall - Dispatches the appropriate system call.
  *
- * @param tfr   Trap frame containing syscall information and arguments.
+ * @param tfr       Trap frame containing syscall information and arguments.
+ * @param scratch   arena for memory that only lives until the syscall returns
  * @return      The result of the system call or an error code.
  */
-int64_t syscall(struct trap_frame * tfr){
+int64_t syscall(struct trap_frame * tfr, struct arena * scratch){
     const uint64_t * const a = tfr->x + TFR_A0;
     switch(a[7]){
         case SYSCALL_EXIT:
-            return sysexit();
+            return sysexit(scratch);
 
         case SYSCALL_MSGOUT:
             return sysmsgout((const char*) a[0]);
             
         case SYSCALL_DEVOPEN:
-            return sysdevopen(a[0], (const char*)a[1], a[2]);
+            return sysdevopen(scratch, a[0], (const char*)a[1], a[2]);
             
         case SYSCALL_FSOPEN:
-            return sysfsopen(a[0], (const char*)a[1]);
+            return sysfsopen(scratch, a[0], (const char*)a[1]);
             
         case SYSCALL_CLOSE:
             return sysclose(a[0]);
@@ -532,7 +746,7 @@ int64_t syscall(struct trap_frame * tfr){
             return sysioctl(a[0], a[1], (void *)a[2]);
             
         case SYSCALL_EXEC:
-            return sysexec(a[0]);
+            return sysexec(scratch, a[0]);
             
         case SYSCALL_WAIT:
             return syswait(a[0]);
@@ -555,6 +769,24 @@ int64_t syscall(struct trap_frame * tfr){
         case SYSCALL_PROCS:
             return sysrunningprocs((int *)a[0], (char *)a[1]);
 
+        case SYSCALL_GETRUSAGE:
+            return sysgetrusage(a[0], (struct rusage *)a[1]);
+
+        case SYSCALL_THRCREATE:
+            return systhrcreate(a[0], a[1], a[2], a[3]);
+
+        case SYSCALL_FUTEX_WAIT:
+            return sysfutexwait((const int *)a[0], a[1], a[2]);
+
+        case SYSCALL_FUTEX_WAKE:
+            return sysfutexwake((const int *)a[0], a[1]);
+
+        case SYSCALL_RTSET:
+            return sysrtset(a[0], a[1]);
+
+        case SYSCALL_RTWAIT:
+            return sysrtwait();
+
         default:
             return -EINVAL; // Invalid syscall
             break;
@@ -565,11 +797,50 @@ int64_t syscall(struct trap_frame * tfr){
  * syscall_handler - Handles system calls.
  *
  * Determines the system call from the trap frame and dispatches it to
- * the appropriate handler.
+ * the appropriate handler. Scratch memory taken by the handler is released
+ * in one go when it returns.
  *
  * @param tfr   Trap frame containing syscall information.
  */
 void syscall_handler(struct trap_frame * tfr){
+    struct arena scratch;
+
+    arena_begin(&scratch);
     tfr->sepc += 4;
-    tfr->x[TFR_A0] = syscall(tfr);
+    tfr->x[TFR_A0] = syscall(tfr, &scratch);
+    arena_release(&scratch);
+}
+
+
+
+/**
+ * scratch_strcpy - copies a validated user string into scratch memory
+ *
+ * @param scratch   arena to allocate the copy from
+ * @param ustr      user string, already checked with memory_validate_vstr
+ * @param bufsz     size of the copy, including the null terminator
+ * @param kstrp     set to the null-terminated kernel copy
+ *
+ * @return      0 on success, -EINVAL if the string does not fit in bufsz
+ *              bytes, or -ENOMEM if the arena has no memory for the copy
+ */
+static int scratch_strcpy (
+    struct arena * scratch, const char * ustr, size_t bufsz, const char ** kstrp)
+{
+    const size_t len = strlen(ustr);
+    char * kstr;
+
+    // a truncated name could open some other device or file
+    if (bufsz <= len)
+        return -EINVAL;
+
+    // another thread may change the string while we copy it
+    kstr = arena_alloc(scratch, len + 1);
+    if (kstr == NULL)
+        return -ENOMEM;
+
+    memcpy(kstr, ustr, len);
+    kstr[len] = '\0';
+    *kstrp = kstr;
+    return 0;
 }
\ No newline at end of file
@@ -99,7 +99,7 @@ _thread_swtch:
         # The currently running thread is suspended and resuming_thread is
         # restored to execution. swtch returns when execution is switched back
         # to the calling thread. The return value is the previously executing
-        # thread. Interrupts are enabled when swtch returns.
+        # thread. Called and returns with interrupts disabled.
         #
         # tp = pointer to struct thread of current thread (to be suspended)
         # a0 = pointer to struct thread of thread to be resumed
@@ -120,6 +120,7 @@ _thread_swtch:
         sd      ra, 12*8(tp)
         sd      sp, 13*8(tp)
 
+        mv      t0, tp          # remember suspended thread for return value
         mv      tp, a0
 
         ld      sp, 13*8(tp)
@@ -136,7 +137,8 @@ _thread_swtch:
         ld      s2, 2*8(tp)
         ld      s1, 1*8(tp)
         ld      s0, 0*8(tp)
-                
+
+        mv      a0, t0          # return previously running thread
         ret
 
         .global _thread_setup
@@ -167,7 +169,12 @@ _thread_setup:
 
         jal     t0, 1f
 
-        # The glue code below is executed when we first switch into the new thread
+        # The glue code below is executed when we first switch into the new
+        # thread. We got here from _thread_swtch, so a0 is the thread we
+        # switched away from, and interrupts are disabled.
+
+        call    thread_finish_switch
+        csrsi   sstatus, 2      # enable interrupts (SIE)
 
         la      ra, thread_exit # child will return to thread_exit
         mv      a0, s0          # get arg argument to child from s0
@@ -247,42 +254,26 @@ _thread_finish_jump:
         .global _thread_finish_fork
         .type   _thread_finish_fork, @function
 
-# extern void _thread_finish_fork
-#         (struct thread *child, 
-#         const struct trap_frame *parent_tfr); 
+# extern void _thread_finish_fork(const struct trap_frame *tfr);
 
 /**
- * _thread_finish_fork - Completes a thread fork and transitions to user mode.
+ * _thread_finish_fork - Starts a forked thread in user mode.
  *
- * Saves the current thread context, switches to the child thread, sets parent and 
- * child return values, restores the trap frame, and enters user mode using `sret`.
+ * Entry point of the child thread created by thread_fork_to_user. Restores the
+ * trap frame copied from the parent, which has a0 = 0, and enters user mode
+ * using `sret`.
  *
  * Parameters:
- *   - a0: Pointer to the child thread.
- *   - a1: Pointer to the parent trap frame.
+ *   - a0: Pointer to the child's trap frame, on the child's own stack.
  */
 
 _thread_finish_fork:
-        # this function saves the current running thread, switches to the new 
-        # child process thread and back to the u mode interrupt handler, it 
-        # then restroes the saved trap frame which is a duplicate of the parent tfr
-        
-        # save the current running thread
-        save_current_thread_context
-
-        # switch to the new child process thread
-        mv      tp, a0
-
-        # put child tid as the return value of parent tfr
-        ld      t6, 0*8(a0)
-        sd      t6, 10*8(a1)
+        mv      a1, a0
 
-        li      a0, 0
-
-        # restore the saved trap frame 
-        restore_trap_frame_except_t6_and_a1
+        # restore sstatus and sepc first: sstatus has SIE clear, as it was
+        # when the parent trapped, so we cannot be interrupted while stvec
+        # points to the U mode entry
 
-        # restore a1 and t6
         restore_sepc_and_sstatus
 
         # set sscratch
@@ -293,12 +284,120 @@ _thread_finish_fork:
         la      t6, _trap_entry_from_umode
         csrw    stvec, t6
 
+        # restore the trap frame, a0, and lastly a1 and t6
+        restore_trap_frame_except_t6_and_a1
+
+        ld      x10, 10*8(a1)   # x10 is a0
         ld      x31, 31*8(a1)   # x31 is t6
         ld      x11, 11*8(a1)   # x11 is a1
 
         sret
 
 
+        .global _thread_fp_save
+        .type   _thread_fp_save, @function
+
+# extern void _thread_fp_save(struct thread_fpstate * fps);
+
+/**
+ * _thread_fp_save - Saves the FP registers and fcsr.
+ *
+ * The caller must have made sure sstatus.FS is not Off.
+ *
+ * Parameters:
+ *   - a0: Pointer to a struct thread_fpstate (f[32] followed by fcsr).
+ */
+
+_thread_fp_save:
+        fsd     f0, 0*8(a0)
+        fsd     f1, 1*8(a0)
+        fsd     f2, 2*8(a0)
+        fsd     f3, 3*8(a0)
+        fsd     f4, 4*8(a0)
+        fsd     f5, 5*8(a0)
+        fsd     f6, 6*8(a0)
+        fsd     f7, 7*8(a0)
+        fsd     f8, 8*8(a0)
+        fsd     f9, 9*8(a0)
+        fsd     f10, 10*8(a0)
+        fsd     f11, 11*8(a0)
+        fsd     f12, 12*8(a0)
+        fsd     f13, 13*8(a0)
+        fsd     f14, 14*8(a0)
+        fsd     f15, 15*8(a0)
+        fsd     f16, 16*8(a0)
+        fsd     f17, 17*8(a0)
+        fsd     f18, 18*8(a0)
+        fsd     f19, 19*8(a0)
+        fsd     f20, 20*8(a0)
+        fsd     f21, 21*8(a0)
+        fsd     f22, 22*8(a0)
+        fsd     f23, 23*8(a0)
+        fsd     f24, 24*8(a0)
+        fsd     f25, 25*8(a0)
+        fsd     f26, 26*8(a0)
+        fsd     f27, 27*8(a0)
+        fsd     f28, 28*8(a0)
+        fsd     f29, 29*8(a0)
+        fsd     f30, 30*8(a0)
+        fsd     f31, 31*8(a0)
+        frcsr   t0
+        sd      t0, 32*8(a0)
+        ret
+
+
+        .global _thread_fp_restore
+        .type   _thread_fp_restore, @function
+
+# extern void _thread_fp_restore(const struct thread_fpstate * fps);
+
+/**
+ * _thread_fp_restore - Loads the FP registers and fcsr.
+ *
+ * The caller must have made sure sstatus.FS is not Off.
+ *
+ * Parameters:
+ *   - a0: Pointer to a struct thread_fpstate.
+ */
+
+_thread_fp_restore:
+        fld     f0, 0*8(a0)
+        fld     f1, 1*8(a0)
+        fld     f2, 2*8(a0)
+        fld     f3, 3*8(a0)
+        fld     f4, 4*8(a0)
+        fld     f5, 5*8(a0)
+        fld     f6, 6*8(a0)
+        fld     f7, 7*8(a0)
+        fld     f8, 8*8(a0)
+        fld     f9, 9*8(a0)
+        fld     f10, 10*8(a0)
+        fld     f11, 11*8(a0)
+        fld     f12, 12*8(a0)
+        fld     f13, 13*8(a0)
+        fld     f14, 14*8(a0)
+        fld     f15, 15*8(a0)
+        fld     f16, 16*8(a0)
+        fld     f17, 17*8(a0)
+        fld     f18, 18*8(a0)
+        fld     f19, 19*8(a0)
+        fld     f20, 20*8(a0)
+        fld     f21, 21*8(a0)
+        fld     f22, 22*8(a0)
+        fld     f23, 23*8(a0)
+        fld     f24, 24*8(a0)
+        fld     f25, 25*8(a0)
+        fld     f26, 26*8(a0)
+        fld     f27, 27*8(a0)
+        fld     f28, 28*8(a0)
+        fld     f29, 29*8(a0)
+        fld     f30, 30*8(a0)
+        fld     f31, 31*8(a0)
+        ld      t0, 32*8(a0)
+        fscsr   t0
+        ret
+
+
 # Statically allocated stack for the idle thread.
 
         .section        .data.stack, "wa", @progbits
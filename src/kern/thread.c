@@ -12,19 +12,80 @@
 #include "string.h"
 #include "csr.h"
 #include "intr.h"
+#include "lock.h"
 #include "process.h"
 #include "memory.h"
+#include "rusage.h"
+#include "schedtrace.h"
+#include "smp.h"
+#include "spinlock.h"
+#include "timer.h"
 
 // COMPILE-TIME PARAMETERS
 //
 
-// // NTHR is the maximum number of threads
+#define SATP_ASID_MASK 0xFFFF0000000000ULL
 
-// #ifndef NTHR
-// #define NTHR 16
-// #endif
+// Scheduling policy. SCHED_FIFO runs threads round-robin from a single ready
+// list per hart and switches on every interrupt taken from U mode. SCHED_MLFQ
+// keeps one ready list per priority level; see thread_tick and thread_preempt.
 
-#define SATP_ASID_MASK 0xFFFF0000000000ULL
+#define SCHED_FIFO 0
+#define SCHED_MLFQ 1
+
+#ifndef SCHED_POLICY
+#define SCHED_POLICY SCHED_MLFQ
+#endif
+
+// Number of MLFQ priority levels. Level 0 is the highest. A thread at level /l/
+// runs for MLFQ_QUANTUM(l) timer ticks before it is moved down a level.
+
+#ifndef MLFQ_LEVELS
+#define MLFQ_LEVELS 3
+#endif
+
+#define MLFQ_QUANTUM(l) (1 << (l))
+
+// Every MLFQ_BOOST_TICKS timer ticks all threads are moved back to level 0, so
+// that threads stuck at the bottom are not starved.
+
+#ifndef MLFQ_BOOST_TICKS
+#define MLFQ_BOOST_TICKS 50
+#endif
+
+// A thread woken by an ISR (an I/O completion or an expired alarm) is queued
+// at the front of the interrupted hart's run queue and runs as soon as the
+// interrupt returns, ahead of the interrupted thread. So that a stream of
+// interrupts cannot starve everything else, a hart makes at most
+// WAKE_HANDOFF_MAX such hand-offs per timer tick; later wakeups are queued
+// normally. Setting it to 0 turns hand-offs off.
+
+#ifndef WAKE_HANDOFF_MAX
+#define WAKE_HANDOFF_MAX 4
+#endif
+
+// lock_release hands a sleep lock to the thread that has waited longest. With
+// LOCK_HANDOFF set to 0 it frees the lock and wakes all waiters to contend for
+// it instead, as it used to; user/fsbench compares the two.
+
+#ifndef LOCK_HANDOFF
+#define LOCK_HANDOFF 1
+#endif
+
+// Kernel stacks of exited threads are kept, still mapped, on a cache of up to
+// KSTACK_CACHE_MAX stacks for the next threads created. This saves mapping
+// and clearing KSTACK_PAGES pages on creation and a TLB shootdown on exit. A
+// shrinker gives cached stacks back when the page allocator runs dry.
+
+#ifndef KSTACK_CACHE_MAX
+#define KSTACK_CACHE_MAX 8
+#endif
+
+#if SCHED_POLICY == SCHED_MLFQ
+#define NLEVEL MLFQ_LEVELS
+#else
+#define NLEVEL 1
+#endif
 
 // EXPORTED GLOBAL VARIABLES
 //
@@ -49,6 +110,22 @@ struct thread_context {
     void * sp;
 };
 
+// CPU time used, in rdtime ticks and cycles
+
+struct thread_usage {
+    uint64_t utime;
+    uint64_t stime;
+    uint64_t ucycles;
+    uint64_t scycles;
+};
+
+// User FP state, saved and restored by _thread_fp_save and _thread_fp_restore.
+
+struct thread_fpstate {
+    uint64_t f[32];
+    uint64_t fcsr;
+};
+
 struct thread {
     struct thread_context context; // must be first member (thrasm.s)
     const char * name;
@@ -61,13 +138,65 @@ struct thread {
     struct thread * list_next;
     struct condition * wait_cond;
     struct condition child_exit;
+    int prio; // ready list level, 0 is highest
+    char background; // kept at the lowest level (thread_set_background)
+    int ticks; // timer ticks used at current level
+    char preempt; // quantum expired, give up CPU on return to U mode
+    struct hart * hart; // hart the thread last ran on (and is queued for)
+    volatile char on_cpu; // set until the thread's context has been saved
+    struct thread * children; // first child, exited or not
+    struct thread * sib_next; // next child of parent
+    struct thread * sib_prev; // previous child of parent
+    struct thread_list zombies; // exited children not yet joined
+    char fp_used; // U mode has used FP since the last exec (see fp_switch)
+    struct hart * fp_hart; // hart whose FP registers match fpstate, or NULL
+    struct thread_fpstate fpstate;
+    char acct_user; // running in U mode as far as accounting is concerned
+    uint64_t acct_time; // rdtime when CPU time was last charged
+    uint64_t acct_cycle; // rdcycle when CPU time was last charged
+    struct thread_usage usage; // CPU time used by this thread
+    struct thread_usage child_usage; // CPU time used by joined descendants
+    int preempt_count; // depth of preempt_disable sections (and spinlocks)
+    char resched; // preemption deferred until preempt_count drops to 0
+    uint64_t rt_period; // real-time period in rdtime ticks, 0 if not real-time
+    uint64_t rt_budget; // CPU time allowed per period
+    uint64_t rt_deadline; // end of the current period
+    uint64_t rt_used; // CPU time used in the current period
+    uint64_t rt_stamp; // rdtime when rt_used was last charged
+    char rt_throttled; // budget used up, runs as a normal thread until rt_deadline
+    char rt_done; // called thread_rt_wait in the current period
+    unsigned long rt_misses; // periods that ended before the thread was done
+    unsigned long rt_reported; // rt_misses already returned by thread_rt_wait
+    struct alarm rt_alarm; // wakes thread_rt_wait at the next period
+    struct alarm rt_replenish; // requeues a throttled thread at rt_deadline
+};
+
+// Each hart has its own run queue. A hart that runs out of threads steals from
+// the others (see runq_take). The idle threads are not kept on any run queue.
+// Real-time threads that still have budget left are kept on a separate list,
+// ahead of all levels, in order of deadline.
+
+struct runq {
+    struct spinlock lock;
+    struct thread_list rt; // real-time threads, earliest deadline first
+    struct thread_list lists[NLEVEL]; // one per level, 0 is highest
+    volatile int cnt; // number of threads on lists
 };
 
 // INTERNAL GLOBAL VARIABLES
 //
 
 #define MAIN_TID 0
-#define IDLE_TID (NTHR-1)
+#define IDLE_TID 1
+
+// The thread table is a directory of chunks of THRTAB_CHUNK slots. The first
+// chunk is static and holds the main and boot idle threads; the others are
+// allocated by thrtab_grow when every slot is taken. Free slots are tracked
+// with a bitmap per chunk (bit set means free), so alloc_tid only has to look
+// for a nonzero word.
+
+#define THRTAB_CHUNK 64
+#define THRTAB_NCHUNK ((NTHR + THRTAB_CHUNK - 1) / THRTAB_CHUNK)
 
 struct thread main_thread = {
     .name = "main",
@@ -75,22 +204,64 @@ struct thread main_thread = {
     .state = THREAD_RUNNING,
     .child_exit = {
         .name = "main.child_exit"
-    }
+    },
+    .hart = &harts[0],
+    .on_cpu = 1
 };
 
+// Idle thread of the boot hart. The other harts' idle threads are created by
+// thread_create_idle and are not in thrtab.
+
 struct thread idle_thread = {
     .name = "idle",
     .id = IDLE_TID,
     .state = THREAD_READY,
-    .parent = &main_thread
+    .parent = &main_thread,
+    .hart = &harts[0]
 };
 
-static struct thread * thrtab[NTHR] = {
+static struct thread * thrtab_chunk0[THRTAB_CHUNK] = {
     [MAIN_TID] = &main_thread,
     [IDLE_TID] = &idle_thread
 };
 
-static struct thread_list ready_list;
+static struct thread ** thrtab[THRTAB_NCHUNK] = { thrtab_chunk0 };
+static uint64_t tid_free[THRTAB_NCHUNK] = {
+    ((NTHR < THRTAB_CHUNK) ? (UINT64_C(1) << NTHR) - 1 : ~UINT64_C(0)) &
+    ~((UINT64_C(1) << MAIN_TID) | (UINT64_C(1) << IDLE_TID))
+};
+static int thrtab_nchunk = 1; // chunks allocated
+static int tid_hint; // chunk most likely to have a free slot
+
+static struct runq runqs[NHART];
+
+// The scheduler lock protects thrtab, thread states, parent and child links,
+// and the wait lists of all condition variables. It may be taken in an ISR, so it must be
+// taken with interrupts disabled. A run queue lock may be taken while holding
+// the scheduler lock, but not the other way around.
+
+static struct spinlock sched_lock = SPINLOCK_INIT("sched");
+
+// Recycled thread structs and kernel stacks (see thread_alloc). Structs are
+// linked through list_next and are kept however many there are, since kfree
+// does not give memory back. Cached stacks are linked through their lowest
+// word.
+
+static struct thread * thread_cache;
+static void * kstack_cache;
+static int kstack_cache_cnt;
+static struct spinlock thread_cache_lock = SPINLOCK_INIT("thread_cache");
+
+static unsigned long kstack_cache_scan(struct shrinker * shr, unsigned long nr);
+
+static struct shrinker kstack_cache_shrinker = {
+    .name = "kstack",
+    .scan = kstack_cache_scan
+};
+
+#if SCHED_POLICY == SCHED_MLFQ
+static int boost_ticks; // ticks since last anti-starvation boost
+#endif
 
 // INTERNAL MACRO DEFINITIONS
 // 
@@ -124,49 +295,201 @@ static void init_idle_thread(void);
 
 static void set_running_thread(struct thread * thr);
 
+// Returns the thread with id /tid/, or NULL. Called with sched_lock held, or
+// for a tid that cannot be recycled under the caller (its own or a child's).
+
+static struct thread * thrtab_get(int tid);
+
+// Returns a free slot in thrtab and marks it used, or -1 if every allocated
+// chunk is full. Must be called with sched_lock held.
+
+static int alloc_tid(void);
+
+// Adds a chunk to the thread table. Returns 0 on success (including when
+// another thread grew the table first), or -EMFILE if NTHR threads exist.
+// Must be called without sched_lock held, since it allocates memory.
+
+static int thrtab_grow(void);
+
+// Gives /child/ a tid, makes it a child of the running thread, and puts it on
+// a run queue. Returns the tid, or a negative error code if the thread table
+// is full. The /child/ must be fully set up.
+
+static int thread_publish(struct thread * child);
+
 // Returns a string representing the state name. Used by debug and trace
 // statements, so marked unused to avoid compiler warnings.
 
 static const char * thread_state_name(enum thread_state state)
     __attribute__ ((unused));
 
-// void recycle_thread(int tid)
-// Reclaims a thread's slot in thrtab and makes its parent the parent of its
-// children. Frees the struct thread of the thread.
+// void recycle_thread(struct thread * thr)
+// Reclaims an exited thread's slot in thrtab and makes its parent the parent of
+// its children. Frees the struct thread of the thread. The thread must already
+// have been removed from its parent's zombie list.
 
-static void recycle_thread(int tid);
+static void recycle_thread(struct thread * thr);
 
 // void suspend_self(void)
-// Suspends the currently running thread and resumes the next thread on the
-// ready-to-run list using _thread_swtch (in threasm.s). Must be called with
-// interrupts enabled. Returns when the current thread is next scheduled for
-// execution. If the current thread is RUNNING, it is marked READY and placed
-// on the ready-to-run list. Note that suspend_self will only return if the
+// Suspends the currently running thread and resumes the next thread taken from
+// this hart's run queue (or stolen from another hart's) using _thread_swtch (in
+// threasm.s). Returns when the current thread is next scheduled for execution,
+// possibly on another hart. If the current thread is RUNNING, it is marked
+// READY and placed on the run queue, unless there is nothing else to run, in
+// which case it keeps running. Note that suspend_self will only return if the
 // current thread becomes READY.
 
 static void suspend_self(void);
 
+// Returns a zeroed struct thread with a kernel stack, its stack_base and
+// stack_size set and the stack anchor pointing at it, or NULL if out of
+// memory. Takes both from the caches if it can. thread_free gives them back
+// (for a thread that never ran); kstack_put and thread_struct_put give back
+// the stack and struct of an exited thread separately.
+
+static struct thread * thread_alloc(void);
+static void thread_free(struct thread * thr);
+static void kstack_put(void * stack);
+static void thread_struct_put(struct thread * thr);
+
 // The following functions manipulate a thread list (struct thread_list). Note
 // that threads form a linked list via the list_next member of each thread
-// structure. Thread lists are used for the ready-to-run list (ready_list) and
-// for the list of waiting threads of each condition variable. These functions
-// are not interrupt-safe! The caller must disable interrupts before calling any
-// thread list function that may modify a list that is used in an ISR.
+// structure. Thread lists are used for the run queues (runqs) and for the list
+// of waiting threads of each condition variable. These functions do no locking;
+// the caller must hold the lock protecting the list.
 
 static void tlclear(struct thread_list * list);
 static int tlempty(const struct thread_list * list);
 static void tlinsert(struct thread_list * list, struct thread * thr);
+static void tlpush(struct thread_list * list, struct thread * thr);
 static struct thread * tlremove(struct thread_list * list);
 static void tlappend(struct thread_list * l0, struct thread_list * l1);
+static int tlunlink(struct thread_list * list, struct thread * thr);
+
+// The following functions manage the run queues. They take the run queue
+// locks themselves, and must be called with interrupts disabled. If /front/ is
+// set, ready_push queues /thr/ ahead of the other threads at its level.
+
+static void ready_push(struct thread * thr, int front);
+static struct thread * runq_pop(struct runq * rq);
+static struct thread * runq_take(struct hart * h);
+static int ready_empty(void);
+static int ready_above(int prio);
+static int ready_before(uint64_t deadline);
+
+// Adds the current thread to the wait list of /cond/ and marks it WAITING. The
+// caller must hold sched_lock and call suspend_self after releasing it.
+
+static void wait_prepare(struct condition * cond);
+
+// Like condition_broadcast, but the caller holds sched_lock.
+
+static void broadcast_locked(struct condition * cond);
+
+// Waits on /cond/ with sched_lock held; the lock is released while the thread
+// is suspended and is held again on return.
+
+static void wait_locked(struct condition * cond);
+
+// Makes /thr/, which was waiting on a condition and has been removed from its
+// wait list, ready to run. The caller holds sched_lock.
+
+static void wake_locked(struct thread * thr);
+
+// Takes the thread that has waited longest off the wait list of /cond/ and
+// makes it ready to run, as the new owner of a lock the caller is releasing.
+// Returns the thread, or NULL if none was waiting. The caller holds sched_lock.
+
+static struct thread * handoff_locked(struct condition * cond);
+
+// State shared between condition_wait_timeout and its alarm.
+
+struct timed_wait {
+    struct alarm al;
+    struct thread * thr;
+    struct condition * cond;
+    char expired; // alarm went off
+    char timed_out; // alarm took thr off the wait list
+};
+
+static void timed_wait_expire(struct alarm * al);
+
+#if SCHED_POLICY == SCHED_MLFQ
+static void mlfq_boost(void);
+#endif
 
 static void idle_thread_func(void * arg);
 
+// Creates a thread of process /proc/ that starts by returning to U mode with a
+// copy of trap frame /tfr/. The thread gets a copy of the FP state of /fp_src/
+// (the running thread) or, if /fp_src/ is NULL, starts with the FP unit off.
+// Returns the thread id or a negative error code.
+
+static int spawn_user_thread (
+    const char * name, struct process * proc,
+    const struct trap_frame * tfr, struct thread * fp_src);
+
+// Returns the trap frame saved on entry from U mode, at the top of the kernel
+// stack of /thr/.
+
+static struct trap_frame * user_tfr(const struct thread * thr);
+
+// Saves the FP registers of /thr/ into thr->fpstate if U mode changed them
+// since they were last saved or loaded. Called with interrupts disabled, on
+// the hart /thr/ is running on.
+
+static void fp_sync(struct thread * thr);
+
+// Switches the FP register file of hart /h/ from /susp/ to /next/ (see the
+// comment in the definition). Called from suspend_self.
+
+static void fp_switch(struct thread * susp, struct thread * next, struct hart * h);
+
+// Charges the CPU time /thr/ used since acct_time to its user or system time,
+// according to acct_user. Called with interrupts disabled, on the hart /thr/
+// is running on, since the cycle counter is per hart.
+
+static void acct_charge(struct thread * thr);
+
+static void usage_add(struct thread_usage * sum, const struct thread_usage * u);
+static uint64_t ticks_to_us(uint64_t ticks);
+
+// The following functions implement the real-time class (see thread_rt_set).
+// They are called with interrupts disabled.
+//
+// rt_active returns 1 if /thr/ is a real-time thread with budget left in the
+// current period. rt_update starts the period containing /now/ if the current
+// one has ended, counting a deadline miss for every period that ended before
+// the thread called thread_rt_wait, and returns the number of periods
+// started. rt_charge charges the running thread /thr/ for the CPU time since
+// rt_stamp, throttles it if that uses up its budget, and calls rt_update.
+// rt_arm_timer has the timer interrupt this hart when the budget or the
+// period of the running thread /thr/ ends. rt_insert adds /thr/ to /list/ in
+// order of deadline. rt_replenish is the expire function of rt_replenish,
+// which rt_charge arms when it throttles a thread: it moves the thread, if it
+// is waiting on a run queue, back into the real-time class when its next
+// period starts.
+
+static int rt_active(const struct thread * thr);
+static unsigned long rt_update(struct thread * thr, uint64_t now);
+static unsigned long rt_charge(struct thread * thr);
+static void rt_arm_timer(const struct thread * thr);
+static void rt_insert(struct thread_list * list, struct thread * thr);
+static void rt_replenish(struct alarm * al);
+
 // IMPORTED FUNCTION DECLARATIONS
 // defined in thrasm.s
 //
 
 extern struct thread * _thread_swtch(struct thread * resuming_thread);
 
+extern void _thread_fp_save(struct thread_fpstate * fps);
+extern void _thread_fp_restore(const struct thread_fpstate * fps);
+
+// Called from thrasm.s, on the new thread's stack, after every switch.
+
+extern void thread_finish_switch(struct thread * prev);
+
 extern void _thread_setup (
     struct thread * thr, void * ksp, void (*start)(void *), ...);
 
@@ -180,26 +503,23 @@ extern void __attribute__ ((noreturn)) _thread_finish_jump (
 
 /**
  * forks the current process to create a child process and sets up a new thread for the child
- * 
+ *
  * this function performs the following steps:
  * -allocate new memeory for the child process
- * -setup a new thread struct
- * -initialize stack anchor
- * -child thread process
- * -switch into child's memory space
- * -set up the thread by calling _thread_setup and add it to ready to run list
- * 
+ * -create a thread for the child with spawn_user_thread, starting from a copy
+ *  of the parent's trap frame with a0 = 0 and a copy of its FP state
+ *
+ * The parent returns normally; the child returns to user mode from fork when
+ * it is first scheduled, which may be on another hart.
+ *
  * @param child_proc    pointer to the child process structure
  * @param parent_tfr    pointer to the parent's trap frame
- * 
+ *
  * @return              returns 0 on success or a negative a value on error
  */
 
 int thread_fork_to_user(struct process *child_proc, const struct trap_frame *parent_tfr){
-    struct thread_stack_anchor * stack_anchor;
-    void * stack_page;
-    struct thread * child;
-    int saved_intr_state;
+    struct trap_frame child_tfr;
     int tid;
 
     if (!child_proc || !parent_tfr) {
@@ -211,73 +531,65 @@ int thread_fork_to_user(struct process *child_proc, const struct trap_frame *par
     uintptr_t child_mtag = memory_space_clone(child_proc_asid);
 
     if (!child_mtag) {
-        return -2; // memory space clone failed 
-    } 
+        return -2; // memory space clone failed
+    }
 
     child_proc->mtag = child_mtag;
 
-    // set up a new thread struct
-    tid = 0;
-    while (++tid < NTHR)
-        if (thrtab[tid] == NULL)
-            break;
-    
-    if (tid == NTHR)
-        panic("Too many threads");
-
-    // Allocate a struct thread and a stack
-
-    child = kmalloc(sizeof(struct thread));
-
-    stack_page = memory_alloc_page();
-    stack_anchor = stack_page + PAGE_SIZE;
-    stack_anchor -= 1;
-    stack_anchor->thread = child;
-    stack_anchor->reserved = 0;
-
-    thrtab[tid] = child;
-
-    child->id = tid;
-    child->name = "forked_process";
-    child->parent = CURTHR;
-    child->stack_base = stack_anchor;
-    child->stack_size = child->stack_base - stack_page;
-
-    // // Allocate space for the trap frame just below the stack anchor
-    // struct trap_frame *child_tfr = (struct trap_frame *)( (uintptr_t)stack_anchor - sizeof(struct trap_frame) );
+    // fork returns 0 in the child
 
-    // // Copy parent trap frame to child trap frame
-    // memcpy(child_tfr, parent_tfr, sizeof(struct trap_frame));
+    child_tfr = *parent_tfr;
+    child_tfr.x[TFR_A0] = 0;
 
-    // // Set return value in child's trap frame
-    // child_tfr->x[10] = 0;
+    tid = spawn_user_thread("forked_process", child_proc, &child_tfr, CURTHR);
 
-    // child->stack_base = child_tfr;
-
-    set_thread_state(CURTHR, THREAD_READY);
-    saved_intr_state = intr_disable();
-    tlinsert(&ready_list, CURTHR);
-    intr_restore(saved_intr_state);
-    set_thread_state(child, THREAD_RUNNING);
+    if (tid < 0) {
+        memory_space_destroy(child_mtag);
+        child_proc->mtag = 0;
+        return tid;
+    }
 
     // set tid of the child proc
     child_proc->tid = tid;
 
-    // set child_thread process
-    thread_set_process(tid, child_proc);
-    
-    // switch memory spaces
-    memory_space_switch(child_mtag);
-
-    _thread_finish_fork(child, parent_tfr);
-
     // function executes w no errors
     return 0;
 }
 
+/**
+ * creates another thread in the current process
+ *
+ * the new thread shares the memory space and open files of the calling
+ * thread, and starts in user mode at upc with its stack pointer at usp and
+ * the given values in a0 and a1. all other registers start out as in the
+ * caller's trap frame, except ra and fp, which are 0, and the FP unit is off.
+ *
+ * @param usp       top of the user stack of the new thread
+ * @param upc       user mode entry point of the new thread
+ * @param a0        initial value of register a0
+ * @param a1        initial value of register a1
+ *
+ * @return          returns the thread id of the new thread or a negative
+ *                  value on error
+ */
+
+int thread_create_user(uintptr_t usp, uintptr_t upc, uintptr_t a0, uintptr_t a1) {
+    struct trap_frame tfr;
+
+    tfr = *user_tfr(CURTHR);
+    tfr.x[TFR_RA] = 0;
+    tfr.x[TFR_S0] = 0;
+    tfr.x[TFR_SP] = usp;
+    tfr.x[TFR_A0] = a0;
+    tfr.x[TFR_A1] = a1;
+    tfr.sepc = upc;
+
+    return spawn_user_thread(CURTHR->name, CURTHR->proc, &tfr, NULL);
+}
+
 // function to get the current thread
 struct thread * cur_thread(void) {
-    return thrtab[MAIN_TID];
+    return thrtab_get(MAIN_TID);
 }
 
 void * cur_stack_base(void) {
@@ -288,72 +600,90 @@ int running_thread(void) {
     return CURTHR->id;
 }
 
+struct hart * this_hart(void) {
+    return CURTHR->hart;
+}
+
 void thread_init(void) {
+    int i;
+
     init_main_thread();
     init_idle_thread();
+
+    for (i = 0; i < NHART; i++)
+        spinlock_init(&runqs[i].lock, "runq");
+
+    memory_register_shrinker(&kstack_cache_shrinker);
+
     set_running_thread(&main_thread);
     thrmgr_initialized = 1;
 }
 
 int thread_spawn(const char * name, void (*start)(void *), void * arg) {
-    struct thread_stack_anchor * stack_anchor;
-    void * stack_page;
     struct thread * child;
-    int saved_intr_state;
     int tid;
 
     trace("%s(name=\"%s\") in %s", __func__, name, CURTHR->name);
 
-    // Find a free thread slot.
-
-    tid = 0;
-    while (++tid < NTHR)
-        if (thrtab[tid] == NULL)
-            break;
-    
-    if (tid == NTHR)
-        panic("Too many threads");
-    
-    // Allocate a struct thread and a stack
-
-    child = kmalloc(sizeof(struct thread));
-
-    stack_page = memory_alloc_page();
-    stack_anchor = stack_page + PAGE_SIZE;
-    stack_anchor -= 1;
-    stack_anchor->thread = child;
-    stack_anchor->reserved = 0;
+    // Allocate a stack and a struct thread
 
+    child = thread_alloc();
+    if (child == NULL)
+        return -ENOMEM;
 
-    thrtab[tid] = child;
-
-    child->id = tid;
     child->name = name;
-    child->parent = CURTHR;
     child->proc = CURTHR->proc;
-    child->stack_base = stack_anchor;
-    child->stack_size = child->stack_base - stack_page;
+    child->wait_cond = NULL;
+    condition_init(&child->child_exit, NULL);
+    child->prio = 0;
+    child->ticks = 0;
+    child->preempt = 0;
+    child->preempt_count = 0;
+    child->resched = 0;
+    child->on_cpu = 0;
+    child->fp_used = 0;
+    child->fp_hart = NULL;
+    child->acct_user = 0;
+    memset(&child->usage, 0, sizeof(child->usage));
+    memset(&child->child_usage, 0, sizeof(child->child_usage));
     set_thread_state(child, THREAD_READY);
 
-    saved_intr_state = intr_disable();
-    tlinsert(&ready_list, child);
-    intr_restore(saved_intr_state);
-
     _thread_setup(child, child->stack_base, start, arg);
-    
+
+    // Find a free thread slot and make the thread runnable.
+
+    tid = thread_publish(child);
+
+    if (tid < 0)
+        thread_free(child);
+
     return tid;
 }
 
 void thread_exit(void) {
     if (CURTHR == &main_thread)
         halt_success();
-    
+
+    // The thread struct is recycled once we are gone, so it must not stay on
+    // the sleep list.
+
+    if (CURTHR->rt_period != 0)
+        alarm_cancel(&CURTHR->rt_replenish);
+
+    // Interrupts stay disabled until we have switched away.
+
+    spin_lock_irqsave(&sched_lock);
+
     set_thread_state(CURTHR, THREAD_EXITED);
 
-    // Signal parent in case it is waiting for us to exit
+    // Signal parent in case it is waiting for us to exit. We are not on any
+    // other list, so list_next is free for the parent's zombie list.
 
     assert(CURTHR->parent != NULL);
-    condition_broadcast(&CURTHR->parent->child_exit);
+    tlinsert(&CURTHR->parent->zombies, CURTHR);
+    broadcast_locked(&CURTHR->parent->child_exit);
+
+    spin_unlock(&sched_lock);
 
     suspend_self(); // should not return
     panic("thread_exit() failed");
@@ -361,197 +691,826 @@ void thread_exit(void) {
 /**
  * @brief - Transfers control to user mode.
  *
- * Switches the current thread's execution context to user mode by setting 
+ * Switches the current thread's execution context to user mode by setting
  * the user stack pointer (usp) and program counter (upc).
  *
  * @param usp: User stack pointer to set for the thread.
  * @param upc: User program counter to set as the thread's execution start point.
  */
 void thread_jump_to_user(uintptr_t usp, uintptr_t upc) {
+    // _thread_finish_jump points stvec at the U mode trap entry, so no
+    // interrupt may be taken from here on.
+
+    intr_disable();
+
+    // A new program image starts with the FP unit off.
+
+    CURTHR->fp_used = 0;
+    csrc_sstatus(RISCV_SSTATUS_FS);
+
+    thread_acct_trap_exit();
+
     _thread_finish_jump(CURTHR->stack_base, usp, upc);
 }
 
-void thread_yield(void) {
-    trace("%s() in %s", __func__, CURTHR->name);
+int thread_fp_first_use(struct trap_frame * tfr) {
+    static const struct thread_fpstate zero_fpstate;
+    struct thread * const thr = CURTHR;
+    int saved_intr_state;
 
-    // assert (intr_enabled());
-    assert (CURTHR->state == THREAD_RUNNING);
+    if ((tfr->sstatus & RISCV_SSTATUS_FS) != RISCV_SSTATUS_FS_OFF)
+        return 0;
 
-    suspend_self();
+    // Start with zeroed registers, so nothing leaks from the thread that last
+    // used them.
+
+    saved_intr_state = intr_disable();
+    csrs_sstatus(RISCV_SSTATUS_FS_CLEAN);
+    _thread_fp_restore(&zero_fpstate);
+    memset(&thr->fpstate, 0, sizeof(thr->fpstate));
+    thr->fp_used = 1;
+    thr->fp_hart = thr->hart;
+    thr->hart->fp_owner = thr;
+    intr_restore(saved_intr_state);
+
+    tfr->sstatus = (tfr->sstatus & ~RISCV_SSTATUS_FS) | RISCV_SSTATUS_FS_CLEAN;
+    return 1;
 }
 
-int thread_join_any(void) {
-    int childcnt = 0;
-    int tid;
+void thread_acct_trap_enter(void) {
+    const int saved_intr_state = intr_disable();
 
-    trace("%s() in %s", __func__, CURTHR->name);
+    acct_charge(CURTHR);
+    CURTHR->acct_user = 0;
+    intr_restore(saved_intr_state);
+}
 
-    // See if there are any children of the current thread, and if they have
-    // already exited. If so, call thread_wait_one() to finish up.
+void thread_acct_trap_exit(void) {
+    const int saved_intr_state = intr_disable();
 
-    for (tid = 1; tid < NTHR; tid++) {
-        if (thrtab[tid] != NULL && thrtab[tid]->parent == CURTHR) {
-            if (thrtab[tid]->state == THREAD_EXITED)
-                return thread_join(tid);
-            childcnt++;
-        }
+    acct_charge(CURTHR);
+    CURTHR->acct_user = 1;
+    intr_restore(saved_intr_state);
+}
+
+int thread_getrusage(int who, struct rusage * ru) {
+    struct thread_usage u;
+    int saved_intr_state;
+
+    switch (who) {
+    case RUSAGE_SELF:
+        saved_intr_state = intr_disable();
+        acct_charge(CURTHR);
+        u = CURTHR->usage;
+        intr_restore(saved_intr_state);
+        break;
+    case RUSAGE_CHILDREN:
+        // Only the thread itself adds to child_usage (in recycle_thread).
+        u = CURTHR->child_usage;
+        break;
+    default:
+        return -EINVAL;
     }
 
-    // If the current thread has no children, this is a bug. We could also
-    // return -EINVAL if we want to allow the calling thread to recover.
+    ru->ru_utime = ticks_to_us(u.utime);
+    ru->ru_stime = ticks_to_us(u.stime);
+    ru->ru_ucycles = u.ucycles;
+    ru->ru_scycles = u.scycles;
+    return 0;
+}
 
-    if (childcnt == 0)
-        panic("thread_wait called by childless thread");
-    
+int thread_rt_set(uint64_t period, uint64_t budget) {
+    struct thread * const thr = CURTHR;
+    int saved_intr_state;
 
-    // Wait for some child to exit. An exiting thread signals its parent's
-    // child_exit condition.
+    if (period != 0 && (budget == 0 || period < budget))
+        return -EINVAL;
 
-    condition_wait(&CURTHR->child_exit);
+    if (thr->rt_period != 0)
+        alarm_cancel(&thr->rt_replenish);
 
-    for (tid = 1; tid < NTHR; tid++) {
-        if (thrtab[tid] != NULL &&
-            thrtab[tid]->parent == CURTHR &&
-            thrtab[tid]->state == THREAD_EXITED)
-        {
-            recycle_thread(tid);
-            return tid;
-        }
-    }
+    alarm_init(&thr->rt_alarm, "rt");
+    alarm_init(&thr->rt_replenish, "rt_replenish");
+    thr->rt_replenish.expire = rt_replenish;
+
+    saved_intr_state = intr_disable();
+    thr->rt_period = period;
+    thr->rt_budget = budget;
+    thr->rt_stamp = csrr_time();
+    thr->rt_deadline = thr->rt_stamp + period;
+    thr->rt_used = 0;
+    thr->rt_throttled = 0;
+    thr->rt_done = 0;
+    thr->rt_misses = 0;
+    thr->rt_reported = 0;
+    rt_arm_timer(thr);
+    intr_restore(saved_intr_state);
 
-    panic("spurious child_exit signal");
+    return 0;
 }
 
-// Wait for specific child thread to exit. Returns the thread id of the child.
+int thread_rt_wait(void) {
+    struct thread * const thr = CURTHR;
+    unsigned long misses;
+    int saved_intr_state;
+    int late;
 
-int thread_join(int tid) {
-    struct thread * const child = thrtab[tid];
+    if (thr->rt_period == 0)
+        return -EINVAL;
 
-    trace("%s(tid=%d)", __func__, tid);
+    saved_intr_state = intr_disable();
+    late = (rt_charge(thr) != 0);
+    if (!late)
+        thr->rt_done = 1;
+    thr->rt_alarm.twake = thr->rt_deadline - thr->rt_period;
+    intr_restore(saved_intr_state);
 
-    if (tid <= 0 || NTHR <= tid)
-        return -1;
+    // ready_push starts the new period when the alarm wakes us. If the period
+    // ends before we get to sleep, alarm_sleep returns right away, so check
+    // again here.
 
-    trace("%s(tid=%d) in %s", __func__, tid, CURTHR->name);
+    if (!late)
+        alarm_sleep(&thr->rt_alarm, thr->rt_period);
 
-    // Can only wait for child if we're the parent
+    saved_intr_state = intr_disable();
+    rt_update(thr, csrr_time());
+    misses = thr->rt_misses - thr->rt_reported;
+    thr->rt_reported = thr->rt_misses;
+    intr_restore(saved_intr_state);
 
-    if (child == NULL || child->parent != CURTHR)
-        return -1;
-    
-    // Wait for child to exit. Whenever a child exits, it signals its parent's
-    // child_exit condition.
+    return misses;
+}
 
-    while (child->state != THREAD_EXITED)
-        condition_wait(&CURTHR->child_exit);
-    
-    recycle_thread(tid);
+void thread_set_background(void) {
+    int pie;
 
-    return tid;
+    pie = spin_lock_irqsave(&sched_lock);
+    CURTHR->background = 1;
+    CURTHR->prio = NLEVEL-1;
+    CURTHR->ticks = 0;
+    spin_unlock_irqrestore(&sched_lock, pie);
 }
 
-struct process * thread_process(int tid) {
-    assert (0 <= tid || tid < NTHR);
-    assert (thrtab[tid] != NULL);
-    return thrtab[tid]->proc;
-}
+void thread_yield(void) {
+    trace("%s() in %s", __func__, CURTHR->name);
 
-void thread_set_process(int tid, struct process * proc) {
-    assert (0 <= tid || tid < NTHR);
-    assert (thrtab[tid] != NULL);
-    thrtab[tid]->proc = proc;
-}
+    // assert (intr_enabled());
+    assert (CURTHR->state == THREAD_RUNNING);
 
-const char * thread_name(int tid) {
-    assert (0 <= tid || tid < NTHR);
-    assert (thrtab[tid] != NULL);
-    return thrtab[tid]->name;
+    suspend_self();
 }
 
-void condition_init(struct condition * cond, const char * name) {
-    cond->name = name;
-    tlclear(&cond->wait_list);
-}
+void thread_tick(void) {
+    struct thread * const thr = CURTHR;
 
-void condition_wait(struct condition * cond) {
-    int saved_intr_state;
+    thr->hart->handoffs = 0;
 
-    trace("%s(cond=<%s>) in %s", __func__, cond->name, CURTHR->name);
+    rt_charge(thr);
 
-    assert(CURTHR->state == THREAD_RUNNING);
+#if SCHED_POLICY == SCHED_MLFQ
+    if (thr != thr->hart->idle && !rt_active(thr) &&
+        MLFQ_QUANTUM(thr->prio) <= ++thr->ticks)
+    {
+        // Used up its quantum: move down a level (unless already at the
+        // bottom) and round-robin with the other threads there.
 
-    // Insert current thread into condition wait list
-    
-    set_thread_state(CURTHR, THREAD_WAITING);
-    CURTHR->wait_cond = cond;
-    CURTHR->list_next = NULL;
+        if (thr->prio < MLFQ_LEVELS-1)
+            thr->prio += 1;
+        thr->ticks = 0;
+        thr->preempt = 1;
+    }
 
-    saved_intr_state = intr_disable();
-    tlinsert(&cond->wait_list, CURTHR);
-    intr_restore(saved_intr_state);
+    // Every hart ticks; only the boot hart's ticks count towards the boost.
 
-    suspend_self();
+    if (thr->hart->id == 0 && MLFQ_BOOST_TICKS <= ++boost_ticks) {
+        boost_ticks = 0;
+        mlfq_boost();
+    }
+#endif
 }
 
-void condition_broadcast(struct condition * cond) {
-    int saved_intr_state;
-    struct thread * thr;
+void thread_preempt(void) {
+    struct thread * const thr = CURTHR;
 
-    // Fast path: if there are no threads waiting, return.
+    // The idle thread yields by itself, and a thread that is about to block
+    // (interrupted in S mode between wait_prepare and suspend_self) is taken
+    // off the CPU shortly anyway.
 
-    if (tlempty(&cond->wait_list))
+    if (thr == thr->hart->idle || thr->state != THREAD_RUNNING)
         return;
 
-    // Mark all waiting threads runnable. This is *not* a constant-time
-    // operation, however, keeping having an enum thread_state member of struct
-    // thread for keeping track of thread state is useful for debugging.
+    // This may be the interrupt for the end of the budget or the period.
 
-    saved_intr_state = intr_disable();
+    if (thr->rt_period != 0) {
+        rt_charge(thr);
+        rt_arm_timer(thr);
+    }
 
-    for (thr = cond->wait_list.head; thr != NULL; thr = thr->list_next) {
-        assert (thr->state == THREAD_WAITING);
-        assert (thr->wait_cond == cond);
-        set_thread_state(thr, THREAD_READY);
-        thr->wait_cond = NULL;
+    // A real-time thread keeps running until its budget is used up or a thread
+    // with an earlier deadline becomes ready.
+
+    if (rt_active(thr)) {
+        if (!thr->preempt && !ready_before(thr->rt_deadline))
+            return;
     }
+#if SCHED_POLICY == SCHED_MLFQ
+    // Keep running unless the quantum is used up, a thread at a higher level
+    // became ready, or an ISR handed this hart to the thread it woke.
 
-    // Append condition variable wait list to run list
+    else if (!thr->preempt && !thr->hart->handoff && !ready_above(thr->prio))
+        return;
+#endif
 
-    tlappend(&ready_list, &cond->wait_list);
-    tlclear(&cond->wait_list);
+    if (thr->preempt_count != 0) {
+        thr->resched = 1;
+        return;
+    }
 
-    intr_restore(saved_intr_state);
+    thr->resched = 0;
+    thr->preempt = 0;
+    thread_yield();
 }
 
-// INTERNAL FUNCTION DEFINITIONS
-//
-
-void init_main_thread(void) {
-    extern char _main_stack_anchor[]; // from thrasm.s
-    extern char _main_stack_lowest[]; // from thrasm.s
+#if KERNEL_PREEMPT
+void preempt_disable(void) {
+    // Spinlocks are taken before thread_init sets up the running thread.
 
-    main_thread.stack_base = _main_stack_anchor;
-    main_thread.stack_size = _main_stack_anchor - _main_stack_lowest;
+    if (thrmgr_initialized)
+        CURTHR->preempt_count += 1;
 }
 
-void init_idle_thread(void) {
-    extern char _idle_stack_anchor[]; // from thrasm.s
-    extern char _idle_stack_lowest[]; // from thrasm.s
+void preempt_enable(void) {
+    struct thread * thr;
+    int saved_intr_state;
 
-    extern void _thread_setup (
+    if (!thrmgr_initialized)
+        return;
+
+    thr = CURTHR;
+    assert (thr->preempt_count > 0);
+
+    if (--thr->preempt_count != 0 || !thr->resched || !intr_enabled())
+        return;
+
+    saved_intr_state = intr_disable();
+    thread_preempt();
+    intr_restore(saved_intr_state);
+}
+#endif
+
+int thread_join_any(void) {
+    struct thread * child;
+    int saved_intr_state;
+    int tid;
+
+    trace("%s() in %s", __func__, CURTHR->name);
+
+    saved_intr_state = spin_lock_irqsave(&sched_lock);
+
+    // If the current thread has no children, this is a bug. We could also
+    // return -EINVAL if we want to allow the calling thread to recover.
+
+    if (CURTHR->children == NULL)
+        panic("thread_wait called by childless thread");
+
+    // Wait for some child to exit. An exiting thread puts itself on its
+    // parent's zombie list and signals its parent's child_exit condition.
+
+    while ((child = tlremove(&CURTHR->zombies)) == NULL)
+        wait_locked(&CURTHR->child_exit);
+
+    tid = child->id;
+    spin_unlock_irqrestore(&sched_lock, saved_intr_state);
+    recycle_thread(child);
+    return tid;
+}
+
+// Wait for specific child thread to exit. Returns the thread id of the child.
+
+int thread_join(int tid) {
+    struct thread * child;
+    int saved_intr_state;
+
+    trace("%s(tid=%d) in %s", __func__, tid, CURTHR->name);
+
+    saved_intr_state = spin_lock_irqsave(&sched_lock);
+    child = thrtab_get(tid);
+
+    // Can only wait for child if we're the parent
+
+    if (child == NULL || child->parent != CURTHR) {
+        spin_unlock_irqrestore(&sched_lock, saved_intr_state);
+        return -1;
+    }
+
+    // Wait for child to exit. Whenever a child exits, it signals its parent's
+    // child_exit condition.
+
+    while (child->state != THREAD_EXITED)
+        wait_locked(&CURTHR->child_exit);
+
+    tlunlink(&CURTHR->zombies, child);
+    spin_unlock_irqrestore(&sched_lock, saved_intr_state);
+    recycle_thread(child);
+
+    return tid;
+}
+
+struct process * thread_process(int tid) {
+    struct thread * const thr = thrtab_get(tid);
+
+    assert (thr != NULL);
+    return thr->proc;
+}
+
+void thread_set_process(int tid, struct process * proc) {
+    struct thread * const thr = thrtab_get(tid);
+
+    assert (thr != NULL);
+    thr->proc = proc;
+}
+
+const char * thread_name(int tid) {
+    struct thread * const thr = thrtab_get(tid);
+
+    assert (thr != NULL);
+    return thr->name;
+}
+
+struct thread * thread_create_idle(struct hart * h, void ** anchorp) {
+    struct thread_stack_anchor * stack_anchor;
+    struct thread * thr;
+    void * stack;
+
+    stack = memory_alloc_kstack();
+    if (stack == NULL)
+        return NULL;
+
+    thr = kcalloc(1, sizeof(struct thread));
+    if (thr == NULL) {
+        memory_free_kstack(stack);
+        return NULL;
+    }
+
+    stack_anchor = stack + KSTACK_SIZE;
+    stack_anchor -= 1;
+    stack_anchor->thread = thr;
+    stack_anchor->reserved = 0;
+
+    // The new hart starts out running its idle thread, so the thread needs no
+    // initial context.
+
+    thr->name = "idle";
+    thr->id = IDLE_TID;
+    thr->state = THREAD_RUNNING;
+    thr->parent = &main_thread;
+    thr->stack_base = stack_anchor;
+    thr->stack_size = thr->stack_base - stack;
+    thr->hart = h;
+    thr->on_cpu = 1;
+    thr->acct_time = csrr_time();
+
+    h->idle = thr;
+    *anchorp = stack_anchor;
+    return thr;
+}
+
+void thread_idle_loop(void) {
+    struct hart * const h = CURTHR->hart; // idle threads do not migrate
+
+    for (;;) {
+        // If there are runnable threads, restart the scheduler tick if it was
+        // stopped and yield to them.
+
+        if (!ready_empty()) {
+            intr_disable();
+            timer_idle_exit();
+            intr_enable();
+
+            while (!ready_empty())
+                thread_yield();
+        }
+
+        // No runnable threads. Sleep using the wfi instruction. Note that we
+        // need to disable interrupts and check the run queues one more time
+        // (make sure they are empty) to avoid a race condition where an ISR
+        // marks a thread ready before we call the wfi instruction. A thread
+        // made ready by another hart sees /idling/ and sends us an IPI.
+
+        intr_disable();
+        h->idling = 1;
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (ready_empty()) {
+            timer_idle_enter();
+            asm ("wfi");
+            h->idle_wakeups += 1;
+        }
+        h->idling = 0;
+        intr_enable();
+    }
+}
+
+void condition_init(struct condition * cond, const char * name) {
+    cond->name = name;
+    tlclear(&cond->wait_list);
+}
+
+void condition_wait(struct condition * cond) {
+    int saved_intr_state;
+
+    trace("%s(cond=<%s>) in %s", __func__, cond->name, CURTHR->name);
+
+    saved_intr_state = spin_lock_irqsave(&sched_lock);
+    wait_prepare(cond);
+    spin_unlock(&sched_lock);
+
+    suspend_self();
+
+    intr_restore(saved_intr_state);
+}
+
+void condition_wait_spin(struct condition * cond, struct spinlock * lk) {
+    trace("%s(cond=<%s>,lk=<%s>) in %s",
+        __func__, cond->name, lk->name, CURTHR->name);
+
+    // Once we are on the wait list, a waker that takes /lk/ after we release
+    // it will find us there.
+
+    spin_lock(&sched_lock);
+    wait_prepare(cond);
+    spin_unlock(lk);
+    spin_unlock(&sched_lock);
+
+    suspend_self();
+
+    spin_lock(lk);
+}
+
+void condition_broadcast(struct condition * cond) {
+    int saved_intr_state;
+
+    // Fast path: if there are no threads waiting, return. A thread about to
+    // wait is put on the wait list while holding the lock protecting the
+    // condition, which the caller also holds, so we cannot miss it.
+
+    if (tlempty(&cond->wait_list))
+        return;
+
+    saved_intr_state = spin_lock_irqsave(&sched_lock);
+    broadcast_locked(cond);
+    spin_unlock_irqrestore(&sched_lock, saved_intr_state);
+}
+
+int condition_wait_timeout (
+    struct condition * cond, struct spinlock * lk, uint64_t tcnt)
+{
+    struct timed_wait tw;
+
+    trace("%s(cond=<%s>,lk=<%s>,tcnt=%lu) in %s",
+        __func__, cond->name, lk->name, tcnt, CURTHR->name);
+
+    alarm_init(&tw.al, cond->name);
+    tw.al.expire = timed_wait_expire;
+    tw.thr = CURTHR;
+    tw.cond = cond;
+    tw.expired = 0;
+    tw.timed_out = 0;
+
+    alarm_arm(&tw.al, tcnt);
+
+    // The alarm may go off (on another hart) before we are on the wait list,
+    // in which case tw.expired tells us not to wait at all. Both are decided
+    // under sched_lock.
+
+    spin_lock(&sched_lock);
+
+    if (!tw.expired) {
+        wait_prepare(cond);
+        spin_unlock(lk);
+        spin_unlock(&sched_lock);
+        suspend_self();
+    } else {
+        tw.timed_out = 1;
+        spin_unlock(lk);
+        spin_unlock(&sched_lock);
+    }
+
+    // Once alarm_cancel returns, the alarm handler is done with tw.
+
+    alarm_cancel(&tw.al);
+
+    spin_lock(lk);
+    return tw.timed_out;
+}
+
+void condition_signal(struct condition * cond) {
+    struct thread * thr;
+    int saved_intr_state;
+
+    if (tlempty(&cond->wait_list))
+        return;
+
+    saved_intr_state = spin_lock_irqsave(&sched_lock);
+
+    if ((thr = tlremove(&cond->wait_list)) != NULL)
+        wake_locked(thr);
+
+    spin_unlock_irqrestore(&sched_lock, saved_intr_state);
+}
+
+void lock_acquire(struct lock * lk) {
+    int saved_intr_state;
+
+    trace("%s(<%s:%p>) in %s", __func__, lk->cond.name, lk, CURTHR->name);
+
+    saved_intr_state = spin_lock_irqsave(&lk->guard);
+
+    if (lk->tid == CURTHR->id)
+        panic("lock_acquire: lock already held by running thread");
+
+#if LOCK_HANDOFF
+    // If the lock is held, wait for the holder to hand it to us. We only get
+    // woken by lock_release, which sets lk->tid to our tid before doing so.
+
+    if (lk->tid != -1) {
+        condition_wait_spin(&lk->cond, &lk->guard);
+        assert (lk->tid == CURTHR->id);
+    } else
+        lk->tid = CURTHR->id;
+#else
+    while (lk->tid != -1)
+        condition_wait_spin(&lk->cond, &lk->guard);
+
+    lk->tid = CURTHR->id;
+#endif
+
+    spin_unlock_irqrestore(&lk->guard, saved_intr_state);
+
+    debug("Thread <%s:%d> acquired lock <%s:%p>",
+        CURTHR->name, CURTHR->id, lk->cond.name, lk);
+}
+
+int lock_try_acquire(struct lock * lk) {
+    int saved_intr_state;
+    int acquired = 0;
+
+    saved_intr_state = spin_lock_irqsave(&lk->guard);
+
+    if (lk->tid == -1) {
+        lk->tid = CURTHR->id;
+        acquired = 1;
+    }
+
+    spin_unlock_irqrestore(&lk->guard, saved_intr_state);
+    return acquired;
+}
+
+void lock_release(struct lock * lk) {
+    struct thread * thr;
+    int saved_intr_state;
+    int tid;
+
+    trace("%s(<%s:%p>) in %s", __func__, lk->cond.name, lk, CURTHR->name);
+
+    saved_intr_state = spin_lock_irqsave(&lk->guard);
+
+    assert (lk->tid == CURTHR->id);
+
+    if (!LOCK_HANDOFF || tlempty(&lk->cond.wait_list)) {
+        lk->tid = -1;
+        if (!LOCK_HANDOFF)
+            condition_broadcast(&lk->cond);
+        spin_unlock_irqrestore(&lk->guard, saved_intr_state);
+        return;
+    }
+
+    // Hand the lock to the first waiter.
+
+    spin_lock(&sched_lock);
+    thr = handoff_locked(&lk->cond);
+    lk->tid = tid = thr->id;
+    spin_unlock(&sched_lock);
+
+    spin_unlock_irqrestore(&lk->guard, saved_intr_state);
+
+    debug("Thread <%s:%d> handed lock <%s:%p> to thread %d",
+        CURTHR->name, CURTHR->id, lk->cond.name, lk, tid);
+}
+
+void rwlock_read_acquire(struct rwlock * rw) {
+    int saved_intr_state;
+
+    saved_intr_state = spin_lock_irqsave(&rw->guard);
+
+    // Wait behind writers, including ones that are only waiting. The writer
+    // that releases the lock counts us in nread before waking us.
+
+    if (rw->writing || !tlempty(&rw->writers.wait_list))
+        condition_wait_spin(&rw->readers, &rw->guard);
+    else
+        rw->nread += 1;
+
+    spin_unlock_irqrestore(&rw->guard, saved_intr_state);
+}
+
+void rwlock_read_release(struct rwlock * rw) {
+    int saved_intr_state;
+
+    saved_intr_state = spin_lock_irqsave(&rw->guard);
+
+    assert (0 < rw->nread);
+    rw->nread -= 1;
+
+    // The last reader out hands the lock to the first waiting writer.
+
+    if (rw->nread == 0 && !tlempty(&rw->writers.wait_list)) {
+        rw->writing = 1;
+        spin_lock(&sched_lock);
+        handoff_locked(&rw->writers);
+        spin_unlock(&sched_lock);
+    }
+
+    spin_unlock_irqrestore(&rw->guard, saved_intr_state);
+}
+
+void rwlock_write_acquire(struct rwlock * rw) {
+    int saved_intr_state;
+
+    saved_intr_state = spin_lock_irqsave(&rw->guard);
+
+    if (rw->writing || rw->nread != 0) {
+        condition_wait_spin(&rw->writers, &rw->guard);
+        assert (rw->writing);
+    } else
+        rw->writing = 1;
+
+    spin_unlock_irqrestore(&rw->guard, saved_intr_state);
+}
+
+void rwlock_write_release(struct rwlock * rw) {
+    int saved_intr_state;
+
+    saved_intr_state = spin_lock_irqsave(&rw->guard);
+
+    assert (rw->writing);
+
+    if (tlempty(&rw->writers.wait_list) && tlempty(&rw->readers.wait_list)) {
+        rw->writing = 0;
+        spin_unlock_irqrestore(&rw->guard, saved_intr_state);
+        return;
+    }
+
+    // Hand the lock to the next writer if there is one, otherwise to all the
+    // readers that queued up behind us.
+
+    spin_lock(&sched_lock);
+
+    if (handoff_locked(&rw->writers) == NULL) {
+        rw->writing = 0;
+        while (handoff_locked(&rw->readers) != NULL)
+            rw->nread += 1;
+    }
+
+    spin_unlock(&sched_lock);
+
+    spin_unlock_irqrestore(&rw->guard, saved_intr_state);
+}
+
+// INTERNAL FUNCTION DEFINITIONS
+//
+
+void init_main_thread(void) {
+    extern char _main_stack_anchor[]; // from thrasm.s
+    extern char _main_stack_lowest[]; // from thrasm.s
+
+    main_thread.stack_base = _main_stack_anchor;
+    main_thread.stack_size = _main_stack_anchor - _main_stack_lowest;
+    main_thread.acct_time = csrr_time();
+    main_thread.acct_cycle = csrr_cycle();
+}
+
+void init_idle_thread(void) {
+    extern char _idle_stack_anchor[]; // from thrasm.s
+    extern char _idle_stack_lowest[]; // from thrasm.s
+
+    extern void _thread_setup (
         struct thread * thr, void * sp, void (*start)(void *), ...);
 
     idle_thread.stack_base = _idle_stack_anchor;
     idle_thread.stack_size = _idle_stack_anchor - _idle_stack_lowest;
     _thread_setup(&idle_thread, _idle_stack_anchor, idle_thread_func);
-    tlinsert(&ready_list, &idle_thread); // interrupts still disabled
-
+    harts[0].idle = &idle_thread;
 }
 
 static void set_running_thread(struct thread * thr) {
     asm inline ("mv tp, %0" :: "r"(thr) : "tp");
 }
 
+struct thread * thrtab_get(int tid) {
+    struct thread ** chunk;
+
+    if (tid < 0 || NTHR <= tid)
+        return NULL;
+
+    chunk = __atomic_load_n(&thrtab[tid / THRTAB_CHUNK], __ATOMIC_ACQUIRE);
+    return (chunk != NULL) ? chunk[tid % THRTAB_CHUNK] : NULL;
+}
+
+int alloc_tid(void) {
+    int c, i, bit;
+
+    for (i = 0; i < thrtab_nchunk; i++) {
+        c = (tid_hint + i) % thrtab_nchunk;
+        if (tid_free[c] != 0) {
+            bit = __builtin_ctzll(tid_free[c]);
+            tid_free[c] &= ~(UINT64_C(1) << bit);
+            tid_hint = c;
+            return c * THRTAB_CHUNK + bit;
+        }
+    }
+
+    return -1;
+}
+
+int thrtab_grow(void) {
+    struct thread ** chunk;
+    int saved_intr_state;
+    int result = -EMFILE;
+    int c;
+
+    chunk = kcalloc(THRTAB_CHUNK, sizeof(struct thread *));
+    if (chunk == NULL)
+        return -ENOMEM;
+
+    saved_intr_state = spin_lock_irqsave(&sched_lock);
+
+    for (c = 0; c < thrtab_nchunk; c++) {
+        if (tid_free[c] != 0)
+            break;
+    }
+
+    if (c < thrtab_nchunk) {
+        result = 0; // somebody freed a slot or grew the table before us
+    } else if (thrtab_nchunk < THRTAB_NCHUNK) {
+        __atomic_store_n(&thrtab[c], chunk, __ATOMIC_RELEASE);
+
+        // The last chunk may extend past NTHR; those slots are never free.
+
+        if (NTHR < (c + 1) * THRTAB_CHUNK)
+            tid_free[c] = (UINT64_C(1) << (NTHR - c * THRTAB_CHUNK)) - 1;
+        else
+            tid_free[c] = ~UINT64_C(0);
+
+        tid_hint = c;
+        thrtab_nchunk += 1;
+        chunk = NULL;
+        result = 0;
+    }
+
+    spin_unlock_irqrestore(&sched_lock, saved_intr_state);
+
+    if (chunk != NULL)
+        kfree(chunk);
+
+    return result;
+}
+
+int thread_publish(struct thread * child) {
+    struct thread * const parent = CURTHR;
+    int saved_intr_state;
+    int result;
+    int tid;
+
+    child->parent = parent;
+    child->children = NULL;
+    child->sib_prev = NULL;
+    tlclear(&child->zombies);
+
+    saved_intr_state = spin_lock_irqsave(&sched_lock);
+
+    while ((tid = alloc_tid()) < 0) {
+        spin_unlock_irqrestore(&sched_lock, saved_intr_state);
+        result = thrtab_grow();
+        if (result < 0)
+            return result;
+        saved_intr_state = spin_lock_irqsave(&sched_lock);
+    }
+
+    child->id = tid;
+    child->hart = this_hart();
+    thrtab[tid / THRTAB_CHUNK][tid % THRTAB_CHUNK] = child;
+
+    child->sib_next = parent->children;
+    if (parent->children != NULL)
+        parent->children->sib_prev = child;
+    parent->children = child;
+
+    ready_push(child, 0);
+    spin_unlock_irqrestore(&sched_lock, saved_intr_state);
+
+    return tid;
+}
+
 const char * thread_state_name(enum thread_state state) {
     static const char * const names[] = {
         [THREAD_UNINITIALIZED] = "UNINITIALIZED",
@@ -562,84 +1521,653 @@ const char * thread_state_name(enum thread_state state) {
         [THREAD_EXITED] = "EXITED"
     };
 
-    if (0 <= (int)state && (int)state < sizeof(names)/sizeof(names[0]))
-        return names[state];
-    else
-        return "UNDEFINED";
-};
+    if (0 <= (int)state && (int)state < sizeof(names)/sizeof(names[0]))
+        return names[state];
+    else
+        return "UNDEFINED";
+};
+
+void recycle_thread(struct thread * thr) {
+    struct thread * const parent = thr->parent;
+    struct thread * child;
+    struct thread * last;
+    int saved_intr_state;
+    const int tid = thr->id;
+
+    assert (0 < tid && tid < NTHR && thrtab_get(tid) == thr);
+    assert (thr->state == THREAD_EXITED);
+
+    saved_intr_state = spin_lock_irqsave(&sched_lock);
+
+    // Unlink from our parent's child list
+
+    if (thr->sib_prev != NULL)
+        thr->sib_prev->sib_next = thr->sib_next;
+    else
+        parent->children = thr->sib_next;
+    if (thr->sib_next != NULL)
+        thr->sib_next->sib_prev = thr->sib_prev;
+
+    // Make our parent the parent of our children. Children that have already
+    // exited become zombies of the parent, who may be waiting for them.
+
+    if (thr->children != NULL) {
+        last = NULL;
+        for (child = thr->children; child != NULL; child = child->sib_next) {
+            child->parent = parent;
+            last = child;
+        }
+
+        last->sib_next = parent->children;
+        if (parent->children != NULL)
+            parent->children->sib_prev = last;
+        parent->children = thr->children;
+        thr->children = NULL;
+
+        if (!tlempty(&thr->zombies)) {
+            tlappend(&parent->zombies, &thr->zombies);
+            broadcast_locked(&parent->child_exit);
+        }
+    }
+
+    thrtab[tid / THRTAB_CHUNK][tid % THRTAB_CHUNK] = NULL;
+    tid_free[tid / THRTAB_CHUNK] |= UINT64_C(1) << (tid % THRTAB_CHUNK);
+    spin_unlock_irqrestore(&sched_lock, saved_intr_state);
+
+    // The thread may have exited on another hart that has not switched away
+    // from it yet.
+
+    while (__atomic_load_n(&thr->on_cpu, __ATOMIC_ACQUIRE))
+        continue;
+
+    // Now that thr has switched away for the last time its usage is final.
+    // We are its parent, the only thread that touches our child_usage.
+
+    usage_add(&parent->child_usage, &thr->usage);
+    usage_add(&parent->child_usage, &thr->child_usage);
+
+    thread_struct_put(thr);
+}
+
+struct thread * thread_alloc(void) {
+    struct thread_stack_anchor * stack_anchor;
+    struct thread * thr;
+    void * stack;
+    int pie;
+
+    pie = spin_lock_irqsave(&thread_cache_lock);
+
+    thr = thread_cache;
+    if (thr != NULL)
+        thread_cache = thr->list_next;
+
+    stack = kstack_cache;
+    if (stack != NULL) {
+        kstack_cache = *(void **)stack;
+        kstack_cache_cnt -= 1;
+    }
+
+    spin_unlock_irqrestore(&thread_cache_lock, pie);
+
+    if (stack == NULL) {
+        stack = memory_alloc_kstack();
+        if (stack == NULL) {
+            if (thr != NULL)
+                thread_struct_put(thr);
+            return NULL;
+        }
+    }
+
+    if (thr == NULL) {
+        thr = kcalloc(1, sizeof(struct thread));
+        if (thr == NULL) {
+            kstack_put(stack);
+            return NULL;
+        }
+    }
+
+    stack_anchor = stack + KSTACK_SIZE;
+    stack_anchor -= 1;
+    stack_anchor->thread = thr;
+    stack_anchor->reserved = 0;
+
+    thr->stack_base = stack_anchor;
+    thr->stack_size = thr->stack_base - stack;
+    return thr;
+}
+
+void thread_free(struct thread * thr) {
+    kstack_put(thr->stack_base - thr->stack_size);
+    thread_struct_put(thr);
+}
+
+void kstack_put(void * stack) {
+    int pie;
+
+    pie = spin_lock_irqsave(&thread_cache_lock);
+    if (kstack_cache_cnt < KSTACK_CACHE_MAX) {
+        *(void **)stack = kstack_cache;
+        kstack_cache = stack;
+        kstack_cache_cnt += 1;
+        stack = NULL;
+    }
+    spin_unlock_irqrestore(&thread_cache_lock, pie);
+
+    if (stack != NULL)
+        memory_free_kstack(stack);
+}
 
-void recycle_thread(int tid) {
-    struct thread * const thr = thrtab[tid];
-    int ctid;
+// Clearing the struct here rather than in thread_alloc keeps the cost off the
+// thread creation path.
 
-    assert (0 < tid && tid < NTHR && thr != NULL);
-    assert (thr->state == THREAD_EXITED);
+void thread_struct_put(struct thread * thr) {
+    int pie;
+
+    memset(thr, 0, sizeof(struct thread));
+
+    pie = spin_lock_irqsave(&thread_cache_lock);
+    thr->list_next = thread_cache;
+    thread_cache = thr;
+    spin_unlock_irqrestore(&thread_cache_lock, pie);
+}
+
+// Hands cached stacks back to the page allocator when it runs out of pages.
+// The allocator may have been called with spinlocks held, so the TLB
+// shootdown that must come before a slot is reused is left to
+// memory_try_free_kstack's work item.
+
+unsigned long kstack_cache_scan(struct shrinker * shr, unsigned long nr) {
+    unsigned long freed = 0;
+    void * stack;
+    int pie;
+
+    while (freed < nr) {
+        pie = spin_lock_irqsave(&thread_cache_lock);
+        stack = kstack_cache;
+        if (stack != NULL) {
+            kstack_cache = *(void **)stack;
+            kstack_cache_cnt -= 1;
+        }
+        spin_unlock_irqrestore(&thread_cache_lock, pie);
+
+        if (stack == NULL)
+            break;
+
+        // Only fails before system_wq exists. Put it back even if that
+        // overfills the cache: kstack_put might call memory_free_kstack, which
+        // cannot do its TLB shootdown here.
 
-    // Make our parent the parent of our children
+        if (!memory_try_free_kstack(stack)) {
+            pie = spin_lock_irqsave(&thread_cache_lock);
+            *(void **)stack = kstack_cache;
+            kstack_cache = stack;
+            kstack_cache_cnt += 1;
+            spin_unlock_irqrestore(&thread_cache_lock, pie);
+            break;
+        }
 
-    for (ctid = 1; ctid < NTHR; ctid++) {
-        if (thrtab[ctid] != NULL && thrtab[ctid]->parent == thr)
-            thrtab[ctid]->parent = thr->parent;
+        freed += KSTACK_PAGES;
     }
 
-    thrtab[tid] = NULL;
-    kfree(thr);
+    return freed;
 }
 
 void suspend_self(void) {
     struct thread * susp_thread; // suspending thread
     struct thread * next_thread; // resuming thread
     struct thread * prev_thread; // previously thread
+    uintptr_t next_mtag; // memory space of next_thread
+    struct hart * h;
     int saved_intr_state;
 
     trace("%s() in %s", __func__, CURTHR->name);
 
-    // The idle thread is always runnable, and the idle thread only calls
-    // suspend_self() if the ready_list is not empty.
-
-    assert (!tlempty(&ready_list));
-
     susp_thread = CURTHR;
 
-    // Get a READY thread from the ready list and mark it running
+    // Interrupts stay disabled until we are back, so we do not move to another
+    // hart half way through.
 
     saved_intr_state = intr_disable();
+    h = susp_thread->hart;
 
-    next_thread = tlremove(&ready_list);
-    // console_printf("switching to: %s, from: %s\n", next_thread->name, susp_thread->name);
+    // Charge the budget first: a thread that used it up is queued as a normal
+    // thread.
+
+    rt_charge(susp_thread);
+
+    next_thread = runq_take(h);
+    h->handoff = 0;
+
+    if (next_thread == susp_thread) {
+        // We were woken up before we got to switch away.
+
+        set_thread_state(susp_thread, THREAD_RUNNING);
+        intr_restore(saved_intr_state);
+        return;
+    }
+
+    if (next_thread == NULL) {
+        // Nothing else to run. A running thread just keeps going; otherwise
+        // this hart goes idle.
+
+        if (susp_thread->state == THREAD_RUNNING) {
+            intr_restore(saved_intr_state);
+            return;
+        }
+
+        next_thread = h->idle;
+    } else
+        assert(next_thread->state == THREAD_READY);
 
-    assert(next_thread->state == THREAD_READY);
-    set_thread_state(next_thread, THREAD_RUNNING);
-    
     // If the current thread is still running, mark it ready-to-run and put it
-    // in the back of the ready-to-run list.
+    // in the back of the run queue. The idle thread is never queued.
 
     if (susp_thread->state == THREAD_RUNNING) {
         set_thread_state(susp_thread, THREAD_READY);
-        tlinsert(&ready_list, susp_thread);
+        if (susp_thread != h->idle)
+            ready_push(susp_thread, 0);
     }
 
-    intr_enable();
+    // A thread that was just queued by another hart may still be on that
+    // hart's stack. Wait for the other hart to finish switching away from it.
+
+    while (__atomic_load_n(&next_thread->on_cpu, __ATOMIC_ACQUIRE))
+        continue;
 
-    if (next_thread->proc != NULL)
-        memory_space_switch(next_thread->proc->mtag);
+    next_thread->on_cpu = 1;
+    next_thread->hart = h;
+    set_thread_state(next_thread, THREAD_RUNNING);
+
+    // Kernel threads run in the main memory space, so that no hart keeps using
+    // a memory space that a process on another hart is about to destroy.
+    // Switching flushes the TLB, so skip it when the space does not change
+    // (kernel thread to kernel thread, or between threads of one process).
+
+    next_mtag = (next_thread->proc != NULL) ?
+        next_thread->proc->mtag : main_mtag;
+
+    if (next_mtag != active_memory_space())
+        memory_space_switch(next_mtag);
+
+    fp_switch(susp_thread, next_thread, h);
+    acct_charge(susp_thread);
+
+    schedtrace(SCHEDTRACE_SWITCH_OUT, susp_thread->id, susp_thread->state);
+    schedtrace(SCHEDTRACE_SWITCH_IN, next_thread->id,
+        (uintptr_t)next_thread->name);
 
     trace("Thread <%s> calling _thread_swtch(<%s>)",
         CURTHR->name, next_thread->name);
-    
+
     prev_thread = _thread_swtch(next_thread);
 
     trace("_thread_swtch() returned in %s", CURTHR->name);
 
-    if (prev_thread->state == THREAD_EXITED) {
-        memory_free_page(prev_thread->stack_base - PAGE_SIZE);
-        prev_thread->stack_base = NULL;
-        prev_thread->stack_size = 0;
-    }
+    thread_finish_switch(prev_thread);
 
     intr_restore(saved_intr_state);
 }
 
+void thread_finish_switch(struct thread * prev) {
+    // We may be on a different hart than when we last ran, so our cycle stamp
+    // is meaningless; start counting afresh.
+
+    CURTHR->acct_time = csrr_time();
+    CURTHR->acct_cycle = csrr_cycle();
+
+    CURTHR->rt_stamp = CURTHR->acct_time;
+    rt_update(CURTHR, CURTHR->rt_stamp);
+    rt_arm_timer(CURTHR);
+
+    if (prev->state == THREAD_EXITED && prev->stack_base != NULL) {
+        kstack_put(prev->stack_base - prev->stack_size);
+        prev->stack_base = NULL;
+        prev->stack_size = 0;
+    }
+
+    // From here on, another hart may resume (or the parent may recycle) prev.
+
+    __atomic_store_n(&prev->on_cpu, 0, __ATOMIC_RELEASE);
+}
+
+int spawn_user_thread (
+    const char * name, struct process * proc,
+    const struct trap_frame * tfr, struct thread * fp_src)
+{
+    struct trap_frame * child_tfr;
+    struct thread * child;
+    int tid;
+
+    // Allocate a stack and a struct thread
+
+    child = thread_alloc();
+    if (child == NULL)
+        return -ENOMEM;
+
+    // The trap frame goes just below the stack anchor, where
+    // _thread_finish_fork expects it.
+
+    child_tfr = (struct trap_frame *)child->stack_base - 1;
+    memcpy(child_tfr, tfr, sizeof(struct trap_frame));
+
+    // FP state that U mode changed has to be written back before we can copy
+    // it.
+
+    child->fp_hart = NULL;
+
+    if (fp_src != NULL && fp_src->fp_used) {
+        const int saved_intr_state = intr_disable();
+        fp_sync(fp_src);
+        intr_restore(saved_intr_state);
+        child->fpstate = fp_src->fpstate;
+        child->fp_used = 1;
+    } else {
+        child->fp_used = 0;
+        child_tfr->sstatus &= ~RISCV_SSTATUS_FS;
+    }
+
+    // The child goes straight back to U mode, so its time counts as user time
+    // from the start.
+
+    child->acct_user = 1;
+    memset(&child->usage, 0, sizeof(child->usage));
+    memset(&child->child_usage, 0, sizeof(child->child_usage));
+
+    child->name = name;
+    child->proc = proc;
+    child->wait_cond = NULL;
+    condition_init(&child->child_exit, NULL);
+    child->prio = 0;
+    child->ticks = 0;
+    child->preempt = 0;
+    child->preempt_count = 0;
+    child->resched = 0;
+    child->on_cpu = 0;
+    set_thread_state(child, THREAD_READY);
+
+    _thread_setup(child, child_tfr,
+        (void (*)(void *))_thread_finish_fork, child_tfr);
+
+    tid = thread_publish(child);
+
+    if (tid < 0)
+        thread_free(child);
+
+    return tid;
+}
+
+struct trap_frame * user_tfr(const struct thread * thr) {
+    return (struct trap_frame *)thr->stack_base - 1;
+}
+
+void acct_charge(struct thread * thr) {
+    const uint64_t now = csrr_time();
+    const uint64_t cycle = csrr_cycle();
+
+    if (thr->acct_user) {
+        thr->usage.utime += now - thr->acct_time;
+        thr->usage.ucycles += cycle - thr->acct_cycle;
+    } else {
+        thr->usage.stime += now - thr->acct_time;
+        thr->usage.scycles += cycle - thr->acct_cycle;
+    }
+
+    thr->acct_time = now;
+    thr->acct_cycle = cycle;
+}
+
+int rt_active(const struct thread * thr) {
+    return (thr->rt_period != 0 && !thr->rt_throttled);
+}
+
+unsigned long rt_update(struct thread * thr, uint64_t now) {
+    unsigned long n;
+
+    if (thr->rt_period == 0 || now < thr->rt_deadline)
+        return 0;
+
+    n = (now - thr->rt_deadline) / thr->rt_period + 1;
+
+    thr->rt_misses += n - thr->rt_done;
+    thr->rt_deadline += n * thr->rt_period;
+    thr->rt_used = 0;
+    thr->rt_throttled = 0;
+    thr->rt_done = 0;
+    return n;
+}
+
+unsigned long rt_charge(struct thread * thr) {
+    const uint64_t now = csrr_time();
+    unsigned long n;
+
+    if (thr->rt_period == 0)
+        return 0;
+
+    thr->rt_used += now - thr->rt_stamp;
+    thr->rt_stamp = now;
+
+    n = rt_update(thr, now);
+
+    if (!thr->rt_throttled && thr->rt_budget <= thr->rt_used) {
+        thr->rt_throttled = 1;
+        thr->preempt = 1;
+
+        // The alarm may still be on the sleep list if the previous period's
+        // one has not been handled yet.
+
+        alarm_cancel(&thr->rt_replenish);
+        alarm_arm(&thr->rt_replenish, thr->rt_deadline - now);
+    }
+
+    return n;
+}
+
+// A throttled thread that is still running is interrupted when its next
+// period starts, so that it becomes a real-time thread again. One that is
+// waiting on a run queue by then is moved by rt_replenish instead.
+
+void rt_arm_timer(const struct thread * thr) {
+    uint64_t twake = 0;
+
+    if (thr->rt_period != 0) {
+        twake = thr->rt_deadline;
+        if (!thr->rt_throttled &&
+            thr->rt_stamp + thr->rt_budget - thr->rt_used < twake)
+        {
+            twake = thr->rt_stamp + thr->rt_budget - thr->rt_used;
+        }
+    }
+
+    timer_set_budget_end(twake);
+}
+
+// Called by the timer interrupt handler with the sleep list locked. Only a
+// thread that is waiting on a run queue needs moving: a running one is
+// interrupted by rt_arm_timer, and a blocked one starts its new period in
+// ready_push when it is woken. If the thread is taken off the run queue
+// before we get to it, tlunlink does not find it and we leave it alone.
+
+void rt_replenish(struct alarm * al) {
+    struct thread * const thr =
+        (void*)al - offsetof(struct thread, rt_replenish);
+    struct runq * rq;
+    int found;
+
+    if (thr->state != THREAD_READY || !thr->rt_throttled)
+        return;
+
+    rq = &runqs[thr->hart->id];
+
+    spin_lock(&rq->lock);
+    found = tlunlink(&rq->lists[thr->prio], thr);
+    if (found)
+        rq->cnt -= 1;
+    spin_unlock(&rq->lock);
+
+    if (found)
+        ready_push(thr, 0);
+}
+
+// Threads with the same deadline run in the order they were queued.
+
+void rt_insert(struct thread_list * list, struct thread * thr) {
+    struct thread ** link = &list->head;
+
+    while (*link != NULL && (*link)->rt_deadline <= thr->rt_deadline)
+        link = &(*link)->list_next;
+
+    thr->list_next = *link;
+    *link = thr;
+
+    if (thr->list_next == NULL)
+        list->tail = thr;
+}
+
+void usage_add(struct thread_usage * sum, const struct thread_usage * u) {
+    sum->utime += u->utime;
+    sum->stime += u->stime;
+    sum->ucycles += u->ucycles;
+    sum->scycles += u->scycles;
+}
+
+uint64_t ticks_to_us(uint64_t ticks) {
+    // Split to avoid overflow in ticks * 1000000
+    return ticks / TIMER_FREQ * 1000000 +
+        ticks % TIMER_FREQ * 1000000 / TIMER_FREQ;
+}
+
+void fp_sync(struct thread * thr) {
+    struct trap_frame * const tfr = user_tfr(thr);
+
+    // sstatus.FS of U mode, as saved on entry to the kernel, tells us whether
+    // the registers were written. The kernel itself does not use FP.
+
+    if ((tfr->sstatus & RISCV_SSTATUS_FS) != RISCV_SSTATUS_FS_DIRTY)
+        return;
+
+    csrs_sstatus(RISCV_SSTATUS_FS_CLEAN);
+    _thread_fp_save(&thr->fpstate);
+    tfr->sstatus = (tfr->sstatus & ~RISCV_SSTATUS_FS) | RISCV_SSTATUS_FS_CLEAN;
+    thr->fp_hart = thr->hart;
+    thr->hart->fp_owner = thr;
+}
+
+// FP registers are switched lazily. A thread that never used FP in U mode
+// (fp_used is clear, and it runs with sstatus.FS Off) costs nothing here. A
+// thread that did is saved only if its U mode sstatus.FS is Dirty, and loaded
+// only if the registers of this hart do not already hold its state. The first
+// FP instruction of a thread traps, and thread_fp_first_use turns FS on.
+
+void fp_switch(struct thread * susp, struct thread * next, struct hart * h) {
+    if (susp->fp_used && susp->state != THREAD_EXITED)
+        fp_sync(susp);
+
+    if (next->fp_used && !(h->fp_owner == next && next->fp_hart == h)) {
+        csrs_sstatus(RISCV_SSTATUS_FS_CLEAN);
+        _thread_fp_restore(&next->fpstate);
+        next->fp_hart = h;
+        h->fp_owner = next;
+    }
+}
+
+void wait_prepare(struct condition * cond) {
+    assert(CURTHR->state == THREAD_RUNNING);
+
+    // Insert current thread into condition wait list
+
+    schedtrace(SCHEDTRACE_BLOCK, CURTHR->id, (uintptr_t)cond->name);
+    set_thread_state(CURTHR, THREAD_WAITING);
+    CURTHR->wait_cond = cond;
+    CURTHR->list_next = NULL;
+    tlinsert(&cond->wait_list, CURTHR);
+}
+
+void wait_locked(struct condition * cond) {
+    wait_prepare(cond);
+    spin_unlock(&sched_lock);
+    suspend_self();
+    spin_lock(&sched_lock);
+}
+
+void broadcast_locked(struct condition * cond) {
+    struct thread * thr;
+
+    // Wake all waiting threads in the order they were added to the wait queue.
+
+    while ((thr = tlremove(&cond->wait_list)) != NULL) {
+        assert (thr->wait_cond == cond);
+        wake_locked(thr);
+    }
+}
+
+// The new owner's priority is left alone: unlike a broadcast, this wakeup is
+// not a sign the thread is interactive.
+
+struct thread * handoff_locked(struct condition * cond) {
+    struct thread * thr;
+
+    thr = tlremove(&cond->wait_list);
+
+    if (thr == NULL)
+        return NULL;
+
+    assert (thr->state == THREAD_WAITING);
+    assert (thr->wait_cond == cond);
+    schedtrace(SCHEDTRACE_WAKEUP, thr->id, CURTHR->id);
+    set_thread_state(thr, THREAD_READY);
+    thr->wait_cond = NULL;
+    ready_push(thr, 0);
+    return thr;
+}
+
+void wake_locked(struct thread * thr) {
+    struct hart * const h = this_hart();
+
+    assert (thr->state == THREAD_WAITING);
+
+    schedtrace(SCHEDTRACE_WAKEUP, thr->id, CURTHR->id);
+
+    // Threads that were waiting are likely interactive or I/O bound, so they go
+    // back to the top level.
+
+    set_thread_state(thr, THREAD_READY);
+    thr->wait_cond = NULL;
+    thr->prio = thr->background ? NLEVEL-1 : 0;
+    thr->ticks = 0;
+
+    // Woken by an ISR: hand it this hart when the interrupt returns, unless
+    // the interrupted thread is idle anyway or the hart has used up its
+    // hand-offs for this tick.
+
+    if (h->in_intr && CURTHR != h->idle && h->handoffs < WAKE_HANDOFF_MAX) {
+        h->handoffs += 1;
+        h->handoff = 1;
+        thr->hart = h;
+        ready_push(thr, 1);
+    } else
+        ready_push(thr, 0);
+}
+
+// Called from the timer interrupt handler with timer_lock held. Lock order is
+// timer_lock, then sched_lock.
+
+void timed_wait_expire(struct alarm * al) {
+    struct timed_wait * const tw = (struct timed_wait *)al;
+
+    spin_lock(&sched_lock);
+
+    tw->expired = 1;
+
+    if (tw->thr->state == THREAD_WAITING && tw->thr->wait_cond == tw->cond &&
+        tlunlink(&tw->cond->wait_list, tw->thr))
+    {
+        tw->timed_out = 1;
+        wake_locked(tw->thr);
+    }
+
+    spin_unlock(&sched_lock);
+}
+
 void tlclear(struct thread_list * list) {
     list->head = NULL;
     list->tail = NULL;
@@ -649,6 +2177,14 @@ int tlempty(const struct thread_list * list) {
     return (list->head == NULL);
 }
 
+void tlpush(struct thread_list * list, struct thread * thr) {
+    thr->list_next = list->head;
+    list->head = thr;
+
+    if (list->tail == NULL)
+        list->tail = thr;
+}
+
 void tlinsert(struct thread_list * list, struct thread * thr) {
     thr->list_next = NULL;
 
@@ -670,12 +2206,12 @@ struct thread * tlremove(struct thread_list * list) {
     struct thread * thr;
 
     thr = list->head;
-    
+
     if (thr == NULL)
         return NULL;
 
     list->head = thr->list_next;
-    
+
     if (list->head != NULL)
         thr->list_next = NULL;
     else
@@ -685,12 +2221,34 @@ struct thread * tlremove(struct thread_list * list) {
     return thr;
 }
 
+// Removes /thr/ from /list/. Returns 1 if it was on the list, 0 otherwise.
+
+int tlunlink(struct thread_list * list, struct thread * thr) {
+    struct thread * prev = NULL;
+    struct thread * cur;
+
+    for (cur = list->head; cur != NULL; prev = cur, cur = cur->list_next) {
+        if (cur == thr) {
+            if (prev != NULL)
+                prev->list_next = cur->list_next;
+            else
+                list->head = cur->list_next;
+            if (list->tail == cur)
+                list->tail = prev;
+            cur->list_next = NULL;
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
 // Appends elements of l1 to the end of l0 and clears l1.
 
 void tlappend(struct thread_list * l0, struct thread_list * l1) {
     if (l0->head != NULL) {
         assert(l0->tail != NULL);
-        
+
         if (l1->head != NULL) {
             assert(l1->tail != NULL);
             l0->tail->list_next = l1->head;
@@ -706,32 +2264,182 @@ void tlappend(struct thread_list * l0, struct thread_list * l1) {
     l1->tail = NULL;
 }
 
-void idle_thread_func(void * arg __attribute__ ((unused))) {
-    // The idle thread sleeps using wfi if the ready list is empty. Note that we
-    // need to disable interrupts before checking if the thread list is empty to
-    // avoid a race condition where an ISR marks a thread ready to run between
-    // the call to tlempty() and the wfi instruction.
+// Queues /thr/ on the run queue of the hart it last ran on, then makes sure
+// some hart notices: the target hart if it is idle, otherwise any idle hart
+// (which will steal the thread), otherwise the target hart so that it can
+// preempt a lower-priority thread. A thread pushed to the front of this hart's
+// queue is about to run here, so no other hart is told.
+
+void ready_push(struct thread * thr, int front) {
+    struct hart * const h = thr->hart;
+    struct runq * const rq = &runqs[h->id];
+    int i;
+
+    if (thr->rt_period != 0)
+        rt_update(thr, csrr_time());
+
+    spin_lock(&rq->lock);
+    if (rt_active(thr))
+        rt_insert(&rq->rt, thr);
+    else if (front)
+        tlpush(&rq->lists[thr->prio], thr);
+    else
+        tlinsert(&rq->lists[thr->prio], thr);
+    rq->cnt += 1;
+    spin_unlock(&rq->lock);
 
-    for (;;) {
-        // If there are runnable threads, yield to them.
+    if (front && h == this_hart())
+        return;
 
-        while (!tlempty(&ready_list))
-            thread_yield();
-        
-        // No runnable threads. Sleep using the wfi instruction. Note that we
-        // need to disable interrupts and check the runnable thread list one
-        // more time (make sure it is empty) to avoid a race condition where an
-        // ISR marks a thread ready before we call the wfi instruction.
+    __atomic_thread_fence(__ATOMIC_SEQ_CST); // pairs with thread_idle_loop
 
-        intr_disable();
-        if (tlempty(&ready_list))
-            asm ("wfi");
-        intr_enable();
+    if (h->idling) {
+        smp_send_ipi(h, IPI_RESCHED);
+        return;
+    }
+
+    for (i = 0; i < NHART; i++) {
+        if (harts[i].online && harts[i].idling && &harts[i] != this_hart()) {
+            smp_send_ipi(&harts[i], IPI_RESCHED);
+            return;
+        }
+    }
+
+    if (h != this_hart())
+        smp_send_ipi(h, IPI_RESCHED);
+}
+
+struct thread * runq_pop(struct runq * rq) {
+    struct thread * thr;
+    int l;
+
+    spin_lock(&rq->lock);
+
+    thr = tlremove(&rq->rt);
+
+    for (l = 0; thr == NULL && l < NLEVEL; l++)
+        thr = tlremove(&rq->lists[l]);
+
+    if (thr != NULL)
+        rq->cnt -= 1;
+
+    spin_unlock(&rq->lock);
+    return thr;
+}
+
+// Returns the next thread for hart /h/ to run: the first thread on its own run
+// queue, or failing that, one stolen from the next busy hart. Returns NULL if
+// all run queues are empty.
+
+struct thread * runq_take(struct hart * h) {
+    struct thread * thr;
+    int i, victim;
+
+    thr = runq_pop(&runqs[h->id]);
+
+    for (i = 1; thr == NULL && i < NHART; i++) {
+        victim = (h->id + i) % NHART;
+        if (runqs[victim].cnt != 0)
+            thr = runq_pop(&runqs[victim]);
+    }
+
+    return thr;
+}
+
+// Returns 1 if no hart has a thread ready to run.
+
+int ready_empty(void) {
+    int i;
+
+    for (i = 0; i < NHART; i++) {
+        if (runqs[i].cnt != 0)
+            return 0;
+    }
+
+    return 1;
+}
+
+// Returns 1 if a real-time thread or a thread at a level higher than /prio/ is
+// ready to run on this hart.
+
+int ready_above(int prio) {
+    struct runq * const rq = &runqs[this_hart()->id];
+    int l;
+
+    if (!tlempty(&rq->rt))
+        return 1;
+
+    for (l = 0; l < prio && l < NLEVEL; l++) {
+        if (!tlempty(&rq->lists[l]))
+            return 1;
+    }
+
+    return 0;
+}
+
+// Returns 1 if a real-time thread with a deadline earlier than /deadline/ is
+// ready to run on this hart. Like ready_above, only peeks at the run queue;
+// the answer may be stale by the time the caller acts on it.
+
+int ready_before(uint64_t deadline) {
+    struct runq * const rq = &runqs[this_hart()->id];
+    struct thread * const thr = rq->rt.head;
+
+    return (thr != NULL && thr->rt_deadline < deadline);
+}
+
+#if SCHED_POLICY == SCHED_MLFQ
+
+// Moves every thread except background threads back to level 0. Ready threads
+// keep their relative order, with higher levels ahead of lower ones. Called
+// with interrupts disabled.
+
+void mlfq_boost(void) {
+    struct thread_list keep;
+    struct thread * thr;
+    int c, tid;
+    int i, l;
+
+    spin_lock(&sched_lock);
+
+    for (c = 0; c < thrtab_nchunk; c++) {
+        for (tid = 0; tid < THRTAB_CHUNK; tid++) {
+            thr = thrtab[c][tid];
+            if (thr != NULL && thr != &idle_thread && !thr->background) {
+                thr->prio = 0;
+                thr->ticks = 0;
+            }
+        }
+    }
+
+    spin_unlock(&sched_lock);
+
+    for (i = 0; i < NHART; i++) {
+        spin_lock(&runqs[i].lock);
+        for (l = 1; l < NLEVEL-1; l++)
+            tlappend(&runqs[i].lists[0], &runqs[i].lists[l]);
+
+        if (NLEVEL > 1) {
+            keep.head = keep.tail = NULL;
+            while ((thr = tlremove(&runqs[i].lists[NLEVEL-1])) != NULL)
+                tlinsert(thr->background ? &keep : &runqs[i].lists[0], thr);
+            runqs[i].lists[NLEVEL-1] = keep;
+        }
+
+        spin_unlock(&runqs[i].lock);
     }
 }
 
+#endif
+
+void idle_thread_func(void * arg __attribute__ ((unused))) {
+    thread_idle_loop();
+}
+
 
 
 char * get_thread_name (int tid) {
-    return (char *) thrtab[tid]->name;
+    struct thread * const thr = thrtab_get(tid);
+
+    return (char *) ((thr != NULL) ? thr->name : "?");
 }
@@ -6,15 +6,28 @@
 
 #include "trap.h"
 #include <stddef.h>
+#include <stdint.h>
 
-// NTHR is the maximum number of threads
+// NTHR is the maximum number of threads. The thread table grows in chunks as
+// threads are created, so a large NTHR costs little memory until it is used.
 
 #ifndef NTHR
-#define NTHR 16
+#define NTHR 512
+#endif
+
+// Kernel preemption. If nonzero, system calls run with interrupts enabled, and
+// a thread interrupted in S mode may be switched out just like one interrupted
+// in U mode, unless it holds a spinlock or has called preempt_disable.
+
+#ifndef KERNEL_PREEMPT
+#define KERNEL_PREEMPT 1
 #endif
 
 struct process; // forward decl. 
+struct rusage; // forward decl.
 struct thread; // forward decl.
+struct hart; // forward decl.
+struct spinlock; // forward decl.
 
 struct thread_stack_anchor {
     struct thread * thread;
@@ -47,9 +60,18 @@ extern void * cur_stack_base(void);
 // This function allocates new memory for the child process and sets up another thread struct.
 extern int thread_fork_to_user(struct process *child_proc, const struct trap_frame *parent_tfr);
 
-// This function begins be saving the currently running thread. Switches to the new child process thread and
-// back to the U mode interrupt handler
-extern void _thread_finish_fork(struct thread *child, const struct trap_frame *parent_tfr);
+// int thread_create_user(uintptr_t usp, uintptr_t upc, uintptr_t a0, uintptr_t a1)
+// Creates another thread in the running thread's process, which starts in U
+// mode at /upc/ with stack pointer /usp/ and arguments /a0/ and /a1/. The new
+// thread is a child of the running thread. Returns its thread id or a negative
+// error code.
+
+extern int thread_create_user (
+    uintptr_t usp, uintptr_t upc, uintptr_t a0, uintptr_t a1);
+
+// Entry point of a forked or user-created thread: returns to U mode by
+// restoring the trap frame copied to the top of the thread's stack.
+extern void __attribute__ ((noreturn)) _thread_finish_fork(const struct trap_frame *tfr);
 
 extern void thread_init(void);
 
@@ -74,6 +96,59 @@ extern int thread_spawn(const char * name, void (*start)(void *), void * arg);
 
 extern void thread_yield(void);
 
+// void thread_set_background(void)
+// Moves the running thread to the lowest MLFQ level for good: waking up and
+// the periodic boost no longer move it up, so it only runs when no other
+// thread is ready. For housekeeping threads such as the reaper.
+
+extern void thread_set_background(void);
+
+// void thread_tick(void)
+// Called from intr_handler on every timer tick, with interrupts disabled.
+// Charges the tick to the running thread for scheduling purposes, and renews
+// the hart's budget of ISR wake hand-offs (see wake_locked in thread.c).
+
+extern void thread_tick(void);
+
+// void thread_preempt(void)
+// Called from intr_handler before returning to a thread interrupted in U mode,
+// or in S mode if KERNEL_PREEMPT is set. Yields the CPU if the scheduler
+// decides the running thread should give it up; otherwise returns immediately.
+// If the thread is in a preempt_disable section, the yield is deferred until
+// the section ends.
+
+extern void thread_preempt(void);
+
+// void preempt_disable(void)
+// void preempt_enable(void)
+// Keep the running thread from being preempted between the two calls, which
+// nest. Does not stop interrupts. Every spinlock acquisition counts as a
+// preempt_disable, so code holding a spinlock is never switched out while
+// another thread spins on it. If the thread was due to be preempted in the
+// meantime, preempt_enable yields once the outermost section ends (unless
+// interrupts are disabled, in which case the next interrupt does it).
+
+#if KERNEL_PREEMPT
+extern void preempt_disable(void);
+extern void preempt_enable(void);
+#else
+static inline void preempt_disable(void) { }
+static inline void preempt_enable(void) { }
+#endif
+
+// struct thread * thread_create_idle(struct hart * h, void ** anchorp)
+// Creates the idle thread for a secondary hart. The thread is marked as running
+// on /h/; the hart is expected to start executing it with its stack pointer set
+// to the stack anchor returned in /anchorp/. Returns NULL if out of memory.
+
+extern struct thread * thread_create_idle(struct hart * h, void ** anchorp);
+
+// void thread_idle_loop(void)
+// Body of every idle thread. Runs ready threads while there are any and waits
+// for an interrupt otherwise. Does not return.
+
+extern void thread_idle_loop(void) __attribute__ ((noreturn));
+
 // int thread_join_any(void) int thread_join(int tid) Waits for a child thread
 // of the current thread to exit. The thread_join_any function waits for any of
 // the current thread's children to exit, while thread_join waits for a specific
@@ -105,6 +180,51 @@ extern void thread_set_process(int tid, struct process * proc);
 
 extern const char * thread_name(int tid);
 
+// int thread_fp_first_use(struct trap_frame * tfr)
+// Called by umode_excp_handler on an illegal instruction exception. If the FP
+// unit was off in U mode, the exception was most likely the running thread's
+// first FP instruction: turns the unit on with zeroed registers and returns 1,
+// and the instruction is retried. Otherwise returns 0.
+
+extern int thread_fp_first_use(struct trap_frame * tfr);
+
+// void thread_acct_trap_enter(void)
+// void thread_acct_trap_exit(void)
+// Called on entry to the kernel from U mode and before going back to U mode.
+// The running thread's CPU time is charged to its user time between an exit
+// and the next entry, and to its system time otherwise.
+
+extern void thread_acct_trap_enter(void);
+extern void thread_acct_trap_exit(void);
+
+// int thread_getrusage(int who, struct rusage * ru)
+// Fills in /ru/ with the CPU time used by the running thread (/who/ is
+// RUSAGE_SELF) or by its children that have been joined, and their children
+// in turn (RUSAGE_CHILDREN). Returns 0, or -EINVAL if /who/ is neither.
+
+extern int thread_getrusage(int who, struct rusage * ru);
+
+// int thread_rt_set(uint64_t period, uint64_t budget)
+// Makes the running thread a real-time thread that needs /budget/ timer ticks
+// of CPU time every /period/ ticks, starting now, or a normal thread again if
+// /period/ is 0. Real-time threads run ahead of all normal threads, earliest
+// deadline (end of the current period) first. A thread that uses up its
+// budget is preempted by the timer and runs as a normal thread for the rest
+// of the period. Returns 0, or -EINVAL if /budget/ is 0 or longer than
+// /period/.
+
+extern int thread_rt_set(uint64_t period, uint64_t budget);
+
+// int thread_rt_wait(void)
+// Ends the running real-time thread's work for the current period and sleeps
+// until the next period starts. If the current period has already ended, the
+// work for the next one is late and the thread does not sleep. Returns the
+// number of deadline misses (periods that ended before the thread called
+// thread_rt_wait) since the previous call, or -EINVAL if the thread is not a
+// real-time thread.
+
+extern int thread_rt_wait(void);
+
 // void condition_init(struct condition * cond, const char * name)
 // Initializes a condition variable. Argument /cond/ is a pointer to a struct
 // condition to initialize. Argument /name/ is the name of the thread, which may
@@ -123,6 +243,26 @@ extern void condition_init(struct condition * cond, const char * name);
 
 extern void condition_wait(struct condition * cond);
 
+// void condition_wait_spin(struct condition * cond, struct spinlock * lk)
+// Like condition_wait, for a condition protected by spinlock /lk/, which the
+// caller holds with interrupts disabled. The lock is released while the thread
+// is suspended and is held again when condition_wait_spin returns. A thread
+// that changes the state the condition stands for must hold /lk/ while it does
+// so and calls condition_broadcast; then no wakeup can be lost, even if the
+// waker runs on another hart.
+
+extern void condition_wait_spin(struct condition * cond, struct spinlock * lk);
+
+// int condition_wait_timeout (
+//     struct condition * cond, struct spinlock * lk, uint64_t tcnt)
+// Like condition_wait_spin, but gives up after /tcnt/ timer ticks. Returns 1 if
+// the wait timed out and 0 if the thread was woken by condition_broadcast or
+// condition_signal. The caller should re-check the state it is waiting for in
+// either case. The timeout is an alarm on the timer.c sleep list.
+
+extern int condition_wait_timeout (
+    struct condition * cond, struct spinlock * lk, uint64_t tcnt);
+
 // void condition_broadcast(struct condition * cond)
 
 // Wakes up all threads waiting on a condition. This function may be called from
@@ -133,6 +273,13 @@ extern void condition_wait(struct condition * cond);
 
 extern void condition_broadcast(struct condition * cond);
 
+// void condition_signal(struct condition * cond)
+// Wakes up the thread that has waited longest on a condition, if any. May be
+// called from an ISR. Use instead of condition_broadcast when any one waiter
+// can consume the event, to avoid waking threads that will only wait again.
+
+extern void condition_signal(struct condition * cond);
+
 
 
 // gets the name of the thread provided by the tid
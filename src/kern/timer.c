@@ -6,6 +6,8 @@
 #include "csr.h"
 #include "intr.h"
 #include "halt.h" // for assert
+#include "smp.h"
+#include "spinlock.h"
 
 #include "config.h"
 #include <limits.h>
@@ -19,6 +21,16 @@
 
 #define TICK_PERIOD (TIMER_FREQ/TICK_FREQ)
 
+// With TICKLESS_IDLE set, an idle hart stops its scheduler tick and only takes
+// timer interrupts for alarms. Set it to 0 to keep ticking in wfi.
+
+#ifndef TICKLESS_IDLE
+#define TICKLESS_IDLE 1
+#endif
+
+// If IDLE_STATS is defined, each hart prints how often its idle thread woke up
+// every IDLE_STATS seconds (counted when the hart next goes idle).
+
 
 
 // EXPORTED GLOBAL VARIABLE DEFINITIONS
@@ -29,14 +41,29 @@ char timer_initialized = 0;
 // INTERNVAL GLOBAL VARIABLE DEFINITIONS
 //
 
+// The sleep list is shared by all harts; each hart has its own timer compare
+// register and scheduler tick (struct hart next_tick). Whichever hart takes a
+// timer interrupt first wakes the expired alarms.
+
 static struct alarm * sleep_list;
-static uint64_t next_tick;
+static struct spinlock timer_lock = SPINLOCK_INIT("timer");
 
 // INTERNAL FUNCTION DECLARATIONS
 //
 
 static void enable_mmode_timer_intr(void);
 
+// Sets this hart's timer compare register to the earliest of the next tick (if
+// the hart is ticking), the first alarm and the budget end of the running
+// thread. Called with timer_lock held.
+
+static void program_timer(struct hart * h);
+
+// Inserts /al/ into the sleep list in order of wake-up time and reprograms this
+// hart's timer if it is the earliest. Called with timer_lock held.
+
+static void sleep_list_insert(struct alarm * al);
+
 static inline uint64_t get_mtime(void);
 static inline void set_mtime(uint64_t val);
 static inline uint64_t get_mtcmp(void);
@@ -47,21 +74,84 @@ static inline void set_mtcmp(uint64_t val);
 
 void timer_init(void) {
     set_mtime(0);
-    set_mtcmp(TICK_PERIOD);
+    timer_init_hart();
+
+    timer_initialized = 1;
+}
+
+void timer_init_hart(void) {
+    struct hart * const h = this_hart();
+
+    h->next_tick = get_mtime() + TICK_PERIOD;
+    set_mtcmp(h->next_tick);
     csrs_sie(RISCV_SIE_STIE);
     enable_mmode_timer_intr();
+}
 
-    timer_initialized = 1;
+void timer_idle_enter(void) {
+    struct hart * const h = this_hart();
+#ifdef IDLE_STATS
+    static uint64_t stats_start[NHART];
+    static unsigned long stats_wakeups[NHART];
+    const uint64_t now = get_mtime();
+
+    if (stats_start[h->id] + IDLE_STATS * TIMER_FREQ <= now) {
+        if (stats_start[h->id] != 0) {
+            kprintf("hart %d: %lu idle wakeups/s\n", h->id,
+                (h->idle_wakeups - stats_wakeups[h->id]) * TIMER_FREQ /
+                (now - stats_start[h->id]));
+        }
+        stats_start[h->id] = now;
+        stats_wakeups[h->id] = h->idle_wakeups;
+    }
+#endif
+
+    if (!TICKLESS_IDLE || !timer_initialized)
+        return;
+
+    spin_lock(&timer_lock);
+    h->tickless = 1;
+    program_timer(h);
+    spin_unlock(&timer_lock);
+}
+
+void timer_idle_exit(void) {
+    struct hart * const h = this_hart();
+
+    if (!h->tickless)
+        return;
+
+    spin_lock(&timer_lock);
+    h->tickless = 0;
+    h->next_tick = get_mtime() + TICK_PERIOD;
+    program_timer(h);
+    spin_unlock(&timer_lock);
+
+    enable_mmode_timer_intr();
+}
+
+void timer_set_budget_end(uint64_t twake) {
+    struct hart * const h = this_hart();
+
+    if (h->budget_end == twake)
+        return;
+
+    spin_lock(&timer_lock);
+    h->budget_end = twake;
+    program_timer(h);
+    spin_unlock(&timer_lock);
+
+    enable_mmode_timer_intr();
 }
 
 void alarm_init(struct alarm * al, const char * name) {
     condition_init(&al->cond, name ? name : "alarm");
     al->twake = get_mtime();
     al->next = NULL;
+    al->expire = NULL;
 }
 
 void alarm_sleep(struct alarm * al, uint64_t tcnt) {
-    struct alarm * prev;
     int saved_intr_state;
     uint64_t now;
 
@@ -79,17 +169,127 @@ void alarm_sleep(struct alarm * al, uint64_t tcnt) {
     if (al->twake < now)
         return;
     
-    saved_intr_state = intr_disable();
+    saved_intr_state = spin_lock_irqsave(&timer_lock);
+
+    sleep_list_insert(al);
+
+    debug("[%lu] Next timer interrupt set for %lu ticks", now, get_mtcmp());
+
+    // Note: we must wait while still holding timer_lock to prevent a race
+    // condition where an alarm is signalled (on any hart) before we wait.
+
+    condition_wait_spin(&al->cond, &timer_lock);
+
+    spin_unlock_irqrestore(&timer_lock, saved_intr_state);
+}
+
+// Resets the alarm so that the next sleep increment is relative to the time
+// alarm_reset is called.
+
+void alarm_reset(struct alarm * al) {
+    al->twake = get_mtime();
+}
+
+void alarm_arm(struct alarm * al, uint64_t tcnt) {
+    int saved_intr_state;
+    uint64_t now;
+
+    now = get_mtime();
+
+    if (UINT64_MAX - now < tcnt)
+        al->twake = UINT64_MAX;
+    else
+        al->twake = now + tcnt;
+
+    saved_intr_state = spin_lock_irqsave(&timer_lock);
+    sleep_list_insert(al);
+    spin_unlock_irqrestore(&timer_lock, saved_intr_state);
+}
+
+int alarm_cancel(struct alarm * al) {
+    struct alarm ** link;
+    int saved_intr_state;
+    int found = 0;
+
+    saved_intr_state = spin_lock_irqsave(&timer_lock);
+
+    for (link = &sleep_list; *link != NULL; link = &(*link)->next) {
+        if (*link == al) {
+            *link = al->next;
+            al->next = NULL;
+            found = 1;
+            break;
+        }
+    }
+
+    spin_unlock_irqrestore(&timer_lock, saved_intr_state);
+    return found;
+}
+
+// timer_handle_interrupt() is dispatched from intr_handler in intr.c
+
+int timer_intr_handler(struct trap_frame * tfr) {
+    struct hart * const h = this_hart();
+    struct alarm * head;
+    struct alarm * next;
+    int tick = 0;
+    uint64_t now;
+
+    spin_lock(&timer_lock);
+
+    head = sleep_list;
+    now = get_mtime();
+
+    trace("[%lu] %s()", now, __func__);
+    debug("[%lu] mtcmp = %lu", now, get_mtcmp());
+
+    while (head != NULL && head->twake <= now) {
+        next = head->next;
+        head->next = NULL;
+        if (head->expire != NULL) {
+            debug("[%lu] Expiring alarm for %s", now, head->cond.name);
+            head->expire(head);
+        } else {
+            debug("[%lu] Broadcasting alarm for %s", now, head->cond.name);
+            condition_broadcast(&head->cond);
+        }
+        head = next;
+    }
+
+    if (h->budget_end != 0 && h->budget_end <= now)
+        h->budget_end = 0;
+
+    if (!h->tickless && h->next_tick < now) {
+        h->next_tick += TICK_PERIOD;
+        tick = 1;
+    }
+
+    sleep_list = head;
+    program_timer(h);
+
+    spin_unlock(&timer_lock);
+
+    debug("[%lu] Next timer interrupt set for %lu ticks", now, get_mtcmp());
+    enable_mmode_timer_intr();
+
+    return tick;
+}
+
+void sleep_list_insert(struct alarm * al) {
+    struct alarm * prev;
 
     if (sleep_list == NULL || al->twake <= sleep_list->twake) {
-        debug("[%lu] Inserting alarm %s at head of list", now, al->cond.name);
+        debug("[%lu] Inserting alarm %s at head of list",
+            al->twake, al->cond.name);
         // Insert alarm at head of sleep list
         al->next = sleep_list;
         sleep_list = al;
-        // If current alarm occurs before next tick, update mtcmp
+        // If current alarm occurs before next tick, update mtcmp. A tickless
+        // hart's next_tick is stale; its mtcmp holds the old head of the list,
+        // which is later than the new one.
 
-        if (al->twake < next_tick) {
-            set_mtcmp(al->twake);
+        if (this_hart()->tickless || al->twake < this_hart()->next_tick) {
+            program_timer(this_hart());
             csrs_sie(RISCV_SIE_STIE);
             enable_mmode_timer_intr();
         }
@@ -105,7 +305,7 @@ void alarm_sleep(struct alarm * al, uint64_t tcnt) {
         for (prev = sleep_list; prev->next != NULL; prev = prev->next) {
             if (al->twake <= prev->next->twake) {
                 debug("[%lu] Inserting alarm %s after %s",
-                    now, al->cond.name, prev->cond.name);
+                    al->twake, al->cond.name, prev->cond.name);
                 al->next = prev->next;
                 prev->next = al;
                 break;
@@ -119,59 +319,22 @@ void alarm_sleep(struct alarm * al, uint64_t tcnt) {
             prev->next = al;
         }
     }
-
-    debug("[%lu] Next timer interrupt set for %lu ticks", now, get_mtcmp());
-
-    // Note: condition_wait must be *inside* intr_disable/intr_restore block to
-    // prevent a race condition where an alarm is signalled before we call
-    // condition_wait.
-
-    condition_wait(&al->cond);
-
-    intr_restore(saved_intr_state);
 }
 
-// Resets the alarm so that the next sleep increment is relative to the time
-// alarm_reset is called.
+void program_timer(struct hart * h) {
+    uint64_t twake;
 
-void alarm_reset(struct alarm * al) {
-    al->twake = get_mtime();
-}
-
-// timer_handle_interrupt() is dispatched from intr_handler in intr.c
-
-void timer_intr_handler(struct trap_frame * tfr) {
-    struct alarm * head = sleep_list;
-    struct alarm * next;
-    uint64_t now;
-
-    now = get_mtime();
-
-    trace("[%lu] %s()", now, __func__);
-    debug("[%lu] mtcmp = %lu", now, get_mtcmp());
-
-    while (head != NULL && head->twake <= now) {
-        debug("[%lu] Broadcasting alarm for %s", now, head->cond.name);
-        condition_broadcast(&head->cond);
-        next = head->next;
-        head->next = NULL;
-        head = next;
-    }
-
-    if (next_tick < now)
-        next_tick += TICK_PERIOD;
-
-    sleep_list = head;
-
-    if (head != NULL && head->twake < next_tick)
-        set_mtcmp(head->twake);
+    if (h->tickless)
+        twake = (sleep_list != NULL) ? sleep_list->twake : UINT64_MAX;
+    else if (sleep_list != NULL && sleep_list->twake < h->next_tick)
+        twake = sleep_list->twake;
     else
-        set_mtcmp(next_tick);
-
+        twake = h->next_tick;
 
-    debug("[%lu] Next timer interrupt set for %lu ticks", now, get_mtcmp());
-    enable_mmode_timer_intr();
+    if (h->budget_end != 0 && h->budget_end < twake)
+        twake = h->budget_end;
 
+    set_mtcmp(twake);
 }
 
 void enable_mmode_timer_intr(void) {
@@ -180,7 +343,7 @@ void enable_mmode_timer_intr(void) {
 }
 
 #define MTIME_ADDR 0x200BFF8
-#define MTCMP_ADDR 0x2004000
+#define MTCMP_ADDR (0x2004000 + 8*(uintptr_t)this_hart()->id) // this hart's mtimecmp
 
 static inline uint64_t get_mtime(void) {
     return *(volatile uint64_t*)MTIME_ADDR;
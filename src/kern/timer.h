@@ -7,13 +7,13 @@
 #include <stdint.h>
 #include "thread.h" // for struct condition
 #include "trap.h" // for struct trap_frame
-
-#define TIMER_FREQ 10000000UL // from QEMU include/hw/intc/riscv_aclint.h
+#include "timerfreq.h" // for TIMER_FREQ
 
 struct alarm {
     struct condition cond;
     struct alarm * next;
     uint64_t twake;
+    void (*expire)(struct alarm * al); // called instead of broadcasting cond
 };
 
 // EXPORTED FUNCTION DECLARATIONS
@@ -22,6 +22,26 @@ struct alarm {
 extern char timer_initialized;
 extern void timer_init(void);
 
+// Starts the scheduler tick on the calling hart. Called by timer_init for the
+// boot hart and by each secondary hart when it comes online.
+
+extern void timer_init_hart(void);
+
+// Called by a hart's idle thread with interrupts disabled. timer_idle_enter
+// is called before each wfi. It stops the scheduler tick on this hart and
+// programs the timer for the earliest alarm only. timer_idle_exit is called
+// before switching to a runnable thread, and restarts the tick.
+
+extern void timer_idle_enter(void);
+extern void timer_idle_exit(void);
+
+// Makes this hart take a timer interrupt at /twake/ even if no tick or alarm
+// is due then, or stops doing so if /twake/ is 0. The scheduler uses this to
+// take the CPU from a real-time thread when its budget runs out (see
+// thread_rt_set). Called with interrupts disabled.
+
+extern void timer_set_budget_end(uint64_t twake);
+
 // Initializes an alarm. The /name/ argument is optional.
 
 extern void alarm_init(struct alarm * al, const char * name);
@@ -37,7 +57,22 @@ extern void alarm_sleep(struct alarm * al, uint64_t tcnt);
 
 extern void alarm_reset(struct alarm * al);
 
-extern void timer_intr_handler(struct trap_frame * tfr); // called from intr.c
+// Puts /al/ on the sleep list to expire /tcnt/ ticks from now, without
+// sleeping. When it expires, the timer interrupt handler calls al->expire,
+// with interrupts disabled and the sleep list locked, or broadcasts al->cond if
+// al->expire is NULL. The alarm must not already be on the sleep list.
+
+extern void alarm_arm(struct alarm * al, uint64_t tcnt);
+
+// Takes /al/ off the sleep list if it has not expired yet, and returns 1 if it
+// did so. On return, the expire function of /al/ is not running on any hart.
+
+extern int alarm_cancel(struct alarm * al);
+
+// Called from intr.c. Returns 1 if a scheduler tick has elapsed since the last
+// tick, 0 if the interrupt was only for an alarm.
+
+extern int timer_intr_handler(struct trap_frame * tfr);
 
 static inline void alarm_sleep_sec(struct alarm * al, unsigned int sec);
 static inline void alarm_sleep_ms(struct alarm * al, unsigned long ms);
@@ -0,0 +1,12 @@
+// timerfreq.h - Frequency of the RISC-V time counter
+//
+// Shared by the kernel and user programs, which read the counter with the
+// rdtime instruction.
+//
+
+#ifndef _TIMERFREQ_H_
+#define _TIMERFREQ_H_
+
+#define TIMER_FREQ 10000000UL // from QEMU include/hw/intc/riscv_aclint.h
+
+#endif // _TIMERFREQ_H_
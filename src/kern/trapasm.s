@@ -260,54 +260,82 @@ trap_umode_cont:
 #      setting MTIE and clearing STIP.
 #   3. When a M mode timer interrupt occurs, we set STIP and clear MTIE. S mode
 #      then needs to re-arm timer interrupts using (2).
+#   4. An M mode software interrupt is an IPI from another hart (see smp.c).
+#      We clear this hart's msip and pass it on to S mode by setting SSIP.
 #
+# mscratch points to a per-hart save area (set up in start.s), where we keep t1
+# and t2 while we use them.
 
 _mmode_trap_entry:
-        # Stash t0 away in mscratch
+        # Swap t0 with mscratch, then save t1 and t2
 
-        csrw    mscratch, t0
+        csrrw   t0, mscratch, t0
+        sd      t1, 0*8(t0)
+        sd      t2, 1*8(t0)
 
-        csrr    t0, mcause
-        bgez    t0, mmode_excp_handler
+        csrr    t1, mcause
+        bgez    t1, mmode_excp_handler
 
-        # If it's not a timer interrupt, panic
+        slli    t1, t1, 1       # clear msb
+        srli    t1, t1, 1       #
 
-        addi    t0, t0, -7      # subtract 7
-        slli    t0, t0, 1       # clear msb
-        bnez    t0, unexpected_mmode_trap
+        li      t2, 7           # machine timer interrupt
+        beq     t1, t2, mmode_timer_intr
+        li      t2, 3           # machine software interrupt
+        beq     t1, t2, mmode_soft_intr
 
-mmode_intr_handler:
+        # Anything else is unexpected
+
+        j       unexpected_mmode_trap
+
+mmode_timer_intr:
 
         # Set STIP, clear MTIE
 
-        li      t0, 0x20        # STIP
-        csrs    mip, t0
-        slli    t0, t0, 2       # MTIE
-        csrc    mie, t0
+        li      t1, 0x20        # STIP
+        csrs    mip, t1
+        slli    t1, t1, 2       # MTIE
+        csrc    mie, t1
+        j       mmode_trap_done
+
+mmode_soft_intr:
+
+        # Clear our msip (CLINT base + 4*mhartid), set SSIP
+
+        csrr    t1, mhartid
+        slli    t1, t1, 2
+        li      t2, 0x2000000
+        add     t1, t1, t2
+        sw      zero, 0(t1)
+
+        li      t1, 0x2         # SSIP
+        csrs    mip, t1
         j       mmode_trap_done
 
 mmode_excp_handler:
         # We support one S mode to M mode environment call, which is to re-arm
         # the timer interrupt.
 
-        addi    t0, t0, -9
-        bnez    t0, unexpected_mmode_trap
+        addi    t1, t1, -9
+        bnez    t1, unexpected_mmode_trap
 
         # Clear STIP, set MTIE
 
-        li      t0, 0x20        # STIP
-        csrc    mip, t0
-        slli    t0, t0, 2       # MTIE
-        csrs    mie, t0
+        li      t1, 0x20        # STIP
+        csrc    mip, t1
+        slli    t1, t1, 2       # MTIE
+        csrs    mie, t1
 
         # Advance mepc past ecall instruction
 
-        csrr    t0, mepc
-        addi    t0, t0, 4
-        csrw    mepc, t0
+        csrr    t1, mepc
+        addi    t1, t1, 4
+        csrw    mepc, t1
        
 mmode_trap_done:
-        csrr    t0, mscratch
+        ld      t2, 1*8(t0)
+        ld      t1, 0*8(t0)
+        csrrw   t0, mscratch, t0
         mret
 
 
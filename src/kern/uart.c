@@ -11,6 +11,7 @@
 #include "heap.h"
 #include "halt.h"
 #include "intr.h"
+#include "spinlock.h"
 #include "limits.h"
 
 // COMPILE-TIME CONSTANT DEFINITIONS
@@ -73,12 +74,15 @@ struct uart_device {
 	int irqno;
 
 	uint32_t rxovrcnt; // number of times OE was set
+	char nonblock; // reads return -EAGAIN instead of waiting (IOCTL_SETNBIO)
 
 	struct io_intf io_intf;
 	
 	struct condition rxbnotempty;
 	struct condition txbnotfull;	
 
+	struct spinlock lock; // ring buffers and ier, shared with uart_isr
+
 	struct ringbuf rxbuf;
 	struct ringbuf txbuf;
 };
@@ -90,6 +94,7 @@ static int uart_open(struct io_intf ** ioptr, void * aux);
 static void uart_close(struct io_intf * io);
 static long uart_read(struct io_intf * io, void * buf, unsigned long bufsz);
 static long uart_write(struct io_intf * io, const void * buf, unsigned long n);
+static int uart_ctl(struct io_intf * io, int cmd, void * arg);
 
 static void uart_isr(int irqno, void * driver_private);
 
@@ -108,7 +113,8 @@ void uart_attach(void * mmio_base, int irqno) {
 	static const struct io_ops uart_ops = {
 		.close = uart_close,
 		.read = uart_read,
-		.write = uart_write
+		.write = uart_write,
+		.ctl = uart_ctl
 	};
 
 	struct uart_device * dev;
@@ -121,6 +127,10 @@ void uart_attach(void * mmio_base, int irqno) {
 	}
 
 	dev = kcalloc(1, sizeof(struct uart_device));
+	if (dev == NULL) {
+		kprintf("%p: out of memory for uart\n", mmio_base);
+		return;
+	}
 
 	dev->regs = mmio_base;
 	dev->irqno = irqno;
@@ -128,6 +138,7 @@ void uart_attach(void * mmio_base, int irqno) {
 
 	condition_init(&dev->rxbnotempty, "rxnotempty");
 	condition_init(&dev->txbnotfull, "txnotfull");
+	spinlock_init(&dev->lock, "uart");
 
 	rbuf_init(&dev->rxbuf);
 	rbuf_init(&dev->txbuf);
@@ -156,6 +167,7 @@ int uart_open(struct io_intf ** ioptr, void * aux) {
 	
 	rbuf_init(&dev->rxbuf);
 	rbuf_init(&dev->txbuf);
+	dev->nonblock = 0;
 
 	// Read receive buffer register to clear it. Enable RX interrupts only.
 
@@ -186,6 +198,7 @@ long uart_read(struct io_intf * io, void * buf, unsigned long bufsz) {
 	struct uart_device * const dev =
 		(void*)io - offsetof(struct uart_device, io_intf);
 	char * p = buf; // position in buf to put next byte
+	int saved_intr_state;
 
 	trace("%s(buf=%p,bufsz=%ld)", __func__, buf, bufsz);
 	assert (io != NULL);
@@ -207,18 +220,25 @@ long uart_read(struct io_intf * io, void * buf, unsigned long bufsz) {
 	// 
 	// Could we implement this as a busy-wait?
 	// 
+	// The ISR may also run on another hart, so disabling interrupts is not
+	// enough; the buffers are protected by the device spinlock.
 
-	intr_disable();
-
-	while (rbuf_empty(&dev->rxbuf))
-		condition_wait(&dev->rxbnotempty);
+	saved_intr_state = spin_lock_irqsave(&dev->lock);
 
-	intr_enable();
+	while (rbuf_empty(&dev->rxbuf)) {
+		if (dev->nonblock) {
+			spin_unlock_irqrestore(&dev->lock, saved_intr_state);
+			return -EAGAIN;
+		}
+		condition_wait_spin(&dev->rxbnotempty, &dev->lock);
+	}
 
 	while (!rbuf_empty(&dev->rxbuf) && p - (char*)buf < bufsz)
 		*p++ = rbuf_get(&dev->rxbuf);
 	
 	dev->regs->ier |= IER_DREIE; // enable receive interrupts
+
+	spin_unlock_irqrestore(&dev->lock, saved_intr_state);
 	
 	return p - (char*)buf;
 }
@@ -227,6 +247,7 @@ long uart_write(struct io_intf * io, const void * buf, unsigned long n) {
 	struct uart_device * const dev =
 		(void*)io - offsetof(struct uart_device, io_intf);
 	const char * p = buf; // position in buf to get next byte
+	int saved_intr_state;
 	
 	trace("%s(n=%ld)", __func__, n);
 	assert (io != NULL);
@@ -239,23 +260,39 @@ long uart_write(struct io_intf * io, const void * buf, unsigned long n) {
 	// Wait until there is room in the transmit ring buffer.
 
 	while (p - (char*)buf < n) {
-		intr_disable();
+		saved_intr_state = spin_lock_irqsave(&dev->lock);
 		while (rbuf_full(&dev->txbuf))
-			condition_wait(&dev->txbnotfull);
-		intr_enable();
+			condition_wait_spin(&dev->txbnotfull, &dev->lock);
 
 		while (!rbuf_full(&dev->txbuf) && p - (char*)buf < n)
 			rbuf_put(&dev->txbuf, *p++);
 		
 		dev->regs->ier |= IER_THREIE;
+		spin_unlock_irqrestore(&dev->lock, saved_intr_state);
 	}
 
 	return p - (char*)buf;
 }
 
+int uart_ctl(struct io_intf * io, int cmd, void * arg) {
+	struct uart_device * const dev =
+		(void*)io - offsetof(struct uart_device, io_intf);
+
+	switch (cmd) {
+	case IOCTL_SETNBIO:
+		dev->nonblock = (*(int *)arg != 0);
+		return 0;
+	default:
+		return -ENOTSUP;
+	}
+}
+
 void uart_isr(int irqno, void * aux) {
 	struct uart_device * const dev = aux;
-	const uint_fast8_t line_status = dev->regs->lsr;
+	uint_fast8_t line_status;
+
+	spin_lock(&dev->lock);
+	line_status = dev->regs->lsr;
 
 	if (line_status & LSR_OE)
 		dev->rxovrcnt += 1;
@@ -277,6 +314,8 @@ void uart_isr(int irqno, void * aux) {
 		} else
 			dev->regs->ier &= ~IER_THREIE;
 	}
+
+	spin_unlock(&dev->lock);
 }
 
 int uart_open_ebusy (
@@ -0,0 +1,555 @@
+// vioballoon.c - VirtIO memory balloon
+//
+// The host sets a target number of pages in the device config. A work item on
+// system_wq inflates the balloon by taking pages off the free list and handing
+// their page frame numbers to the device, and deflates it by taking pages back
+// from the device and returning them to the page allocator. The stats queue
+// reports the page allocator's free and total memory to the host. When the
+// host allows it (VIRTIO_BALLOON_F_DEFLATE_ON_OOM), a shrinker gives balloon
+// pages back to the allocator instead of letting an allocation fail.
+//
+
+#ifndef TRACE
+#ifdef VIOBALLOON_TRACE
+#define TRACE
+#endif
+#endif
+
+#ifndef DEBUG
+#ifdef VIOBALLOON_DEBUG
+#define DEBUG
+#endif
+#endif
+
+#include "virtio.h"
+#include "config.h"
+#include "console.h"
+#include "intr.h"
+#include "halt.h"
+#include "heap.h"
+#include "memory.h"
+#include "error.h"
+#include "string.h"
+#include "thread.h"
+#include "spinlock.h"
+#include "workq.h"
+
+#include <stdint.h>
+
+// COMPILE-TIME PARAMETERS
+//
+
+#define VIOBALLOON_IRQ_PRIO 1
+
+// Number of free pages the balloon never takes, so that inflating does not
+// starve the rest of the kernel.
+
+#ifndef VIOBALLOON_RESERVE
+#define VIOBALLOON_RESERVE 64
+#endif
+
+// Maximum number of page frame numbers sent to the device in one request.
+
+#ifndef VIOBALLOON_BATCH
+#define VIOBALLOON_BATCH 256
+#endif
+
+// INTERNAL CONSTANT DEFINITIONS
+//
+
+// VirtIO balloon feature bits (number, *not* mask)
+
+#define VIRTIO_BALLOON_F_MUST_TELL_HOST     0
+#define VIRTIO_BALLOON_F_STATS_VQ           1
+#define VIRTIO_BALLOON_F_DEFLATE_ON_OOM     2
+
+// Virtqueue numbers
+
+#define VIOBALLOON_INFLATEQ 0
+#define VIOBALLOON_DEFLATEQ 1
+#define VIOBALLOON_STATSQ   2
+#define VIOBALLOON_NQ       3
+
+// Balloon page frame numbers are always in 4 kB units
+
+#define VIRTIO_BALLOON_PFN_SHIFT 12
+
+// Memory statistics tags
+
+#define VIRTIO_BALLOON_S_MEMFREE    4
+#define VIRTIO_BALLOON_S_MEMTOT     5
+#define VIRTIO_BALLOON_S_AVAIL      6
+
+#define VIOBALLOON_NSTATS 3
+
+#define VIOBALLOON_MAX_PAGES (RAM_SIZE / PAGE_SIZE)
+
+// Reasons for the work item to run (vioballoon_device.pending)
+
+#define VIOBALLOON_WORK_CONFIG  (1 << 0) // host changed the target
+#define VIOBALLOON_WORK_STATS   (1 << 1) // host asked for statistics
+#define VIOBALLOON_WORK_OOM     (1 << 2) // shrinker released pages
+
+// INTERNAL TYPE DEFINITIONS
+//
+
+struct virtio_balloon_stat {
+    uint16_t tag;
+    uint64_t val;
+} __attribute__ ((packed));
+
+// Each queue carries one request at a time, described by a single descriptor.
+
+struct vioballoon_virtq {
+    struct virtq_desc desc[1] __attribute__ ((aligned(16)));
+
+    union {
+        struct virtq_avail avail;
+        char _avail_filler[VIRTQ_AVAIL_SIZE(1)];
+    };
+
+    union {
+        volatile struct virtq_used used;
+        char _used_filler[VIRTQ_USED_SIZE(1)];
+    } __attribute__ ((aligned(4)));
+};
+
+struct vioballoon_device {
+    volatile struct virtio_mmio_regs * regs;
+    uint16_t irqno;
+    int8_t stats_enabled;
+    int8_t oom_enabled;
+
+    // Protects pending and the balloon and oom page lists against the ISR and
+    // the shrinker, which may run on another hart
+    struct spinlock lock;
+
+    // VIOBALLOON_WORK_* flags; set by the ISR and shrinker, cleared by
+    // vioballoon_work
+    volatile int pending;
+    struct work work; // queued when pending becomes non-zero
+    struct condition used_updated; // signaled from ISR
+
+    struct vioballoon_virtq vq[VIOBALLOON_NQ];
+
+    // Request buffer for the inflate and deflate queues
+    uint32_t batch[VIOBALLOON_BATCH];
+
+    struct virtio_balloon_stat stats[VIOBALLOON_NSTATS];
+    uint16_t stats_used_idx; // used.idx of stats queue when last answered
+};
+
+// INTERNAL FUNCTION DECLARATIONS
+//
+
+static void vioballoon_work(struct work * wk);
+static void vioballoon_isr(int irqno, void * aux);
+
+static void vioballoon_inflate(struct vioballoon_device * dev, uint32_t cnt);
+static void vioballoon_deflate(struct vioballoon_device * dev, uint32_t cnt);
+static void vioballoon_report_oom(struct vioballoon_device * dev);
+static void vioballoon_update_stats(struct vioballoon_device * dev);
+
+static void vioballoon_send (
+    struct vioballoon_device * dev, int qid, void * buf, uint32_t len);
+
+static unsigned long vioballoon_shrink(struct shrinker * shr, unsigned long nr);
+
+// INTERNAL GLOBAL VARIABLES
+//
+
+// Page frame numbers of the pages currently held by the balloon. Pages given
+// to the device may have had their contents discarded by the host, so the list
+// cannot be threaded through the pages themselves.
+
+static uint32_t balloon_pfns[VIOBALLOON_MAX_PAGES];
+static uint32_t balloon_cnt;
+
+// Page frame numbers of pages the shrinker took back from the balloon that the
+// device has not been told about yet. vioballoon_report_oom sends them a batch
+// at a time, while the shrinker may keep adding to the list.
+
+static uint32_t oom_pfns[VIOBALLOON_MAX_PAGES];
+static uint32_t oom_cnt;
+
+static struct vioballoon_device * balloon_dev; // only one balloon is driven
+
+static struct shrinker balloon_shrinker = {
+    .name = "vioballoon",
+    .scan = vioballoon_shrink
+};
+
+// EXPORTED FUNCTION DEFINITIONS
+//
+
+// void vioballoon_attach(volatile struct virtio_mmio_regs * regs, int irqno)
+//
+// Attaches a VirtIO balloon device. Declared and called directly from
+// virtio.c. Negotiates features, sets up the three virtqueues, registers the
+// ISR and queues the work that follows the host's target.
+
+void vioballoon_attach(volatile struct virtio_mmio_regs * regs, int irqno) {
+    virtio_featset_t enabled_features, wanted_features, needed_features;
+    struct vioballoon_device * dev;
+    int result;
+    int pie;
+    int q;
+
+    trace("%s(regs=%p,irqno=%d)", __func__, regs, irqno);
+
+    assert (regs->device_id == VIRTIO_ID_BALLOON);
+
+    if (balloon_dev != NULL) {
+        kprintf("%p: second virtio balloon ignored\n", regs);
+        return;
+    }
+
+    // Signal device that we found a driver
+    regs->status |= VIRTIO_STAT_DRIVER;
+    // fence o,io
+    __sync_synchronize();
+
+    // We don't tell the host before reusing pages, so MUST_TELL_HOST is not
+    // requested. Statistics and deflate-on-OOM are used when offered.
+
+    virtio_featset_init(needed_features);
+    virtio_featset_init(wanted_features);
+    virtio_featset_add(wanted_features, VIRTIO_BALLOON_F_STATS_VQ);
+    virtio_featset_add(wanted_features, VIRTIO_BALLOON_F_DEFLATE_ON_OOM);
+    result = virtio_negotiate_features(regs,
+        enabled_features, wanted_features, needed_features);
+
+    if (result != 0) {
+        kprintf("%p: virtio feature negotiation failed\n", regs);
+        return;
+    }
+
+    dev = kmalloc(sizeof(struct vioballoon_device));
+
+    if (dev == NULL) {
+        kprintf("%p: out of memory for virtio balloon\n", regs);
+        return;
+    }
+
+    memset(dev, 0, sizeof(struct vioballoon_device));
+
+    dev->regs = regs;
+    dev->irqno = irqno;
+    dev->stats_enabled =
+        virtio_featset_test(enabled_features, VIRTIO_BALLOON_F_STATS_VQ);
+    dev->oom_enabled =
+        virtio_featset_test(enabled_features, VIRTIO_BALLOON_F_DEFLATE_ON_OOM);
+
+    work_init(&dev->work, vioballoon_work);
+    condition_init(&dev->used_updated, "balloon_used_updated");
+    spinlock_init(&dev->lock, "balloon");
+
+    for (q = 0; q < VIOBALLOON_NQ; q++) {
+        if (q == VIOBALLOON_STATSQ && !dev->stats_enabled)
+            break;
+
+        virtio_attach_virtq(regs, q, 1,
+            (uint64_t)&dev->vq[q].desc[0],
+            (uint64_t)&dev->vq[q].used,
+            (uint64_t)&dev->vq[q].avail);
+        virtio_enable_virtq(regs, q);
+    }
+
+    balloon_dev = dev;
+
+    intr_register_isr(irqno, VIOBALLOON_IRQ_PRIO, vioballoon_isr, dev);
+    intr_enable_irq(irqno);
+
+    regs->status |= VIRTIO_STAT_DRIVER_OK;
+    // fence o,oi
+    __sync_synchronize();
+
+    // The device expects a stats buffer to be queued up front; it returns
+    // the buffer each time the host wants fresh numbers.
+
+    if (dev->stats_enabled) {
+        vioballoon_update_stats(dev);
+        dev->stats_used_idx = dev->vq[VIOBALLOON_STATSQ].used.idx;
+    }
+
+    if (dev->oom_enabled)
+        memory_register_shrinker(&balloon_shrinker);
+
+    // Pick up whatever target the host set before we attached
+
+    pie = spin_lock_irqsave(&dev->lock);
+    dev->pending |= VIOBALLOON_WORK_CONFIG;
+    work_queue(system_wq, &dev->work);
+    spin_unlock_irqrestore(&dev->lock, pie);
+}
+
+// INTERNAL FUNCTION DEFINITIONS
+//
+
+// void vioballoon_work(struct work * wk)
+//
+// Runs on system_wq whenever the ISR or the shrinker flags work. Reports
+// pages the shrinker took back, moves the balloon towards the host's target
+// and answers statistics requests. Work flagged while it runs queues it again.
+
+static void vioballoon_work(struct work * wk) {
+    struct vioballoon_device * const dev =
+        (void *)wk - offsetof(struct vioballoon_device, work);
+    uint32_t target;
+    int pending;
+    int pie;
+
+    pie = spin_lock_irqsave(&dev->lock);
+    pending = dev->pending;
+    dev->pending = 0;
+    spin_unlock_irqrestore(&dev->lock, pie);
+
+    debug("balloon work %x, %u pages held", pending, balloon_cnt);
+
+    if (pending & VIOBALLOON_WORK_OOM)
+        vioballoon_report_oom(dev);
+
+    if (pending & (VIOBALLOON_WORK_CONFIG | VIOBALLOON_WORK_OOM)) {
+        target = dev->regs->config.balloon.num_pages;
+
+        if (balloon_cnt < target)
+            vioballoon_inflate(dev, target - balloon_cnt);
+        else if (target < balloon_cnt)
+            vioballoon_deflate(dev, balloon_cnt - target);
+
+        dev->regs->config.balloon.actual = balloon_cnt;
+    }
+
+    if (pending & VIOBALLOON_WORK_STATS)
+        vioballoon_update_stats(dev);
+}
+
+// void vioballoon_isr(int irqno, void * aux)
+//
+// Used buffer notifications wake vioballoon_send; a returned stats buffer and
+// a config change flag work and queue vioballoon_work.
+
+static void vioballoon_isr(int irqno, void * aux) {
+    struct vioballoon_device * const dev = aux;
+    const uint32_t interrupt_status = dev->regs->interrupt_status;
+
+    spin_lock(&dev->lock);
+
+    if (interrupt_status & 0x1) {
+        if (dev->stats_enabled &&
+            dev->vq[VIOBALLOON_STATSQ].used.idx != dev->stats_used_idx)
+        {
+            dev->pending |= VIOBALLOON_WORK_STATS;
+        }
+
+        condition_broadcast(&dev->used_updated);
+    }
+
+    if (interrupt_status & 0x2)
+        dev->pending |= VIOBALLOON_WORK_CONFIG;
+
+    if (dev->pending != 0)
+        work_queue(system_wq, &dev->work);
+
+    spin_unlock(&dev->lock);
+
+    dev->regs->interrupt_ack = interrupt_status;
+    __sync_synchronize();
+}
+
+// void vioballoon_inflate(struct vioballoon_device * dev, uint32_t cnt)
+//
+// Gives up to /cnt/ pages to the device, in batches. Stops early rather than
+// dip into the last VIOBALLOON_RESERVE free pages.
+
+static void vioballoon_inflate(struct vioballoon_device * dev, uint32_t cnt) {
+    struct memory_stats mstats;
+    uint32_t n;
+    void * pp;
+    int pie;
+
+    while (cnt != 0) {
+        memory_get_stats(&mstats);
+
+        for (n = 0; n < cnt && n < VIOBALLOON_BATCH; n++) {
+            if (mstats.free_pages <= VIOBALLOON_RESERVE + n)
+                break;
+
+            pp = memory_try_alloc_page();
+            if (pp == NULL)
+                break;
+
+            dev->batch[n] = (uintptr_t)pp >> VIRTIO_BALLOON_PFN_SHIFT;
+        }
+
+        if (n == 0)
+            break;
+
+        vioballoon_send(dev, VIOBALLOON_INFLATEQ,
+            dev->batch, n * sizeof(uint32_t));
+
+        pie = spin_lock_irqsave(&dev->lock);
+        memcpy(balloon_pfns + balloon_cnt, dev->batch, n * sizeof(uint32_t));
+        balloon_cnt += n;
+        spin_unlock_irqrestore(&dev->lock, pie);
+
+        cnt -= n;
+    }
+}
+
+// void vioballoon_deflate(struct vioballoon_device * dev, uint32_t cnt)
+//
+// Takes /cnt/ pages back from the device and returns them to the page
+// allocator.
+
+static void vioballoon_deflate(struct vioballoon_device * dev, uint32_t cnt) {
+    uint32_t n;
+    int pie;
+
+    while (cnt != 0) {
+        pie = spin_lock_irqsave(&dev->lock);
+        n = (cnt < VIOBALLOON_BATCH) ? cnt : VIOBALLOON_BATCH;
+        if (balloon_cnt < n)
+            n = balloon_cnt;
+        balloon_cnt -= n;
+        memcpy(dev->batch, balloon_pfns + balloon_cnt, n * sizeof(uint32_t));
+        spin_unlock_irqrestore(&dev->lock, pie);
+
+        if (n == 0)
+            break;
+
+        vioballoon_send(dev, VIOBALLOON_DEFLATEQ,
+            dev->batch, n * sizeof(uint32_t));
+
+        for (uint32_t i = 0; i < n; i++) {
+            memory_free_page (
+                (void*)((uintptr_t)dev->batch[i] << VIRTIO_BALLOON_PFN_SHIFT));
+        }
+
+        cnt -= n;
+    }
+}
+
+// void vioballoon_report_oom(struct vioballoon_device * dev)
+//
+// Tells the device about pages the shrinker already returned to the page
+// allocator, VIOBALLOON_BATCH at a time, until none are left.
+
+static void vioballoon_report_oom(struct vioballoon_device * dev) {
+    uint32_t n;
+    int pie;
+
+    for (;;) {
+        pie = spin_lock_irqsave(&dev->lock);
+        n = (oom_cnt < VIOBALLOON_BATCH) ? oom_cnt : VIOBALLOON_BATCH;
+        oom_cnt -= n;
+        memcpy(dev->batch, oom_pfns + oom_cnt, n * sizeof(uint32_t));
+        spin_unlock_irqrestore(&dev->lock, pie);
+
+        if (n == 0)
+            break;
+
+        vioballoon_send(dev, VIOBALLOON_DEFLATEQ,
+            dev->batch, n * sizeof(uint32_t));
+    }
+}
+
+// void vioballoon_update_stats(struct vioballoon_device * dev)
+//
+// Fills the stats buffer from the page allocator's counters and queues it for
+// the device. The device hands it back the next time the host polls.
+
+static void vioballoon_update_stats(struct vioballoon_device * dev) {
+    struct vioballoon_virtq * const vq = &dev->vq[VIOBALLOON_STATSQ];
+    struct memory_stats mstats;
+
+    memory_get_stats(&mstats);
+
+    dev->stats[0].tag = VIRTIO_BALLOON_S_MEMFREE;
+    dev->stats[0].val = (uint64_t)mstats.free_pages * PAGE_SIZE;
+    dev->stats[1].tag = VIRTIO_BALLOON_S_MEMTOT;
+    dev->stats[1].val = (uint64_t)mstats.total_pages * PAGE_SIZE;
+    dev->stats[2].tag = VIRTIO_BALLOON_S_AVAIL;
+    dev->stats[2].val = (uint64_t)mstats.free_pages * PAGE_SIZE;
+
+    dev->stats_used_idx = vq->used.idx;
+
+    vq->desc[0].addr = (uint64_t)dev->stats;
+    vq->desc[0].len = sizeof(dev->stats);
+    vq->desc[0].flags = 0;
+    vq->avail.ring[0] = 0;
+    __sync_synchronize(); // mem barrier
+    vq->avail.idx += 1;
+    virtio_notify_avail(dev->regs, VIOBALLOON_STATSQ);
+}
+
+// void vioballoon_send (
+//      struct vioballoon_device * dev, int qid, void * buf, uint32_t len)
+//
+// Hands a device-readable buffer to the inflate or deflate queue and sleeps
+// until the device has consumed it.
+
+static void vioballoon_send (
+    struct vioballoon_device * dev, int qid, void * buf, uint32_t len)
+{
+    struct vioballoon_virtq * const vq = &dev->vq[qid];
+    uint16_t used_idx;
+    int pie;
+
+    used_idx = vq->used.idx;
+
+    vq->desc[0].addr = (uint64_t)buf;
+    vq->desc[0].len = len;
+    vq->desc[0].flags = 0;
+    vq->avail.ring[0] = 0;
+    __sync_synchronize(); // mem barrier
+    vq->avail.idx += 1;
+    virtio_notify_avail(dev->regs, qid);
+
+    pie = spin_lock_irqsave(&dev->lock);
+    while (vq->used.idx == used_idx)
+        condition_wait_spin(&dev->used_updated, &dev->lock);
+    spin_unlock_irqrestore(&dev->lock, pie);
+}
+
+// unsigned long vioballoon_shrink(struct shrinker * shr, unsigned long nr)
+//
+// Shrinker callback, only registered with VIRTIO_BALLOON_F_DEFLATE_ON_OOM.
+// Returns balloon pages to the page allocator right away; the device is told
+// later by vioballoon_work, which the spec allows for this feature.
+
+static unsigned long vioballoon_shrink(struct shrinker * shr, unsigned long nr) {
+    struct vioballoon_device * const dev = balloon_dev;
+    unsigned long freed = 0;
+    uint32_t pfn;
+    int pie;
+
+    while (freed < nr) {
+        // Every page on the oom list came out of the balloon, so the list
+        // only fills up if pages are inflated and taken back again before
+        // being reported. Should that happen, leave the page in the balloon
+        // rather than lose track of it.
+
+        pie = spin_lock_irqsave(&dev->lock);
+        if (balloon_cnt == 0 || oom_cnt == VIOBALLOON_MAX_PAGES) {
+            spin_unlock_irqrestore(&dev->lock, pie);
+            break;
+        }
+
+        pfn = balloon_pfns[--balloon_cnt];
+        oom_pfns[oom_cnt++] = pfn;
+        spin_unlock_irqrestore(&dev->lock, pie);
+
+        memory_free_page((void*)((uintptr_t)pfn << VIRTIO_BALLOON_PFN_SHIFT));
+        freed += 1;
+    }
+
+    if (freed != 0) {
+        pie = spin_lock_irqsave(&dev->lock);
+        dev->pending |= VIOBALLOON_WORK_OOM;
+        work_queue(system_wq, &dev->work);
+        spin_unlock_irqrestore(&dev->lock, pie);
+    }
+
+    return freed;
+}
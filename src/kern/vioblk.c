@@ -11,12 +11,21 @@
 #include "string.h"
 #include "thread.h"
 #include "lock.h"
+#include "spinlock.h"
+#include "timer.h"
 
 //           COMPILE-TIME PARAMETERS
 //          
 
 #define VIOBLK_IRQ_PRIO 1
 
+// A request that is not completed within this many milliseconds fails with
+// -EIO instead of waiting forever for an interrupt that may have been lost.
+
+#ifndef VIOBLK_TIMEOUT_MS
+#define VIOBLK_TIMEOUT_MS 1000
+#endif
+
 //           INTERNAL CONSTANT DEFINITIONS
 //          
 
@@ -84,6 +93,8 @@ struct vioblk_device {
     struct {
         //           signaled from ISR
         struct condition used_updated;
+        // protects used ring against ISR on another hart
+        struct spinlock lock;
 
         //           We use a simple scheme of one transaction at a time.
 
@@ -152,6 +163,11 @@ static int vioblk_setpos(struct vioblk_device * dev, const uint64_t * posptr);
 static int vioblk_getblksz (
     const struct vioblk_device * dev, uint32_t * blkszptr);
 
+// Waits for the device to complete the request last made available. Returns 0
+// on completion or -EIO on timeout.
+
+static int vioblk_wait_used(struct vioblk_device * dev);
+
 //           EXPORTED FUNCTION DEFINITIONS
 //          
 
@@ -204,6 +220,10 @@ void vioblk_attach(volatile struct virtio_mmio_regs * regs, int irqno) {
     debug("%p: virtio block device block size is %lu", regs, (long)blksz);
     //           Allocate initialize device struct
     dev = kmalloc(sizeof(struct vioblk_device) + blksz);
+    if (dev == NULL) {
+        kprintf("%p: out of memory for virtio block device\n", regs);
+        return;
+    }
     memset(dev, 0, sizeof(struct vioblk_device));
 
     lock_init(&dev->io_lock, "vioblk_io_lock");
@@ -222,9 +242,14 @@ void vioblk_attach(volatile struct virtio_mmio_regs * regs, int irqno) {
     dev->regs->queue_num = 0;
 
     condition_init(&dev->vq.used_updated, "used_updated");
+    spinlock_init(&dev->vq.lock, "vioblk.vq");
 
     dev->blkbuf = kmalloc(blksz * sizeof(char));
-    assert(dev->blkbuf != NULL);
+    if (dev->blkbuf == NULL) {
+        kprintf("%p: out of memory for virtio block device\n", regs);
+        kfree(dev);
+        return;
+    }
 
     // initialize I/O interface
     dev->io_intf.ops = &vioblk_io_ops;
@@ -414,9 +439,10 @@ long vioblk_read (
         // notify the avail ring
         virtio_notify_avail(dev->regs, 0);
 
-        uint64_t intr_state = intr_disable();
-        condition_wait(&dev->vq.used_updated);
-        intr_restore(intr_state);
+        if (vioblk_wait_used(dev) != 0) {
+            lock_release(&dev->io_lock);
+            return (total_read > 0) ? total_read : -EIO;
+        }
 
         // data cooked; copy it back
         memcpy(buf + total_read, dev->blkbuf + sector_offset, bytes_this_read);
@@ -501,9 +527,10 @@ long vioblk_write (
             // notify the avail ring
             virtio_notify_avail(dev->regs, 0);
 
-            uint64_t intr_state = intr_disable();
-            condition_wait(&dev->vq.used_updated);
-            intr_restore(intr_state);
+            if (vioblk_wait_used(dev) != 0) {
+                lock_release(&dev->io_lock);
+                return (total_written > 0) ? total_written : -EIO;
+            }
         }
 
         memcpy(dev->blkbuf + sector_offset, buf + total_written, bytes_this_write);
@@ -534,9 +561,10 @@ long vioblk_write (
         // notify the avail ring
         virtio_notify_avail(dev->regs, 0);
 
-        uint64_t intr_state = intr_disable();
-        condition_wait(&dev->vq.used_updated);
-        intr_restore(intr_state);
+        if (vioblk_wait_used(dev) != 0) {
+            lock_release(&dev->io_lock);
+            return (total_written > 0) ? total_written : -EIO;
+        }
 
         dev->pos += bytes_this_write; 
         total_written += bytes_this_write;
@@ -591,7 +619,9 @@ void vioblk_isr(int irqno, void * aux) {
 
     // handle virtqueue interrupts
     if (interrupt_status & 0x1) {
-        condition_broadcast(&dev->vq.used_updated);   
+        spin_lock(&dev->vq.lock);
+        condition_broadcast(&dev->vq.used_updated);
+        spin_unlock(&dev->vq.lock);
         // write to acknowledge register
         dev->regs->interrupt_ack = interrupt_status;
         __sync_synchronize();
@@ -675,4 +705,35 @@ int vioblk_getblksz (
 
     // success return 0
     return 0;
-}
\ No newline at end of file
+}
+
+// int vioblk_wait_used(struct vioblk_device * dev)
+//
+// Sleeps until the used ring catches up with the avail ring. Checking the ring
+// under the queue lock, which the ISR also takes, means the wakeup cannot be
+// missed even if the request completes before we go to sleep or the interrupt
+// is taken by another hart. Gives up with -EIO if the device makes no progress
+// for VIOBLK_TIMEOUT_MS. A request that completes after that is absorbed by the
+// next wait, which waits for the used ring to catch up with all requests.
+
+int vioblk_wait_used(struct vioblk_device * dev) {
+    const uint64_t timeout = VIOBLK_TIMEOUT_MS * (TIMER_FREQ / 1000);
+    int saved_intr_state;
+    int result = 0;
+
+    saved_intr_state = spin_lock_irqsave(&dev->vq.lock);
+
+    while (dev->vq.used.idx != dev->vq.avail.idx) {
+        if (condition_wait_timeout(&dev->vq.used_updated,
+            &dev->vq.lock, timeout) &&
+            dev->vq.used.idx != dev->vq.avail.idx)
+        {
+            kprintf("vioblk%d: request timed out\n", (int)dev->instno);
+            result = -EIO;
+            break;
+        }
+    }
+
+    spin_unlock_irqrestore(&dev->vq.lock, saved_intr_state);
+    return result;
+}
@@ -0,0 +1,185 @@
+// workq.c - Deferred work run by kernel worker threads
+//
+
+#ifndef TRACE
+#ifdef WORKQ_TRACE
+#define TRACE
+#endif
+#endif
+
+#ifndef DEBUG
+#ifdef WORKQ_DEBUG
+#define DEBUG
+#endif
+#endif
+
+#include "workq.h"
+
+#include "console.h"
+#include "halt.h"
+#include "heap.h"
+
+#include <stddef.h>
+
+// EXPORTED GLOBAL VARIABLE DEFINITIONS
+//
+
+struct workqueue * system_wq;
+
+// INTERNAL FUNCTION DECLARATIONS
+//
+
+// Body of a workqueue's worker thread. Does not return.
+
+static void workq_worker(void * aux);
+
+// Adds /wk/, which the caller has just marked pending, to /wq/ and wakes the
+// worker if the queue was empty.
+
+static void workq_push(struct workqueue * wq, struct work * wk);
+
+// Alarm expire function of a delayed work item. Called by the timer interrupt
+// handler.
+
+static void work_expire(struct alarm * al);
+
+// EXPORTED FUNCTION DEFINITIONS
+//
+
+void workq_init(void) {
+    system_wq = workqueue_create("workq");
+
+    if (system_wq == NULL)
+        panic("workq_init: could not create system_wq");
+}
+
+struct workqueue * workqueue_create(const char * name) {
+    struct workqueue * wq;
+
+    trace("%s(name=\"%s\")", __func__, name);
+
+    wq = kcalloc(1, sizeof(struct workqueue));
+    if (wq == NULL)
+        return NULL;
+
+    wq->name = name;
+    spinlock_init(&wq->lock, name);
+    condition_init(&wq->ready, name);
+
+    if (thread_spawn(name, workq_worker, wq) < 0) {
+        kfree(wq);
+        return NULL;
+    }
+
+    return wq;
+}
+
+void work_init(struct work * wk, void (*func)(struct work * wk)) {
+    wk->next = NULL;
+    wk->func = func;
+    wk->wq = NULL;
+    wk->pending = 0;
+    alarm_init(&wk->al, "work");
+    wk->al.expire = work_expire;
+}
+
+int work_queue(struct workqueue * wq, struct work * wk) {
+    if (__atomic_exchange_n(&wk->pending, 1, __ATOMIC_ACQ_REL))
+        return 0;
+
+    workq_push(wq, wk);
+    return 1;
+}
+
+int work_queue_delayed (
+    struct workqueue * wq, struct work * wk, uint64_t tcnt)
+{
+    if (__atomic_exchange_n(&wk->pending, 1, __ATOMIC_ACQ_REL))
+        return 0;
+
+    if (tcnt == 0) {
+        workq_push(wq, wk);
+        return 1;
+    }
+
+    wk->wq = wq;
+    alarm_arm(&wk->al, tcnt);
+    return 1;
+}
+
+int work_cancel_delayed(struct work * wk) {
+    if (!alarm_cancel(&wk->al))
+        return 0;
+
+    __atomic_store_n(&wk->pending, 0, __ATOMIC_RELEASE);
+    return 1;
+}
+
+// INTERNAL FUNCTION DEFINITIONS
+//
+
+void workq_worker(void * aux) {
+    struct workqueue * const wq = aux;
+    struct work * list;
+    struct work * todo;
+    struct work * wk;
+    int pie;
+
+    for (;;) {
+        pie = spin_lock_irqsave(&wq->lock);
+        while (wq->head == NULL)
+            condition_wait_spin(&wq->ready, &wq->lock);
+        spin_unlock_irqrestore(&wq->lock, pie);
+
+        // Take everything queued so far. The list is newest first, so reverse
+        // it to run the items in the order they were queued.
+
+        list = __atomic_exchange_n(&wq->head, NULL, __ATOMIC_ACQUIRE);
+        todo = NULL;
+
+        while (list != NULL) {
+            wk = list;
+            list = wk->next;
+            wk->next = todo;
+            todo = wk;
+        }
+
+        // Once pending is cleared the item may be queued again, which
+        // overwrites wk->next, and its function may free it.
+
+        while (todo != NULL) {
+            wk = todo;
+            todo = wk->next;
+            debug("%s: running work %p", wq->name, wk);
+            __atomic_store_n(&wk->pending, 0, __ATOMIC_RELEASE);
+            wk->func(wk);
+        }
+    }
+}
+
+void workq_push(struct workqueue * wq, struct work * wk) {
+    struct work * head;
+    int pie;
+
+    head = __atomic_load_n(&wq->head, __ATOMIC_RELAXED);
+
+    do wk->next = head;
+    while (!__atomic_compare_exchange_n(&wq->head, &head, wk,
+        1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    // The worker checks for an empty queue with wq->lock held, so taking the
+    // lock here means it is either still going to see our item or already
+    // waiting to be signaled.
+
+    if (head == NULL) {
+        pie = spin_lock_irqsave(&wq->lock);
+        condition_signal(&wq->ready);
+        spin_unlock_irqrestore(&wq->lock, pie);
+    }
+}
+
+void work_expire(struct alarm * al) {
+    struct work * const wk = (void *)al - offsetof(struct work, al);
+
+    workq_push(wk->wq, wk);
+}
@@ -0,0 +1,89 @@
+// workq.h - Deferred work run by kernel worker threads
+//
+// An ISR (or any other code that cannot sleep) hands work off to a kernel
+// thread by queueing a struct work on a workqueue. Each workqueue has one
+// worker thread, which runs the queued items in the order they were queued,
+// one at a time. Queueing pushes the item onto a lock-free list; a spinlock is
+// only taken to wake the worker when the list was empty.
+//
+// A work item can also be queued after a delay, using an alarm on the timer.c
+// sleep list.
+//
+
+#ifndef _WORKQ_H_
+#define _WORKQ_H_
+
+#include "thread.h"
+#include "timer.h"
+#include "spinlock.h"
+
+#include <stdint.h>
+
+struct workqueue {
+    struct work * volatile head; // most recently queued item first
+    struct spinlock lock; // held by the worker while checking for work
+    struct condition ready; // signaled when head becomes non-NULL
+    const char * name;
+};
+
+struct work {
+    struct work * next; // next older item on workqueue
+    void (*func)(struct work * wk);
+    struct workqueue * wq; // queue for delayed work to go to
+    struct alarm al; // delays the item in work_queue_delayed
+    volatile char pending; // queued or delayed, and not yet started
+};
+
+// EXPORTED GLOBAL VARIABLES
+//
+
+// Shared workqueue for short work items, created by workq_init.
+
+extern struct workqueue * system_wq;
+
+// EXPORTED FUNCTION DECLARATIONS
+//
+
+// void workq_init(void)
+// Creates system_wq. Must be called after thread_init and before any driver
+// queues work.
+
+extern void workq_init(void);
+
+// struct workqueue * workqueue_create(const char * name)
+// Creates a workqueue and starts its worker thread, named /name/. Work that
+// sleeps for a long time should get its own queue rather than hold up
+// system_wq. Returns NULL if out of memory.
+
+extern struct workqueue * workqueue_create(const char * name);
+
+// void work_init(struct work * wk, void (*func)(struct work * wk))
+// Initializes a work item that calls /func/ when it runs. The item is
+// typically embedded in a larger structure, which /func/ can recover from
+// /wk/.
+
+extern void work_init(struct work * wk, void (*func)(struct work * wk));
+
+// int work_queue(struct workqueue * wq, struct work * wk)
+// Queues /wk/ on /wq/. May be called from an ISR and with most spinlocks
+// held, but not sched_lock, a run queue lock or wq's own lock: waking the
+// worker takes wq->lock and then sched_lock. If /wk/ is already pending, does nothing and returns 0; otherwise returns 1.
+// The item stops being pending just before its function is called, so queueing
+// it again from there or while it runs makes it run once more.
+
+extern int work_queue(struct workqueue * wq, struct work * wk);
+
+// int work_queue_delayed(struct workqueue * wq, struct work * wk, uint64_t tcnt)
+// Like work_queue, but queues /wk/ only after /tcnt/ timer ticks.
+
+extern int work_queue_delayed (
+    struct workqueue * wq, struct work * wk, uint64_t tcnt);
+
+// int work_cancel_delayed(struct work * wk)
+// Stops /wk/ from being queued if it is still waiting for its delay to pass.
+// Returns 1 if it was, 0 if it had already been queued (or was never
+// delayed).
+
+extern int work_cancel_delayed(struct work * wk);
+
+#endif // _WORKQ_H_
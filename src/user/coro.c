@@ -0,0 +1,246 @@
+// coro.c - Coroutines (green threads) within a user thread
+//
+
+#include "coro.h"
+#include "syscall.h"
+#include "error.h"
+
+#include <stdint.h>
+
+// COMPILE-TIME PARAMETERS
+//
+
+// Parked reads are retried every CORO_POLL_SWITCHES switches, so that
+// coroutines that keep yielding do not starve the ones waiting for input.
+// When every live coroutine is parked, the thread sleeps CORO_POLL_US
+// microseconds between retries.
+
+#ifndef CORO_POLL_SWITCHES
+#define CORO_POLL_SWITCHES 64
+#endif
+
+#ifndef CORO_POLL_US
+#define CORO_POLL_US 1000
+#endif
+
+// INTERNAL GLOBAL VARIABLES
+//
+
+static struct coro main_coro = { .fp = 1 }; // the thread's own context
+static struct coro * cur = &main_coro; // running coroutine
+
+// The FP registers hold the values of fp_owner. They are only saved and
+// loaded when switching to an FP coroutine other than fp_owner, so switches
+// among integer-only coroutines never touch them. The thread's own context may
+// use FP, so it owns them to begin with.
+
+static struct coro * fp_owner = &main_coro;
+
+static struct coro * ready_head;
+static struct coro * ready_tail;
+static struct coro * parked; // waiting in coro_read, in no particular order
+
+static int nlive; // coroutines created and not yet ended
+static struct coro * runner; // waiting in coro_run for nlive to drop to 0
+static unsigned int nswitch; // switches since parked reads were last retried
+
+// INTERNAL FUNCTION DECLARATIONS
+//
+
+static void ready_push(struct coro * co);
+static struct coro * ready_pop(void);
+
+// Retries the parked reads and makes the coroutines whose read completed
+// ready.
+
+static void poll_parked(void);
+
+// Switches to the next ready coroutine, sleeping until a parked read
+// completes if there is none. The caller has already put the running
+// coroutine on a list, or is ending it.
+
+static void schedule(void);
+
+static void create (
+    struct coro * co, void (*fn)(void *), void * arg,
+    void * stack, size_t size, int fp);
+
+// IMPORTED FUNCTION DECLARATIONS
+// defined in coroasm.s
+//
+
+extern struct coro * _coro_swtch(struct coro * susp, struct coro * next);
+extern void _coro_fpsave(struct coro * co);
+extern void _coro_fpload(struct coro * co);
+
+extern void _coro_setup (
+    struct coro * co, void * sp, void (*fn)(void *), void * arg);
+
+// Called from coroasm.s when a coroutine's function returns.
+
+extern void __attribute__ ((noreturn)) _coro_exit(void);
+
+// EXPORTED FUNCTION DEFINITIONS
+//
+
+void coro_create (
+    struct coro * co, void (*fn)(void *), void * arg,
+    void * stack, size_t size)
+{
+    create(co, fn, arg, stack, size, 0);
+}
+
+void coro_create_fp (
+    struct coro * co, void (*fn)(void *), void * arg,
+    void * stack, size_t size)
+{
+    create(co, fn, arg, stack, size, 1);
+}
+
+void coro_yield(void) {
+    if (ready_head == NULL && parked == NULL)
+        return;
+
+    ready_push(cur);
+    schedule();
+}
+
+void coro_run(void) {
+    if (nlive == 0)
+        return;
+
+    runner = cur;
+    schedule();
+}
+
+long coro_read(int fd, void * buf, size_t bufsz) {
+    long result;
+
+    result = _read(fd, buf, bufsz);
+
+    if (result != -EAGAIN)
+        return result;
+
+    cur->fd = fd;
+    cur->buf = buf;
+    cur->bufsz = bufsz;
+    cur->next = parked;
+    parked = cur;
+
+    schedule();
+
+    return cur->result;
+}
+
+void _coro_exit(void) {
+    nlive -= 1;
+
+    // Nothing is left to save once the coroutine ends
+
+    if (fp_owner == cur)
+        fp_owner = NULL;
+
+    if (nlive == 0 && runner != NULL) {
+        ready_push(runner);
+        runner = NULL;
+    }
+
+    schedule();
+
+    // An ended coroutine is never on a list, so is never switched back to.
+
+    for (;;)
+        continue;
+}
+
+// INTERNAL FUNCTION DEFINITIONS
+//
+
+void create (
+    struct coro * co, void (*fn)(void *), void * arg,
+    void * stack, size_t size, int fp)
+{
+    // The stack pointer must be 16-byte aligned
+
+    const uintptr_t top = ((uintptr_t)stack + size) & ~(uintptr_t)15;
+
+    _coro_setup(co, (void *)top, fn, arg);
+    co->fp = fp;
+    nlive += 1;
+    ready_push(co);
+}
+
+void ready_push(struct coro * co) {
+    co->next = NULL;
+
+    if (ready_tail != NULL)
+        ready_tail->next = co;
+    else
+        ready_head = co;
+
+    ready_tail = co;
+}
+
+struct coro * ready_pop(void) {
+    struct coro * const co = ready_head;
+
+    if (co != NULL) {
+        ready_head = co->next;
+        if (ready_head == NULL)
+            ready_tail = NULL;
+        co->next = NULL;
+    }
+
+    return co;
+}
+
+void poll_parked(void) {
+    struct coro ** link = &parked;
+    struct coro * co;
+    long result;
+
+    nswitch = 0;
+
+    while ((co = *link) != NULL) {
+        result = _read(co->fd, co->buf, co->bufsz);
+
+        if (result == -EAGAIN) {
+            link = &co->next;
+            continue;
+        }
+
+        *link = co->next;
+        co->result = result;
+        ready_push(co);
+    }
+}
+
+void schedule(void) {
+    struct coro * const susp = cur;
+    struct coro * next;
+
+    if (parked != NULL && CORO_POLL_SWITCHES <= ++nswitch)
+        poll_parked();
+
+    while ((next = ready_pop()) == NULL) {
+        poll_parked();
+        if (ready_head == NULL)
+            _usleep(CORO_POLL_US);
+    }
+
+    if (next == susp)
+        return;
+
+    // No C code runs between here and the switch that could change the
+    // callee-saved FP registers, so they still hold fp_owner's values.
+
+    if (next->fp && fp_owner != next) {
+        if (fp_owner != NULL)
+            _coro_fpsave(fp_owner);
+        _coro_fpload(next);
+        fp_owner = next;
+    }
+
+    cur = next;
+    _coro_swtch(susp, next);
+}
@@ -0,0 +1,84 @@
+// coro.h - Coroutines (green threads) within a user thread
+//
+// Coroutines are scheduled round-robin by the thread that runs them, without
+// entering the kernel: a switch saves and restores the callee-saved registers
+// in user mode (_coro_swtch in coroasm.s). A coroutine runs until it calls
+// coro_yield, waits for input in coro_read, or returns. The kernel only sees
+// the one thread, so coroutines cost no kernel stack or thread table slot, and
+// never run in parallel with each other.
+//
+
+#ifndef _CORO_H_
+#define _CORO_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Registers saved by _coro_swtch. The integer registers match the layout of
+// struct thread_context in the kernel. The FP registers are only saved and
+// restored for coroutines created with coro_create_fp (see coro.c).
+
+struct coro_context {
+    uint64_t s[12];
+    void * ra;
+    void * sp;
+    uint64_t fs[12];
+};
+
+struct coro {
+    struct coro_context context; // must be first member (coroasm.s)
+    struct coro * next; // next coroutine on the ready or parked list
+    int fd; // pending coro_read while parked
+    void * buf;
+    size_t bufsz;
+    long result;
+    char fp; // uses the FP registers (coro_create_fp)
+};
+
+// void coro_create (
+//     struct coro * co, void (*fn)(void *), void * arg,
+//     void * stack, size_t size)
+// Sets up /co/ to run fn(arg) on the stack of /size/ bytes at /stack/, and
+// queues it behind the ready coroutines. It first runs when the calling
+// coroutine (or the thread's own context, which takes part in the round
+// robin like any other) yields. Returning from /fn/ ends the coroutine, after
+// which /co/ and its stack may be reused.
+
+extern void coro_create (
+    struct coro * co, void (*fn)(void *), void * arg,
+    void * stack, size_t size);
+
+// void coro_create_fp (
+//     struct coro * co, void (*fn)(void *), void * arg,
+//     void * stack, size_t size)
+// Like coro_create, for a coroutine that uses floating point. Coroutines
+// created with coro_create must not touch the FP registers: switching between
+// them leaves the FP registers alone, so a program that never uses FP never
+// has the kernel save FP state for it.
+
+extern void coro_create_fp (
+    struct coro * co, void (*fn)(void *), void * arg,
+    void * stack, size_t size);
+
+// void coro_yield(void)
+// Lets the other ready coroutines run, and returns when the caller's turn
+// comes around again. Returns at once if no other coroutine is ready.
+
+extern void coro_yield(void);
+
+// void coro_run(void)
+// Runs coroutines until all of them have ended. Called from the thread's own
+// context, which does not take part in the round robin meanwhile.
+
+extern void coro_run(void);
+
+// long coro_read(int fd, void * buf, size_t bufsz)
+// Like _read, but if no data is available, parks the calling coroutine until
+// there is, and lets the others run. The file or device /fd/ must have
+// nonblocking reads turned on (IOCTL_SETNBIO); otherwise a read that has to
+// wait blocks the whole thread. Parked reads are retried when no coroutine is
+// ready, and every CORO_POLL_SWITCHES switches.
+
+extern long coro_read(int fd, void * buf, size_t bufsz);
+
+#endif // _CORO_H_
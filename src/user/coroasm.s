@@ -0,0 +1,122 @@
+# coroasm.s - Context switch for coroutines (coro.c)
+#
+
+# struct coro * _coro_swtch(struct coro * susp, struct coro * next)
+
+# Saves the callee-saved integer registers of the running coroutine in /susp/
+# and resumes /next/. Returns, in /susp/, when it is switched back to, with the
+# coroutine that switched to it. Mirrors _thread_swtch in kern/thrasm.s. The FP
+# registers are left alone; coro.c moves them with _coro_fpsave and
+# _coro_fpload when an FP coroutine needs them.
+
+        .text
+        .global _coro_swtch
+        .type   _coro_swtch, @function
+_coro_swtch:
+        sd      s0, 0*8(a0)
+        sd      s1, 1*8(a0)
+        sd      s2, 2*8(a0)
+        sd      s3, 3*8(a0)
+        sd      s4, 4*8(a0)
+        sd      s5, 5*8(a0)
+        sd      s6, 6*8(a0)
+        sd      s7, 7*8(a0)
+        sd      s8, 8*8(a0)
+        sd      s9, 9*8(a0)
+        sd      s10, 10*8(a0)
+        sd      s11, 11*8(a0)
+        sd      ra, 12*8(a0)
+        sd      sp, 13*8(a0)
+
+        ld      sp, 13*8(a1)
+        ld      ra, 12*8(a1)
+        ld      s11, 11*8(a1)
+        ld      s10, 10*8(a1)
+        ld      s9, 9*8(a1)
+        ld      s8, 8*8(a1)
+        ld      s7, 7*8(a1)
+        ld      s6, 6*8(a1)
+        ld      s5, 5*8(a1)
+        ld      s4, 4*8(a1)
+        ld      s3, 3*8(a1)
+        ld      s2, 2*8(a1)
+        ld      s1, 1*8(a1)
+        ld      s0, 0*8(a1)
+
+        ret                     # a0 is still susp
+
+# void _coro_fpsave(struct coro * co)
+# void _coro_fpload(struct coro * co)
+
+# Save the callee-saved FP registers in /co/ and load them from /co/.
+
+        .global _coro_fpsave
+        .type   _coro_fpsave, @function
+_coro_fpsave:
+        fsd     fs0, 14*8(a0)
+        fsd     fs1, 15*8(a0)
+        fsd     fs2, 16*8(a0)
+        fsd     fs3, 17*8(a0)
+        fsd     fs4, 18*8(a0)
+        fsd     fs5, 19*8(a0)
+        fsd     fs6, 20*8(a0)
+        fsd     fs7, 21*8(a0)
+        fsd     fs8, 22*8(a0)
+        fsd     fs9, 23*8(a0)
+        fsd     fs10, 24*8(a0)
+        fsd     fs11, 25*8(a0)
+        ret
+
+        .global _coro_fpload
+        .type   _coro_fpload, @function
+_coro_fpload:
+        fld     fs0, 14*8(a0)
+        fld     fs1, 15*8(a0)
+        fld     fs2, 16*8(a0)
+        fld     fs3, 17*8(a0)
+        fld     fs4, 18*8(a0)
+        fld     fs5, 19*8(a0)
+        fld     fs6, 20*8(a0)
+        fld     fs7, 21*8(a0)
+        fld     fs8, 22*8(a0)
+        fld     fs9, 23*8(a0)
+        fld     fs10, 24*8(a0)
+        fld     fs11, 25*8(a0)
+        ret
+
+# void _coro_setup (
+#      struct coro * co,                in a0
+#      void * sp,                       in a1
+#      void (*fn)(void *),              in a2
+#      void * arg)                      in a3
+#
+# Sets up the initial context of a coroutine. When first switched to, it calls
+# fn(arg), and _coro_exit if /fn/ returns. The FP registers start out as
+# whatever the previous FP user left, which the C calling convention allows.
+
+        .global _coro_setup
+        .type   _coro_setup, @function
+_coro_setup:
+        sd      a1, 13*8(a0)    # Initial sp
+        sd      a2, 11*8(a0)    # s11 <- fn
+        sd      a3, 0*8(a0)     # s0 <- arg
+
+        # put address of coroutine entry glue into t0 and continue at 1f
+
+        jal     t0, 1f
+
+        # The glue code below is executed when we first switch into the new
+        # coroutine, from _coro_swtch.
+
+        la      ra, _coro_exit  # fn will return to _coro_exit
+        mv      a0, s0          # get arg from s0
+        mv      fp, sp          # frame pointer = stack pointer
+        jr      s11             # jump to fn (in s11)
+
+1:      # Execution of _coro_setup continues here
+
+        sd      t0, 12*8(a0)    # put address of above glue code into ra slot
+
+        ret
+
+        .end
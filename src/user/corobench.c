@@ -0,0 +1,90 @@
+// corobench.c - Switch cost: coroutines vs kernel threads
+//
+// Two coroutines (coro.h) pass a turn back and forth with coro_yield for
+// NCORO_SWITCH switches. Then two threads of the process (uthread.h) pass a
+// turn back and forth NTHR_ROUND times through a ucond, each round trip taking
+// two switches through the kernel. Reports the average time per switch for
+// each, in nanoseconds.
+
+#include "syscall.h"
+#include "string.h"
+#include "coro.h"
+#include "uthread.h"
+#include "rdtime.h"
+
+#define NCORO_SWITCH    20000   // coroutine switches
+#define NTHR_ROUND      200     // thread round trips
+#define STACK_SIZE      4096
+
+static void coro_player(void * arg);
+static void thread_player(void * arg);
+
+static volatile int turn; // 0 or 1: whose move it is
+static struct umutex mtx = UMUTEX_INIT;
+static struct ucond moved = UCOND_INIT;
+
+static struct coro coros[2];
+static char stacks[2][STACK_SIZE] __attribute__ ((aligned (16)));
+
+void main(void) {
+    char linebuf[96];
+    unsigned long t0, t;
+    int tid;
+
+    t0 = rdtime();
+
+    coro_create(&coros[0], coro_player, NULL, stacks[0], STACK_SIZE);
+    coro_create(&coros[1], coro_player, NULL, stacks[1], STACK_SIZE);
+    coro_run();
+
+    t = rdtime() - t0;
+    snprintf(linebuf, sizeof(linebuf),
+        "corobench: coroutine switch: %lu ns\n",
+        t * 1000 / NCORO_SWITCH / (TIMER_FREQ / 1000000));
+    _msgout(linebuf);
+
+    turn = 0;
+    t0 = rdtime();
+
+    tid = uthread_create(thread_player, (void *)1, stacks[0], STACK_SIZE);
+
+    if (tid < 0) {
+        _msgout("uthread_create failed");
+        _exit();
+    }
+
+    thread_player((void *)0);
+    uthread_join(tid);
+
+    t = rdtime() - t0;
+    snprintf(linebuf, sizeof(linebuf),
+        "corobench: thread switch: %lu ns\n",
+        t * 1000 / (2 * NTHR_ROUND) / (TIMER_FREQ / 1000000));
+    _msgout(linebuf);
+
+    _exit();
+}
+
+// Coroutines need no lock or turn variable: only one runs at a time, and with
+// two of them, each yield switches to the other.
+
+static void coro_player(void * arg) {
+    int i;
+
+    for (i = 0; i < NCORO_SWITCH / 2; i++)
+        coro_yield();
+}
+
+static void thread_player(void * arg) {
+    const int me = (int)(long)arg;
+    int i;
+
+    for (i = 0; i < NTHR_ROUND; i++) {
+        umutex_lock(&mtx);
+        while (turn != me)
+            ucond_wait(&moved, &mtx);
+        turn = 1 - me;
+        ucond_signal(&moved);
+        umutex_unlock(&mtx);
+    }
+}
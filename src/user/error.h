@@ -14,5 +14,9 @@
 #define EACCESS     8
 #define EBADFD      9
 #define EMFILE     10
+#define ENOMEM     11
+#define EAGAIN     12
+#define ETIMEDOUT  13
+#define EINTR      14
 
 #endif // _ERROR_H_
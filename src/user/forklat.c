@@ -0,0 +1,79 @@
+// forklat.c - Wake-up latency while another process forks a large image
+//
+// Forks a child that touches BLOAT_SIZE bytes of memory and then forks and
+// reaps copies of itself for FORK_SEC seconds; each fork copies the whole
+// image inside a single system call. Meanwhile the parent repeatedly sleeps
+// for a short time and measures how late it gets to run again, as the shell
+// would when woken by a keystroke. Compare a kernel built with
+// KERNEL_PREEMPT=0, where a system call runs to completion once started,
+// against the default. Run with the kernel on a single hart (NHART=1) to
+// keep the forker and the sleeper on the same CPU; the commented-out CFLAGS
+// line in kern/Makefile has both flags. The max is the number to compare:
+// without preemption it grows with BLOAT_SIZE, with it it should not.
+
+#include "syscall.h"
+#include "string.h"
+#include "rdtime.h"
+
+#define BLOAT_SIZE  (1024*1024) // memory the forker touches before forking
+#define NSAMPLE     50      // sleep/wake measurements
+#define SLEEP_US    10000   // requested sleep per measurement
+#define FORK_SEC    10      // forker gives up after this many seconds
+#define PAGE_SIZE   4096
+
+static void forker(void);
+
+static char bloat[BLOAT_SIZE];
+
+void main(void) {
+    unsigned long t0, t1, late;
+    unsigned long late_sum = 0;
+    unsigned long late_max = 0;
+    char linebuf[96];
+    int i;
+
+    if (_fork() == 0)
+        forker();
+
+    for (i = 0; i < NSAMPLE; i++) {
+        t0 = rdtime();
+        _usleep(SLEEP_US);
+        t1 = rdtime();
+
+        late = (t1 - t0) - SLEEP_US * (TIMER_FREQ / 1000000);
+        if ((long)late < 0)
+            late = 0;
+
+        late_sum += late;
+        if (late_max < late)
+            late_max = late;
+    }
+
+    snprintf(linebuf, sizeof(linebuf),
+        "forklat: %d KB forks, wake latency avg %lu us, max %lu us\n",
+        BLOAT_SIZE / 1024, late_sum / NSAMPLE / (TIMER_FREQ / 1000000),
+        late_max / (TIMER_FREQ / 1000000));
+    _msgout(linebuf);
+
+    _wait(0);
+    _exit();
+}
+
+// Touches every page of bloat so that fork has to copy it, then forks
+// children that exit right away until FORK_SEC have passed.
+
+static void forker(void) {
+    const unsigned long tend = rdtime() + FORK_SEC * TIMER_FREQ;
+    int i;
+
+    for (i = 0; i < BLOAT_SIZE; i += PAGE_SIZE)
+        bloat[i] = 1;
+
+    while (rdtime() < tend) {
+        if (_fork() == 0)
+            _exit();
+        _wait(0);
+    }
+
+    _exit();
+}
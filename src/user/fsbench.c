@@ -0,0 +1,77 @@
+// fsbench.c - Concurrent kfs read throughput
+//
+// Forks NREADER children that each open the same file and read it from start
+// to end NPASS times in BUFSZ chunks. Every read takes the kfs lock and the
+// vioblk I/O lock, so the readers contend for both. Prints the total time and
+// the aggregate read rate. Compare a kernel built with LOCK_HANDOFF=0, where
+// releasing a sleep lock wakes every waiter to contend for it, against the
+// default, where the lock is handed to the longest waiter.
+
+#include "syscall.h"
+#include "string.h"
+#include "io.h"
+#include "rdtime.h"
+
+#define NREADER     4       // concurrent readers
+#define NPASS       8       // times each reader reads the file
+#define BUFSZ       256     // bytes per read call
+#define FILENAME    "fib"   // any file in the kfs image
+
+static void reader(void);
+
+void main(void) {
+    unsigned long t0, t1, ms;
+    uint64_t len = 0;
+    char linebuf[96];
+    int i;
+
+    if (_fsopen(0, FILENAME) < 0 || _ioctl(0, IOCTL_GETLEN, &len) < 0) {
+        _msgout("fsbench: cannot open " FILENAME "\n");
+        _exit();
+    }
+
+    _close(0);
+
+    t0 = rdtime();
+
+    for (i = 0; i < NREADER; i++) {
+        if (_fork() == 0)
+            reader();
+    }
+
+    for (i = 0; i < NREADER; i++)
+        _wait(0);
+
+    t1 = rdtime();
+
+    ms = (t1 - t0) / (TIMER_FREQ / 1000);
+
+    snprintf(linebuf, sizeof(linebuf),
+        "fsbench: %d readers, %lu bytes each, %lu ms, %lu KB/s\n",
+        NREADER, (unsigned long)len * NPASS, ms,
+        (ms == 0) ? 0 : (unsigned long)len * NPASS * NREADER / ms);
+    _msgout(linebuf);
+
+    _exit();
+}
+
+static void reader(void) {
+    char buf[BUFSZ];
+    uint64_t pos;
+    int pass;
+
+    if (_fsopen(0, FILENAME) < 0) {
+        _msgout("fsbench: reader cannot open " FILENAME "\n");
+        _exit();
+    }
+
+    for (pass = 0; pass < NPASS; pass++) {
+        pos = 0;
+        _ioctl(0, IOCTL_SETPOS, &pos);
+        while (_read(0, buf, sizeof(buf)) > 0)
+            continue;
+    }
+
+    _close(0);
+    _exit();
+}
@@ -0,0 +1,91 @@
+// futexbench.c - Thread hand-off latency: futex mutex/condvar vs sleep-polling
+//
+// Two threads of one process pass a turn back and forth NROUND times. In the
+// first run each thread polls the shared turn variable, sleeping POLL_US
+// between checks; in the second it waits on a ucond (uthread.h), which sleeps
+// in the kernel until the other thread signals. Reports the average time per
+// round trip for each.
+
+#include "syscall.h"
+#include "string.h"
+#include "uthread.h"
+#include "rdtime.h"
+
+#define NROUND      200     // round trips per run
+#define POLL_US     1000    // sleep between polls
+#define STACK_SIZE  4096
+
+static unsigned long run(void (*fn)(void *));
+static void poll_player(void * arg);
+static void futex_player(void * arg);
+
+static volatile int turn; // 0 or 1: whose move it is
+static struct umutex mtx = UMUTEX_INIT;
+static struct ucond moved = UCOND_INIT;
+
+static char stack[STACK_SIZE] __attribute__ ((aligned (16)));
+
+void main(void) {
+    char linebuf[96];
+    unsigned long t;
+
+    t = run(poll_player);
+    snprintf(linebuf, sizeof(linebuf),
+        "futexbench: sleep-polling (%d us): %lu us per round trip\n",
+        POLL_US, t / NROUND / (TIMER_FREQ / 1000000));
+    _msgout(linebuf);
+
+    t = run(futex_player);
+    snprintf(linebuf, sizeof(linebuf),
+        "futexbench: futex condvar: %lu us per round trip\n",
+        t / NROUND / (TIMER_FREQ / 1000000));
+    _msgout(linebuf);
+}
+
+// Plays /fn/ as player 0 against a second thread playing it as player 1, and
+// returns the elapsed rdtime ticks.
+
+static unsigned long run(void (*fn)(void *)) {
+    unsigned long t0;
+    int tid;
+
+    turn = 0;
+    t0 = rdtime();
+
+    tid = uthread_create(fn, (void *)1, stack, sizeof(stack));
+
+    if (tid < 0) {
+        _msgout("uthread_create failed");
+        _exit();
+    }
+
+    fn((void *)0);
+    uthread_join(tid);
+
+    return rdtime() - t0;
+}
+
+static void poll_player(void * arg) {
+    const int me = (int)(long)arg;
+    int i;
+
+    for (i = 0; i < NROUND; i++) {
+        while (turn != me)
+            _usleep(POLL_US);
+        turn = 1 - me;
+    }
+}
+
+static void futex_player(void * arg) {
+    const int me = (int)(long)arg;
+    int i;
+
+    for (i = 0; i < NROUND; i++) {
+        umutex_lock(&mtx);
+        while (turn != me)
+            ucond_wait(&moved, &mtx);
+        turn = 1 - me;
+        ucond_signal(&moved);
+        umutex_unlock(&mtx);
+    }
+}
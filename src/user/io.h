@@ -69,6 +69,10 @@ struct io_term {
 //   IOCTL_FLUSH - Current not supported (do not need to implement).
 //
 //   IOCTL_GETBLKSZ - Returns the block size. Optional.
+//
+//   IOCTL_SETNBIO - Turns nonblocking reads on (*arg nonzero) or off. While it
+//   is on, a read that would have to wait for data returns -EAGAIN instead.
+//   Supported by devices whose reads can wait (e.g. UART).
 
 #define IOCTL_GETLEN        1   // arg is pointer to uint64_t
 #define IOCTL_SETLEN        2   // arg is pointer to uint64_t
@@ -76,6 +80,7 @@ struct io_term {
 #define IOCTL_SETPOS        4   // arg is pointer to uint64_t
 #define IOCTL_FLUSH         5   // arg is ignored
 #define IOCTL_GETBLKSZ      6   // arg is pointer to uint32_t
+#define IOCTL_SETNBIO       7   // arg is pointer to int
 
 // EXPORTED FUNCTION DECLARATIONS
 //
@@ -0,0 +1,83 @@
+// prule30.c - Rule 30 with computation and output in separate threads
+//
+// A second thread computes generations of the rule 30 cellular automaton into
+// a small ring of rows, while the main thread writes finished rows to the
+// serial port (fd 0). The next rows are computed while the UART is still busy
+// with earlier ones, instead of the two taking turns.
+
+#include "syscall.h"
+#include "string.h"
+#include "uthread.h"
+
+#define WIDTH       78      // cells per row
+#define NGEN        64      // generations to print
+#define NROWS       8       // rows buffered between the threads
+#define STACK_SIZE  4096    // stack of the compute thread
+#define WAIT_US     1000    // back-off while the ring is full or empty
+
+static void compute(void * arg);
+
+// Row i is in rows[i % NROWS] once nproduced > i, until nconsumed > i.
+
+static char rows[NROWS][WIDTH+2]; // cells as text, then "\r\n"
+static unsigned int nproduced; // written by compute thread only
+static unsigned int nconsumed; // written by main thread only
+
+static char stack[STACK_SIZE] __attribute__ ((aligned (16)));
+
+void main(void) {
+    unsigned int gen;
+    int tid;
+
+    tid = uthread_create(compute, NULL, stack, sizeof(stack));
+
+    if (tid < 0) {
+        _msgout("uthread_create failed");
+        _exit();
+    }
+
+    for (gen = 0; gen < NGEN; gen++) {
+        while (__atomic_load_n(&nproduced, __ATOMIC_ACQUIRE) == gen)
+            _usleep(WAIT_US);
+
+        _write(0, rows[gen % NROWS], WIDTH+2);
+        __atomic_store_n(&nconsumed, gen + 1, __ATOMIC_RELEASE);
+    }
+
+    uthread_join(tid);
+}
+
+static void compute(void * arg) {
+    char cur[WIDTH], next[WIDTH];
+    unsigned int gen;
+    char left, right;
+    char * row;
+    int i;
+
+    memset(cur, 0, sizeof(cur));
+    cur[WIDTH/2] = 1;
+
+    for (gen = 0; gen < NGEN; gen++) {
+        while (gen - __atomic_load_n(&nconsumed, __ATOMIC_ACQUIRE) == NROWS)
+            _usleep(WAIT_US);
+
+        row = rows[gen % NROWS];
+
+        for (i = 0; i < WIDTH; i++)
+            row[i] = cur[i] ? '#' : ' ';
+
+        row[WIDTH] = '\r';
+        row[WIDTH+1] = '\n';
+        __atomic_store_n(&nproduced, gen + 1, __ATOMIC_RELEASE);
+
+        // Rule 30: new cell = left XOR (cell OR right)
+
+        for (i = 0; i < WIDTH; i++) {
+            left = (i > 0) ? cur[i-1] : 0;
+            right = (i < WIDTH-1) ? cur[i+1] : 0;
+            next[i] = left ^ (cur[i] | right);
+        }
+
+        memcpy(cur, next, sizeof(cur));
+    }
+}
@@ -0,0 +1,21 @@
+// rdtime.h - Reading the RISC-V time counter from user programs
+//
+// The counter runs at TIMER_FREQ ticks per second. The kernel reads it with
+// csrr_time (kern/csr.h).
+//
+
+#ifndef _RDTIME_H_
+#define _RDTIME_H_
+
+#include "../kern/timerfreq.h"
+
+// unsigned long rdtime(void)
+// Returns the current value of the time counter.
+
+static inline unsigned long rdtime(void) {
+    unsigned long t;
+    asm volatile ("rdtime %0" : "=r"(t));
+    return t;
+}
+
+#endif // _RDTIME_H_
@@ -0,0 +1,126 @@
+// rtframe.c - Frame timing of a periodic real-time thread
+//
+// Runs an animation-style loop of NFRAME frames, FRAME_US apart, while NSPIN
+// children keep the CPUs busy: first pacing the frames with _usleep, then as
+// a real-time thread (_rtset) pacing them with _rtwait. Each frame computes a
+// rule 30 row. For both runs, reports how late frames started on average and
+// at worst, relative to a steady frame clock, and how many frames finished
+// after the end of their period (as counted by the kernel for _rtwait).
+
+#include "syscall.h"
+#include "string.h"
+#include "rdtime.h"
+
+#define NFRAME      100     // frames per run
+#define FRAME_US    20000   // frame period
+#define BUDGET_US   5000    // CPU time reserved per frame
+#define NSPIN       2       // CPU-bound children
+#define WIDTH       64      // rule 30 cells per row
+
+static void run(int rt);
+static void frame(void);
+static void spinner(unsigned long tend);
+
+static char cells[2][WIDTH];
+
+void main(void) {
+    unsigned long tend;
+    int i;
+
+    // The spinners outlast both runs, with a second to spare.
+
+    tend = rdtime() +
+        (2 * NFRAME * FRAME_US / 1000000 + 1) * TIMER_FREQ;
+
+    for (i = 0; i < NSPIN; i++) {
+        if (_fork() == 0)
+            spinner(tend);
+    }
+
+    cells[0][WIDTH/2] = 1;
+
+    run(0);
+    run(1);
+
+    for (i = 0; i < NSPIN; i++)
+        _wait(0);
+
+    _exit();
+}
+
+static void run(int rt) {
+    const unsigned long period = FRAME_US * (TIMER_FREQ / 1000000);
+    unsigned long t0, next, now, late;
+    unsigned long late_sum = 0;
+    unsigned long late_max = 0;
+    char linebuf[96];
+    int misses = 0;
+    int i;
+
+    if (rt && _rtset(FRAME_US, BUDGET_US) < 0) {
+        _msgout("rtframe: _rtset failed");
+        return;
+    }
+
+    t0 = rdtime();
+
+    for (i = 0; i < NFRAME; i++) {
+        late = rdtime() - (t0 + i * period);
+        if ((long)late < 0)
+            late = 0;
+
+        late_sum += late;
+        if (late_max < late)
+            late_max = late;
+
+        frame();
+
+        if (rt) {
+            misses += _rtwait();
+            continue;
+        }
+
+        next = t0 + (i + 1) * period;
+        now = rdtime();
+
+        if (now < next)
+            _usleep((next - now) / (TIMER_FREQ / 1000000));
+        else
+            misses += 1;
+    }
+
+    if (rt)
+        _rtset(0, 0);
+
+    snprintf(linebuf, sizeof(linebuf),
+        "rtframe: %s: frame start late avg %lu us, max %lu us, %d misses\n",
+        rt ? "_rtwait" : "_usleep",
+        late_sum / NFRAME / (TIMER_FREQ / 1000000),
+        late_max / (TIMER_FREQ / 1000000), misses);
+    _msgout(linebuf);
+}
+
+// Computes the next rule 30 row from the current one.
+
+static void frame(void) {
+    static int cur;
+    const char * const row = cells[cur];
+    char * const next = cells[1-cur];
+    int l, r;
+    int i;
+
+    for (i = 0; i < WIDTH; i++) {
+        l = row[(i + WIDTH - 1) % WIDTH];
+        r = row[(i + 1) % WIDTH];
+        next[i] = l ^ (row[i] | r);
+    }
+
+    cur = 1 - cur;
+}
+
+static void spinner(unsigned long tend) {
+    while (rdtime() < tend)
+        continue;
+
+    _exit();
+}
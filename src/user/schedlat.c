@@ -0,0 +1,70 @@
+// schedlat.c - Wake-up latency under CPU load
+//
+// Forks NSPIN CPU-bound children, then repeatedly sleeps for a short time and
+// measures how late it gets to run again. An interactive program (such as the
+// shell waiting for a keystroke) sees about the same delay between its wake-up
+// and getting the CPU. Compare a kernel built with SCHED_POLICY=SCHED_FIFO
+// against the default MLFQ scheduler, and one built with WAKE_HANDOFF_MAX=0,
+// where a thread woken by the timer interrupt waits its turn in the run queue,
+// against the default.
+
+#include "syscall.h"
+#include "string.h"
+#include "rdtime.h"
+
+#define NSPIN       3       // CPU-bound children
+#define NSAMPLE     50      // sleep/wake measurements
+#define SLEEP_US    10000   // requested sleep per measurement
+#define SPIN_SEC    30      // children give up after this many seconds
+
+static void spin(void);
+
+void main(void) {
+    unsigned long t0, t1, late;
+    unsigned long late_sum = 0;
+    unsigned long late_max = 0;
+    char linebuf[96];
+    int i;
+
+    for (i = 0; i < NSPIN; i++) {
+        if (_fork() == 0)
+            spin();
+    }
+
+    for (i = 0; i < NSAMPLE; i++) {
+        t0 = rdtime();
+        _usleep(SLEEP_US);
+        t1 = rdtime();
+
+        late = (t1 - t0) - SLEEP_US * (TIMER_FREQ / 1000000);
+        if ((long)late < 0)
+            late = 0;
+        
+        late_sum += late;
+        if (late_max < late)
+            late_max = late;
+    }
+
+    snprintf(linebuf, sizeof(linebuf),
+        "schedlat: %d spinners, wake latency avg %lu us, max %lu us\n",
+        NSPIN, late_sum / NSAMPLE / (TIMER_FREQ / 1000000),
+        late_max / (TIMER_FREQ / 1000000));
+    _msgout(linebuf);
+
+    for (i = 0; i < NSPIN; i++)
+        _wait(0);
+
+    _exit();
+}
+
+// Burns CPU until SPIN_SEC have passed, then exits.
+
+static void spin(void) {
+    const unsigned long tend = rdtime() + SPIN_SEC * TIMER_FREQ;
+    volatile unsigned long n = 0;
+
+    while (rdtime() < tend)
+        n++;
+
+    _exit();
+}
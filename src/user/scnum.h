@@ -26,6 +26,12 @@
 #define SYSCALL_NUMPROGS    44
 #define SYSCALL_PROCS       45
 #define SYSCALL_SIGNAL      46
+#define SYSCALL_GETRUSAGE   47
+#define SYSCALL_THRCREATE   48
+#define SYSCALL_FUTEX_WAIT  49
+#define SYSCALL_FUTEX_WAKE  50
+#define SYSCALL_RTSET       51
+#define SYSCALL_RTWAIT      52
 
 
 #endif // _SCNUM_H_
@@ -3,9 +3,11 @@
 #include "syscall.h"
 #include "string.h"
 #include "io.h"
+#include "rdtime.h"
 #include "../kern/kfs.h"
 #include "../kern/process.h"
 #include "../kern/signals.h"
+#include "../kern/rusage.h"
 
 // constants
 #define MAX_INPUT 64
@@ -27,6 +29,7 @@ void save_to_history(const char * input);
 void tokenize_input(char * input_copy, char *argv[], int *argc);
 void list_programs(int num_programs);
 int run_program(char *program);
+int time_program(char *program);
 void print_help();
 void execute_command(int argc, char *argv[]);
 void list_processes();
@@ -346,6 +349,7 @@ void execute_command(int argc, char *argv[]) {
     // commands to include:
     //      list: lists all of the currently loaded user programs
     //      run: runs the specified user program
+    //      time: runs a program and reports the CPU time it used
     //      help: shows the help menu
     //      exit: exits out of terminal
     //      clear: clears terminal
@@ -370,6 +374,20 @@ void execute_command(int argc, char *argv[]) {
 
             _write(0, "\r\n", 2);
         }
+    } else if (strcmp(argv[0], "time") == 0) {
+        if (argc != 2) {
+            _write(0, "\r\n", 2);
+            _write(0, "usage: time <program>\r\n", sizeof("usage: time <program>\r\n"));
+            return;
+        }
+
+        result = time_program(argv[1]);
+
+        if (result < 0) {
+            _write(0, "failed to run program", sizeof("failed to run program"));
+        }
+
+        _write(0, "\r\n", 2);
     } else if (strcmp(argv[0], "help") == 0) {
         // list commands, what they do, and how they're used
         print_help();
@@ -563,11 +581,74 @@ int run_program(char *program) {
 
 
 
+/**
+ * this function runs the program inputted in the foreground and prints how
+ * long it took
+ * 
+ * the program shares the shell's console. its user and system times are the
+ * growth of the shell's RUSAGE_CHILDREN usage while waiting for it; a
+ * program started with run that exits in the meantime is counted as well
+ * 
+ * @param program       name of the program to run
+ * 
+ * @return              returns 0 on success and negative value on failure
+ */
+int time_program(char *program) {
+    struct rusage before, after;
+    unsigned long t0, t1;
+    char line[96];
+    int len;
+    int result;
+
+    _getrusage(RUSAGE_CHILDREN, &before);
+    t0 = rdtime();
+
+    result = _fork();
+
+    if (result < 0) {
+        return result;
+    } else if (result == 0) {
+        // ------------------------
+        // child process
+        // ------------------------
+
+        if (_fsopen(2, program) < 0) {
+            _msgout("_fsopen failed");
+            _exit();
+        }
+
+        _exec(2);
+        _exit();
+    }
+
+    // wait for this child only, not whichever child exits first
+    _wait(result);
+
+    t1 = rdtime();
+    _getrusage(RUSAGE_CHILDREN, &after);
+
+    len = snprintf(line, sizeof(line),
+        "\r\nreal %lu.%03lus  user %lu.%03lus  sys %lu.%03lus",
+        (t1 - t0) / TIMER_FREQ, (t1 - t0) % TIMER_FREQ / (TIMER_FREQ / 1000),
+        (after.ru_utime - before.ru_utime) / 1000000,
+        (after.ru_utime - before.ru_utime) % 1000000 / 1000,
+        (after.ru_stime - before.ru_stime) / 1000000,
+        (after.ru_stime - before.ru_stime) % 1000000 / 1000);
+
+    _write(0, line, len);
+    return 0;
+}
+
+
+
+
+
 void print_help() {
     _write(0, "\r\n", sizeof("\r\n"));
     _write(0, "Supported commands:\r\n", sizeof("Supported commands:\r\n"));
     _write(0, " - list: List runnable programs\r\n", sizeof(" - list: List runnable programs\r\n"));
     _write(0, " - run <program>: Run a program\r\n", sizeof(" - run <program>: Run a program\r\n"));
+    _write(0, " - time <program>: Run a program and time it\r\n", sizeof(" - time <program>: Run a program and time it\r\n"));
     _write(0, " - clear: Clear the screen\r\n", sizeof(" - clear: Clear the screen\r\n"));
     _write(0, " - exit: Exit the shell\r\n", sizeof(" - exit: Exit the shell\r\n"));
     _write(0, " - help: Display this help message\r\n", sizeof(" - help: Display this help message\r\n"));
@@ -0,0 +1,53 @@
+// smpscale.c - CPU-bound throughput with increasing process count
+//
+// For n = 1 .. NMAX, forks n children that each compute the same recursive
+// Fibonacci number and reports how long it takes for all of them to finish.
+// With the kernel running on H harts (make run SMP=H), the elapsed time should
+// stay roughly flat up to n = H and grow linearly beyond that; on a single hart
+// it grows linearly from the start.
+
+#include "syscall.h"
+#include "string.h"
+#include "rdtime.h"
+
+#define NMAX        4       // largest number of concurrent workers
+#define FIBN        27      // work done by each worker
+
+static unsigned long fib(unsigned int n);
+
+void main(void) {
+    unsigned long t0, t1;
+    char linebuf[96];
+    int n, i;
+
+    for (n = 1; n <= NMAX; n++) {
+        t0 = rdtime();
+
+        for (i = 0; i < n; i++) {
+            if (_fork() == 0) {
+                fib(FIBN);
+                _exit();
+            }
+        }
+
+        for (i = 0; i < n; i++)
+            _wait(0);
+
+        t1 = rdtime();
+
+        snprintf(linebuf, sizeof(linebuf),
+            "smpscale: %d worker%s, fib(%d) each, %lu ms\n",
+            n, (n == 1) ? "" : "s", FIBN,
+            (t1 - t0) / (TIMER_FREQ / 1000));
+        _msgout(linebuf);
+    }
+
+    _exit();
+}
+
+static unsigned long fib(unsigned int n) {
+    if (n < 2)
+        return n;
+    else
+        return fib(n-1) + fib(n-2);
+}
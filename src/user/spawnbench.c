@@ -0,0 +1,64 @@
+// spawnbench.c - Thread and process creation rate
+//
+// Creates and joins NTHREAD threads one after another (uthread_create), then
+// forks and waits for NFORK children that exit right away, and reports the
+// average time per creation for each. Every thread created gets a struct
+// thread and a kernel stack; compare a kernel built with KSTACK_CACHE_MAX=0,
+// which maps and clears a fresh stack every time, against the default.
+
+#include "syscall.h"
+#include "string.h"
+#include "uthread.h"
+#include "rdtime.h"
+
+#define NTHREAD     500     // threads created and joined
+#define NFORK       100     // children forked and waited for
+#define STACK_SIZE  4096
+
+static void nop(void * arg);
+
+static char stack[STACK_SIZE] __attribute__ ((aligned (16)));
+
+void main(void) {
+    unsigned long t0, t;
+    char linebuf[96];
+    int tid;
+    int i;
+
+    t0 = rdtime();
+
+    for (i = 0; i < NTHREAD; i++) {
+        tid = uthread_create(nop, NULL, stack, sizeof(stack));
+
+        if (tid < 0) {
+            _msgout("uthread_create failed");
+            _exit();
+        }
+
+        uthread_join(tid);
+    }
+
+    t = rdtime() - t0;
+    snprintf(linebuf, sizeof(linebuf),
+        "spawnbench: thread create+join: %lu us each\n",
+        t / NTHREAD / (TIMER_FREQ / 1000000));
+    _msgout(linebuf);
+
+    t0 = rdtime();
+
+    for (i = 0; i < NFORK; i++) {
+        if (_fork() == 0)
+            _exit();
+        _wait(0);
+    }
+
+    t = rdtime() - t0;
+    snprintf(linebuf, sizeof(linebuf),
+        "spawnbench: fork+exit+wait: %lu us each\n",
+        t / NFORK / (TIMER_FREQ / 1000000));
+    _msgout(linebuf);
+
+    _exit();
+}
+
+static void nop(void * arg) { }
@@ -8,4 +8,15 @@
 _start:
         la      ra, _exit
         j       main
+
+# Entry point of threads created by uthread_create. The kernel starts us with
+# the thread function in a0 and its argument in a1.
+
+        .global _uthread_start
+        .type   _uthread_start, @function
+_uthread_start:
+        mv      t0, a0
+        mv      a0, a1
+        la      ra, _exit
+        jr      t0
         .end
@@ -6,6 +6,8 @@
 
 #include <stddef.h>
 
+struct rusage; // see kern/rusage.h
+
 extern void __attribute__ ((noreturn)) _exit(void);
 extern void _msgout(const char * msg);
 extern int _close(int fd);
@@ -23,5 +25,11 @@ extern int _getnumprogs(void * arg);
 extern int _getprognames(void * arg);
 extern int _getprocs(int * pids, char * names);
 extern int _signal(int pid, int sig);
+extern int _getrusage(int who, struct rusage * ru);
+extern int _thrcreate(void * upc, void * usp, void * a0, void * a1);
+extern int _futex_wait(int * uaddr, int val, unsigned long timeout_us);
+extern int _futex_wake(int * uaddr, int cnt);
+extern int _rtset(unsigned long period_us, unsigned long budget_us);
+extern int _rtwait(void);
 
 #endif // _SYSCALL_H_
@@ -0,0 +1,28 @@
+// tracedump.c - Dump the kernel scheduler trace
+//
+// Copies the "trace" device to fd 0 (the console of the shell that started
+// us). Capture the output on the host and convert it with
+// src/util/trace2chrome.py to view it in chrome://tracing or Perfetto.
+
+#include "syscall.h"
+#include "string.h"
+
+void main(void) {
+    char buf[256];
+    long n;
+
+    if (_devopen(1, "trace", 0) < 0) {
+        _msgout("tracedump: cannot open trace device\n");
+        _exit();
+    }
+
+    _write(0, "--- schedtrace begin ---\n", 25);
+
+    while ((n = _read(1, buf, sizeof(buf))) > 0)
+        _write(0, buf, n);
+
+    _write(0, "--- schedtrace end ---\n", 23);
+
+    _close(1);
+    _exit();
+}
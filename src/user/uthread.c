@@ -0,0 +1,73 @@
+// uthread.c - Threads within a user process
+//
+
+#include "uthread.h"
+#include "syscall.h"
+
+#include <limits.h>
+#include <stdint.h>
+
+extern void _uthread_start(void); // start.s
+
+int uthread_create(void (*fn)(void *), void * arg, void * stack, size_t size) {
+    // The stack pointer must be 16-byte aligned
+
+    const uintptr_t top = ((uintptr_t)stack + size) & ~(uintptr_t)15;
+
+    return _thrcreate((void *)_uthread_start, (void *)top, (void *)fn, arg);
+}
+
+int uthread_join(int tid) {
+    return _wait(tid);
+}
+
+void umutex_lock(struct umutex * mtx) {
+    int c = 0;
+
+    if (__atomic_compare_exchange_n(&mtx->state, &c, 1,
+        0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+    {
+        return;
+    }
+
+    // Contended: mark the mutex as waited for, so that the owner wakes us when
+    // it unlocks, and sleep until we find it unlocked.
+
+    if (c != 2)
+        c = __atomic_exchange_n(&mtx->state, 2, __ATOMIC_ACQUIRE);
+
+    while (c != 0) {
+        _futex_wait(&mtx->state, 2, 0);
+        c = __atomic_exchange_n(&mtx->state, 2, __ATOMIC_ACQUIRE);
+    }
+}
+
+void umutex_unlock(struct umutex * mtx) {
+    if (__atomic_exchange_n(&mtx->state, 0, __ATOMIC_RELEASE) == 2)
+        _futex_wake(&mtx->state, 1);
+}
+
+void ucond_wait(struct ucond * cv, struct umutex * mtx) {
+    const int seq = __atomic_load_n(&cv->seq, __ATOMIC_RELAXED);
+
+    // A signal after we read seq changes it, so _futex_wait returns at once.
+
+    umutex_unlock(mtx);
+    _futex_wait(&cv->seq, seq, 0);
+
+    // Other threads may have been woken along with us, so take the mutex as
+    // contended.
+
+    while (__atomic_exchange_n(&mtx->state, 2, __ATOMIC_ACQUIRE) != 0)
+        _futex_wait(&mtx->state, 2, 0);
+}
+
+void ucond_signal(struct ucond * cv) {
+    __atomic_add_fetch(&cv->seq, 1, __ATOMIC_RELEASE);
+    _futex_wake(&cv->seq, 1);
+}
+
+void ucond_broadcast(struct ucond * cv) {
+    __atomic_add_fetch(&cv->seq, 1, __ATOMIC_RELEASE);
+    _futex_wake(&cv->seq, INT_MAX);
+}
@@ -0,0 +1,66 @@
+// uthread.h - Threads within a user process
+//
+
+#ifndef _UTHREAD_H_
+#define _UTHREAD_H_
+
+#include <stddef.h>
+
+// int uthread_create(void (*fn)(void *), void * arg, void * stack, size_t size)
+// Starts a thread in the calling process that runs fn(arg) on the stack of
+// /size/ bytes at /stack/. The thread shares the process's memory and open
+// files. Returning from /fn/ ends the thread, as does calling _exit from it.
+// When the main thread (the one that started the process) calls _exit, the
+// whole process ends, once its other threads have been made to exit. A thread
+// in U mode or sleeping in _futex_wait exits at once; one blocked in any other
+// system call (a blocking _read, _usleep, _wait) only exits when that call
+// returns, and until then the process, and a parent waiting for it, wait too.
+// Returns the thread id or a negative error code.
+
+extern int uthread_create (
+    void (*fn)(void *), void * arg, void * stack, size_t size);
+
+// int uthread_join(int tid)
+// Waits for thread /tid/, which must have been created by the calling thread,
+// to end.
+
+extern int uthread_join(int tid);
+
+// A mutex and a condition variable for threads of one process. Both sleep in
+// the kernel (_futex_wait) when they have to wait, and are initialized to all
+// zeroes.
+
+struct umutex {
+    int state; // 0 unlocked, 1 locked, 2 locked and maybe waited for
+};
+
+struct ucond {
+    int seq; // incremented by every signal and broadcast
+};
+
+#define UMUTEX_INIT { .state = 0 }
+#define UCOND_INIT  { .seq = 0 }
+
+// void umutex_lock(struct umutex * mtx)
+// void umutex_unlock(struct umutex * mtx)
+// Acquire and release a mutex. Unlocking only enters the kernel if another
+// thread may be waiting.
+
+extern void umutex_lock(struct umutex * mtx);
+extern void umutex_unlock(struct umutex * mtx);
+
+// void ucond_wait(struct ucond * cv, struct umutex * mtx)
+// Releases /mtx/, which the caller holds, waits for /cv/ to be signaled, and
+// acquires /mtx/ again. May return without a signal, so the caller must check
+// its condition in a loop.
+
+extern void ucond_wait(struct ucond * cv, struct umutex * mtx);
+
+// void ucond_signal(struct ucond * cv)
+// void ucond_broadcast(struct ucond * cv)
+// Wake one or all threads waiting on /cv/.
+
+extern void ucond_signal(struct ucond * cv);
+extern void ucond_broadcast(struct ucond * cv);
+
+#endif // _UTHREAD_H_
@@ -0,0 +1,118 @@
+#!/usr/bin/env python3
+# trace2chrome.py - Convert a kernel scheduler trace to Chrome trace format
+#
+# Usage: trace2chrome.py [console.log] > trace.json
+#
+# Reads the output of the tracedump user program (lines of the form
+# "<rdtime> <hart> <event> <tid> <arg>", see kern/schedtrace.h) from a file or
+# stdin, ignoring any other console output, and writes a JSON trace that can
+# be loaded in chrome://tracing or https://ui.perfetto.dev. Each hart is shown
+# as a process with two tracks: the threads it ran, and the interrupts it took.
+# Wakeups and blocking waits are shown as instant events.
+
+import json
+import sys
+
+TIMER_FREQ = 10000000  # rdtime ticks per second (QEMU virt)
+
+# enum thread_state in kern/thread.c
+STATE_NAMES = ["uninitialized", "stopped", "waiting", "running", "ready",
+               "exited"]
+
+IRQ_NAMES = {1: "ssi", 5: "timer", 9: "external"}
+
+THREAD_TRACK = 0
+IRQ_TRACK = 1
+
+
+def usec(ticks):
+    return ticks * 1000000 / TIMER_FREQ
+
+
+def parse(lines):
+    events = []
+    for line in lines:
+        fields = line.strip().split(None, 4)
+        if len(fields) != 5 or not fields[0].isdigit():
+            continue
+        try:
+            time, hart, tid = int(fields[0]), int(fields[1]), int(fields[3])
+        except ValueError:
+            continue
+        events.append((time, hart, fields[2], tid, fields[4]))
+    events.sort(key=lambda ev: ev[0])
+    return events
+
+
+def convert(events):
+    out = []
+    running = {}  # hart -> (start time, tid, name)
+    in_irq = {}  # hart -> (start time, code)
+    harts = set()
+    t0 = events[0][0] if events else 0
+
+    for time, hart, kind, tid, arg in events:
+        ts = usec(time - t0)
+        harts.add(hart)
+
+        if kind == "in":
+            running[hart] = (ts, tid, arg)
+        elif kind == "out":
+            if hart in running:
+                start, rtid, name = running.pop(hart)
+                state = int(arg)
+                out.append({
+                    "name": "%s:%d" % (name, rtid), "ph": "X",
+                    "pid": hart, "tid": THREAD_TRACK,
+                    "ts": start, "dur": ts - start,
+                    "args": {"tid": rtid, "left as":
+                             STATE_NAMES[state]
+                             if 0 <= state < len(STATE_NAMES) else arg}})
+        elif kind == "irq":
+            in_irq[hart] = (ts, int(arg))
+        elif kind == "iret":
+            if hart in in_irq:
+                start, code = in_irq.pop(hart)
+                out.append({
+                    "name": IRQ_NAMES.get(code, "irq %d" % code), "ph": "X",
+                    "pid": hart, "tid": IRQ_TRACK,
+                    "ts": start, "dur": ts - start,
+                    "args": {"interrupted tid": tid}})
+        elif kind == "wake":
+            out.append({
+                "name": "wake %d" % tid, "ph": "i", "s": "p",
+                "pid": hart, "tid": THREAD_TRACK, "ts": ts,
+                "args": {"woken": tid, "by": int(arg)}})
+        elif kind == "block":
+            out.append({
+                "name": "block on %s" % arg, "ph": "i", "s": "t",
+                "pid": hart, "tid": THREAD_TRACK, "ts": ts,
+                "args": {"tid": tid, "condition": arg}})
+
+    for hart in sorted(harts):
+        out.append({"name": "process_name", "ph": "M", "pid": hart,
+                    "args": {"name": "hart %d" % hart}})
+        out.append({"name": "thread_name", "ph": "M", "pid": hart,
+                    "tid": THREAD_TRACK, "args": {"name": "threads"}})
+        out.append({"name": "thread_name", "ph": "M", "pid": hart,
+                    "tid": IRQ_TRACK, "args": {"name": "interrupts"}})
+
+    return {"traceEvents": out, "displayTimeUnit": "ms"}
+
+
+def main():
+    if len(sys.argv) > 2:
+        sys.exit("usage: %s [console.log]" % sys.argv[0])
+
+    if len(sys.argv) == 2:
+        with open(sys.argv[1], errors="replace") as f:
+            lines = f.readlines()
+    else:
+        lines = sys.stdin.readlines()
+
+    json.dump(convert(parse(lines)), sys.stdout)
+    sys.stdout.write("\n")
+
+
+if __name__ == "__main__":
+    main()